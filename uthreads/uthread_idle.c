@@ -6,26 +6,62 @@
  *
  */
 
-#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "uthread.h"
 #include "uthread_private.h"
 
 
+/*
+ * uthread_idle_can_wake
+ *
+ * while no uthread is running, the only thing that can make one
+ * runnable is a signal handler the application installed (uthread_wake()
+ * is otherwise only called by running threads). returns whether any
+ * signal that is not blocked in mask has such a handler.
+ */
+static int
+uthread_idle_can_wake(const sigset_t *mask)
+{
+    struct sigaction sa;
+    int sig;
+
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sigismember(mask, sig) || sigaction(sig, NULL, &sa) < 0)
+            continue;
+        if (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)
+            return 1;
+    }
+    return 0;
+}
+
+
 /*
  * uthread_idle
  *
- * right now we just call linux's yield() function.
- * note that we cannot make system calls here, since it
- * is called from uthread_switch().
+ * called by uthread_switch() when there are no runnable threads.
+ * sleeps in sigsuspend() until a signal arrives, since only a signal
+ * handler can make a thread runnable now. signals are blocked while
+ * we look at the run queue, so one that arrives just before we sleep
+ * is not missed. if no signal is handled, every thread is blocked for
+ * good: that is a deadlock, and we abort.
  */
 void
 uthread_idle(void)
 {
-#if defined(__linux__) && defined(__i386)	
-    sched_yield();
-#else
-    /* solaris */
-    yield();
-#endif    
+    sigset_t all, old;
+
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+    if (uthread_runq_empty()) {
+        if (!uthread_idle_can_wake(&old)) {
+            fprintf(stderr, "uthreads: deadlock: every thread is blocked "
+                    "and no signal handler could wake one\n");
+            abort();
+        }
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
 }
@@ -25,6 +25,12 @@ void uthread_sched_init(void);
 void uthread_switch(void);
 
 
+/*
+ * returns whether no thread is runnable.
+ */
+int uthread_runq_empty(void);
+
+
 /*
  * "idle" the "cpu".
  * see comment above uthread_switch()
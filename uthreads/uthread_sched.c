@@ -129,6 +129,23 @@ uthread_setprio(uthread_id_t id, int prio)
 /* ----------- private code -- */
 
 
+/*
+ * uthread_runq_empty()
+ *
+ * Returns whether no thread is runnable.
+ */
+int
+uthread_runq_empty(void)
+{
+        int i;
+
+        for (i = 0; i <= UTH_MAXPRIO; i++) {
+            if (!utqueue_empty(&runq_table[i]))
+                return 0;
+        }
+        return 1;
+}
+
 /*
  * uthread_switch()
  *
@@ -139,9 +156,9 @@ uthread_setprio(uthread_id_t id, int prio)
  * it is okay to switch back to the calling thread if it is the highest
  * priority runnable thread.
  *
- * Every time uthread_switch() is called, uthread_idle() should be called at
- * least once.  In addition, when there are no runnable threads, you should
- * repeatedly call uthread_idle() until there are runnable threads.  Threads
+ * When there are no runnable threads, uthread_idle() is called repeatedly
+ * until there are; it sleeps until a signal arrives, and aborts if nothing
+ * could ever make a thread runnable again.  Threads
  * with numerically higher priorities run first. For example, a thread with
  * priority 8 will run before one with priority 3.
  * */
@@ -162,7 +179,6 @@ uthread_switch(void)
                 //wont add to the runnable queue
         }
         
-        uthread_idle();
         while(1){
         //get the next runnable thread.
         //from highest priority queue to low priority queue
@@ -192,7 +208,6 @@ uthread_switch(void)
             return;
         }
         //no runnable threads
-        //TODO: Rewrtie uthread_idle
         else{
             uthread_idle();
         }
@@ -0,0 +1,449 @@
+/*
+ * Request queues in front of block devices.
+ *
+ * The block device entry points are synchronous: read_block and
+ * write_block keep the calling thread until the transfer is done, so each
+ * thread doing I/O waits for its own requests one at a time, in whatever
+ * order the threads happen to run. Here requests are instead queued per
+ * device and carried out by a single thread, blockqd, while the callers
+ * sleep until theirs completes. That lets requests from different threads
+ * be reordered and combined:
+ *
+ * - Pending requests are kept sorted by block, and blockqd sweeps across
+ *   the disk in one direction, from wherever the last request ended,
+ *   starting again from the lowest block when it reaches the top.
+ *
+ * - Requests for the same direction that carry on where the one being
+ *   carried out stops are merged into it (up to BLOCKQ_MAX_BLOCKS blocks),
+ *   through a bounce buffer if their buffers are not contiguous.
+ *
+ * - So that the sweep does not starve anyone, a request that has waited
+ *   for more than BLOCKQ_READ_EXPIRE (reads) or BLOCKQ_WRITE_EXPIRE
+ *   (writes) other requests goes next. There is no clock here, so time is
+ *   counted in requests carried out.
+ *
+ * A request that overlaps one that is already queued waits for that one
+ * to complete before it is queued itself, so requests for the same block
+ * are carried out in the order they were submitted. If blockq_shutdown()
+ * is called while it waits, it is carried out by its submitter once the
+ * overlapping request completes, like any request submitted after that.
+ *
+ * Until blockqd is running, and after blockq_shutdown(), requests are
+ * carried out right away by the thread that submits them.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+#include "config.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/blockq.h"
+
+typedef struct blockq {
+        blockdev_t     *bq_bdev;
+        list_t          bq_sorted;      /* pending requests, by block */
+        list_t          bq_fifo[2];     /* pending reads/writes, oldest first */
+        uint32_t        bq_npending;
+        blocknum_t      bq_head;        /* where the last request ended */
+        uint32_t        bq_seq;         /* requests carried out */
+
+        uint32_t        bq_nsubmitted;
+        uint32_t        bq_nmerged;     /* requests merged into another */
+        uint32_t        bq_nexpired;    /* served early for their deadline */
+        uint32_t        bq_nbounced;    /* merges that needed a bounce buffer */
+        uint32_t        bq_maxdepth;
+        uint32_t        bq_maxwait;     /* in requests carried out */
+
+        list_link_t     bq_link;        /* on blockq_list */
+} blockq_t;
+
+static list_t blockq_list;
+static uint32_t blockq_nsync = 0;       /* carried out by the submitter */
+
+static proc_t *blockqd = NULL;
+static kthread_t *blockqd_thr = NULL;
+static ktqueue_t blockqd_waitq;
+
+static void *blockqd_run(int arg1, void *arg2);
+
+void
+bio_init(bio_t *bio, blockdev_t *bdev, int write, blocknum_t block,
+         size_t count, char *buf)
+{
+        KASSERT(NULL != bdev);
+        KASSERT(0 < count);
+        KASSERT(PAGE_ALIGNED(buf));
+
+        bio->bio_bdev = bdev;
+        bio->bio_write = write;
+        bio->bio_block = block;
+        bio->bio_count = count;
+        bio->bio_buf = buf;
+        bio->bio_done = NULL;
+        bio->bio_private = NULL;
+        bio->bio_status = 0;
+        bio->bio_complete = 0;
+        sched_queue_init(&bio->bio_waitq);
+        list_link_init(&bio->bio_link);
+        list_link_init(&bio->bio_flink);
+}
+
+static int
+blockq_issue(blockdev_t *bdev, int write, char *buf, blocknum_t block, size_t count)
+{
+        if (write)
+                return bdev->bd_ops->write_block(bdev, buf, block, count);
+        return bdev->bd_ops->read_block(bdev, buf, block, count);
+}
+
+static void
+blockq_complete(bio_t *bio, int status)
+{
+        bio->bio_status = status;
+        bio->bio_complete = 1;
+        sched_broadcast_on(&bio->bio_waitq);
+        if (NULL != bio->bio_done)
+                bio->bio_done(bio);
+}
+
+/* Carry out bio right away, in the submitting thread */
+static void
+blockq_sync(bio_t *bio)
+{
+        blockq_nsync++;
+        blockq_complete(bio, blockq_issue(bio->bio_bdev, bio->bio_write,
+                                          bio->bio_buf, bio->bio_block,
+                                          bio->bio_count));
+}
+
+/* The queue for bdev, creating it the first time; NULL if out of memory */
+static blockq_t *
+blockq_get(blockdev_t *bdev)
+{
+        blockq_t *bq;
+
+        list_iterate_begin(&blockq_list, bq, blockq_t, bq_link) {
+                if (bq->bq_bdev == bdev)
+                        return bq;
+        } list_iterate_end();
+
+        if (NULL == (bq = kmalloc(sizeof(blockq_t))))
+                return NULL;
+        memset(bq, 0, sizeof(blockq_t));
+        bq->bq_bdev = bdev;
+        list_init(&bq->bq_sorted);
+        list_init(&bq->bq_fifo[0]);
+        list_init(&bq->bq_fifo[1]);
+        list_insert_tail(&blockq_list, &bq->bq_link);
+        return bq;
+}
+
+/* A pending request in bq that overlaps bio, or NULL */
+static bio_t *
+blockq_overlap(blockq_t *bq, bio_t *bio)
+{
+        bio_t *b;
+
+        list_iterate_begin(&bq->bq_sorted, b, bio_t, bio_link) {
+                if (b->bio_block >= bio->bio_block + bio->bio_count)
+                        break;
+                if (b->bio_block + b->bio_count > bio->bio_block)
+                        return b;
+        } list_iterate_end();
+        return NULL;
+}
+
+void
+blockq_submit(bio_t *bio)
+{
+        blockq_t *bq;
+        bio_t *b;
+
+        KASSERT(!bio->bio_complete);
+
+        if ((NULL == blockqd_thr) || (NULL == (bq = blockq_get(bio->bio_bdev)))) {
+                blockq_sync(bio);
+                return;
+        }
+
+        while (NULL != (b = blockq_overlap(bq, bio)))
+                sched_sleep_on(&b->bio_waitq);
+
+        /* blockq_shutdown() may have been called while we slept; blockqd
+         * completed everything that was queued before it exited, and
+         * nothing overlaps now, so carry this one out ourselves */
+        if (NULL == blockqd_thr) {
+                blockq_sync(bio);
+                return;
+        }
+
+        bio->bio_queued = bq->bq_seq;
+        bio->bio_deadline = bq->bq_seq
+                            + (bio->bio_write ? BLOCKQ_WRITE_EXPIRE : BLOCKQ_READ_EXPIRE);
+
+        list_iterate_begin(&bq->bq_sorted, b, bio_t, bio_link) {
+                if (b->bio_block > bio->bio_block) {
+                        list_insert_before(&b->bio_link, &bio->bio_link);
+                        goto queued;
+                }
+        } list_iterate_end();
+        list_insert_tail(&bq->bq_sorted, &bio->bio_link);
+queued:
+        list_insert_tail(&bq->bq_fifo[bio->bio_write], &bio->bio_flink);
+
+        bq->bq_nsubmitted++;
+        bq->bq_npending++;
+        bq->bq_maxdepth = MAX(bq->bq_maxdepth, bq->bq_npending);
+        sched_broadcast_on(&blockqd_waitq);
+}
+
+int
+blockq_wait(bio_t *bio)
+{
+        while (!bio->bio_complete)
+                sched_sleep_on(&bio->bio_waitq);
+        return bio->bio_status;
+}
+
+int
+blockq_read(blockdev_t *bdev, char *buf, blocknum_t block, size_t count)
+{
+        bio_t bio;
+
+        bio_init(&bio, bdev, 0, block, count, buf);
+        blockq_submit(&bio);
+        return blockq_wait(&bio);
+}
+
+int
+blockq_write(blockdev_t *bdev, const char *buf, blocknum_t block, size_t count)
+{
+        bio_t bio;
+
+        bio_init(&bio, bdev, 1, block, count, (char *) buf);
+        blockq_submit(&bio);
+        return blockq_wait(&bio);
+}
+
+/*
+ * The request bq should carry out next: the oldest read or, failing
+ * that, the oldest write if it is past its deadline; otherwise the next
+ * one at or above where the last request ended, wrapping around to the
+ * lowest block.
+ */
+static bio_t *
+blockq_next(blockq_t *bq)
+{
+        bio_t *bio;
+        int dir;
+
+        for (dir = 0; dir < 2; ++dir) {
+                if (list_empty(&bq->bq_fifo[dir]))
+                        continue;
+                bio = list_head(&bq->bq_fifo[dir], bio_t, bio_flink);
+                if ((int32_t)(bq->bq_seq - bio->bio_deadline) >= 0) {
+                        bq->bq_nexpired++;
+                        return bio;
+                }
+        }
+
+        list_iterate_begin(&bq->bq_sorted, bio, bio_t, bio_link) {
+                if (bio->bio_block >= bq->bq_head)
+                        return bio;
+        } list_iterate_end();
+        return list_head(&bq->bq_sorted, bio_t, bio_link);
+}
+
+/*
+ * Carry out run[0..n), requests for count consecutive blocks in the same
+ * direction, as a single request if we can.
+ */
+static void
+blockq_issue_run(blockq_t *bq, bio_t **run, uint32_t n, size_t count)
+{
+        blockdev_t *bdev = bq->bq_bdev;
+        int write = run[0]->bio_write;
+        char *buf, *p;
+        uint32_t i;
+        int ret;
+
+        for (i = 1; i < n; ++i) {
+                if (run[i]->bio_buf != run[i - 1]->bio_buf + run[i - 1]->bio_count * BLOCK_SIZE)
+                        break;
+        }
+        if (i == n) {
+                ret = blockq_issue(bdev, write, run[0]->bio_buf, run[0]->bio_block, count);
+                for (i = 0; i < n; ++i)
+                        blockq_complete(run[i], ret);
+                return;
+        }
+
+        if (NULL == (buf = page_alloc_n(count))) {
+                for (i = 0; i < n; ++i) {
+                        blockq_complete(run[i], blockq_issue(bdev, write, run[i]->bio_buf,
+                                                             run[i]->bio_block,
+                                                             run[i]->bio_count));
+                }
+                return;
+        }
+
+        bq->bq_nbounced++;
+        if (write) {
+                for (i = 0, p = buf; i < n; p += run[i]->bio_count * BLOCK_SIZE, ++i)
+                        memcpy(p, run[i]->bio_buf, run[i]->bio_count * BLOCK_SIZE);
+        }
+        ret = blockq_issue(bdev, write, buf, run[0]->bio_block, count);
+        for (i = 0, p = buf; i < n; p += run[i]->bio_count * BLOCK_SIZE, ++i) {
+                if (!write && (0 <= ret))
+                        memcpy(run[i]->bio_buf, p, run[i]->bio_count * BLOCK_SIZE);
+                blockq_complete(run[i], ret);
+        }
+        page_free_n(buf, count);
+}
+
+/* Take the next request off bq, along with any it can be merged with,
+ * and carry them out */
+static void
+blockq_dispatch(blockq_t *bq)
+{
+        bio_t *run[BLOCKQ_MAX_BLOCKS];
+        bio_t *bio, *next;
+        uint32_t n, i;
+        size_t count;
+
+        bio = blockq_next(bq);
+        run[0] = bio;
+        n = 1;
+        count = bio->bio_count;
+        while ((n < BLOCKQ_MAX_BLOCKS) && (bio->bio_link.l_next != &bq->bq_sorted)) {
+                next = list_item(bio->bio_link.l_next, bio_t, bio_link);
+                if ((next->bio_write != run[0]->bio_write)
+                    || (next->bio_block != run[0]->bio_block + count)
+                    || (count + next->bio_count > BLOCKQ_MAX_BLOCKS))
+                        break;
+                run[n++] = bio = next;
+                count += next->bio_count;
+        }
+
+        for (i = 0; i < n; ++i) {
+                list_remove(&run[i]->bio_link);
+                list_remove(&run[i]->bio_flink);
+                bq->bq_maxwait = MAX(bq->bq_maxwait, bq->bq_seq - run[i]->bio_queued);
+        }
+        bq->bq_npending -= n;
+        bq->bq_nmerged += n - 1;
+        bq->bq_head = run[0]->bio_block + count;
+        bq->bq_seq++;
+
+        /* this blocks; others may queue more requests meanwhile */
+        blockq_issue_run(bq, run, n, count);
+}
+
+/* A queue with requests pending, or NULL */
+static blockq_t *
+blockq_pending(void)
+{
+        blockq_t *bq;
+
+        list_iterate_begin(&blockq_list, bq, blockq_t, bq_link) {
+                if (0 < bq->bq_npending)
+                        return bq;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void *
+blockqd_run(int arg1, void *arg2)
+{
+        blockq_t *bq;
+        int cancelled;
+
+        while (1) {
+                while (NULL != (bq = blockq_pending()))
+                        blockq_dispatch(bq);
+                cancelled = sched_cancellable_sleep_on(&blockqd_waitq);
+                while (NULL != (bq = blockq_pending()))
+                        blockq_dispatch(bq);
+                if (cancelled)
+                        kthread_exit((void *) 0);
+        }
+        return NULL;
+}
+
+static __attribute__((unused)) void
+blockq_init(void)
+{
+        list_init(&blockq_list);
+        sched_queue_init(&blockqd_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        blockqd = proc_create("blockqd");
+        KASSERT(NULL != blockqd);
+        blockqd_thr = kthread_create(blockqd, blockqd_run, 0, NULL);
+        KASSERT(NULL != blockqd_thr);
+
+        sched_make_runnable(blockqd_thr);
+}
+init_func(blockq_init);
+init_depends(sched_init);
+
+void
+blockq_shutdown(void)
+{
+        kthread_t *thr = blockqd_thr;
+        pid_t pid, child;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        KASSERT(NULL != thr);
+
+        /* from now on requests are carried out by whoever submits them;
+         * blockqd finishes whatever is still queued before it exits */
+        blockqd_thr = NULL;
+        kthread_cancel(thr, (void *) 0);
+
+        pid = blockqd->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than blockqd");
+        KASSERT(NULL == blockq_pending());
+}
+
+size_t
+blockq_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+        blockq_t *bq;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "blockqd: %s, %u requests carried out by the submitter\n",
+                (NULL != blockqd_thr) ? "running" : "stopped", blockq_nsync);
+        list_iterate_begin(&blockq_list, bq, blockq_t, bq_link) {
+                iprintf(&buf, &size, "device %u:%u\n",
+                        MAJOR(bq->bq_bdev->bd_id), MINOR(bq->bq_bdev->bd_id));
+                iprintf(&buf, &size, "  pending:   %u (most %u)\n",
+                        bq->bq_npending, bq->bq_maxdepth);
+                iprintf(&buf, &size, "  submitted: %u\n", bq->bq_nsubmitted);
+                iprintf(&buf, &size, "  carried out: %u (%u merged, %u bounced)\n",
+                        bq->bq_seq, bq->bq_nmerged, bq->bq_nbounced);
+                iprintf(&buf, &size, "  expired:   %u\n", bq->bq_nexpired);
+                iprintf(&buf, &size, "  longest wait: %u requests\n", bq->bq_maxwait);
+        } list_iterate_end();
+
+        return osize - size;
+}
@@ -0,0 +1,216 @@
+/*
+ * Name lookup cache.
+ *
+ * lookup() consults this cache before asking the file system to search a
+ * directory. An entry maps (file system, directory vnode number, name) to
+ * the vnode number the name refers to, or records that the name does not
+ * exist (a negative entry). Entries hold no references: a hit calls vget()
+ * on the cached vnode number, so vnodes and inodes are freed exactly as
+ * they would be without the cache.
+ *
+ * The VFS calls dcache_remove() after every operation that changes a
+ * directory. Because the file system's lookup can block, a lookup only
+ * enters its result if no removal happened while it was in progress
+ * (dcache_gen is unchanged); otherwise it might cache a name that has
+ * just been created or removed.
+ *
+ * "." and ".." are never cached: "." is resolved by lookup() itself, and
+ * a cached ".." would outlive a removed directory whose inode number is
+ * reused.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+#include "config.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/slab.h"
+
+typedef struct dentry {
+        fs_t               *de_fs;
+        ino_t               de_dir;         /* directory the name is in */
+        ino_t               de_vno;         /* DCACHE_NEGATIVE if no such name */
+        size_t              de_namelen;
+        char                de_name[NAME_LEN];
+        list_link_t         de_hlink;       /* on hash chain */
+        list_link_t         de_lrulink;     /* on dcache_lru, newest first */
+} dentry_t;
+
+#define DCACHE_NEGATIVE ((ino_t) -1)
+
+static slab_allocator_t *dentry_allocator = NULL;
+static list_t dcache_hash[DCACHE_HASH_SIZE];
+static list_t dcache_lru;
+static uint32_t dcache_count = 0;
+static uint32_t dcache_gen = 0;
+
+static uint32_t dcache_nhits = 0;
+static uint32_t dcache_nneg = 0;
+static uint32_t dcache_nmisses = 0;
+static uint32_t dcache_nevicts = 0;
+
+static list_t *
+dcache_bucket(vnode_t *dir, const char *name, size_t len)
+{
+        uint32_t h = 2166136261U;
+        size_t i;
+
+        for (i = 0; i < len; ++i) {
+                h ^= (uint8_t) name[i];
+                h *= 16777619;
+        }
+        h ^= (uint32_t) dir->vn_vno * 2654435761U;
+        h ^= (uint32_t) dir->vn_fs >> 4;
+        return &dcache_hash[h & (DCACHE_HASH_SIZE - 1)];
+}
+
+/* Whether the name is one we never cache */
+#define dcache_skip(name, len) \
+        ((0 == (len)) || (len) > NAME_LEN || name_match(".", (name), (len)) \
+         || name_match("..", (name), (len)))
+
+static dentry_t *
+dcache_find(vnode_t *dir, const char *name, size_t len)
+{
+        dentry_t *de;
+
+        list_iterate_begin(dcache_bucket(dir, name, len), de, dentry_t, de_hlink) {
+                if ((de->de_fs == dir->vn_fs) && (de->de_dir == dir->vn_vno)
+                    && (de->de_namelen == len) && !strncmp(de->de_name, name, len))
+                        return de;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+dcache_free(dentry_t *de)
+{
+        list_remove(&de->de_hlink);
+        list_remove(&de->de_lrulink);
+        --dcache_count;
+        slab_obj_free(dentry_allocator, de);
+}
+
+int
+dcache_lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+{
+        dentry_t *de;
+        ino_t vno;
+
+        if (dcache_skip(name, len))
+                return 0;
+        if (NULL == (de = dcache_find(dir, name, len))) {
+                ++dcache_nmisses;
+                return 0;
+        }
+
+        list_remove(&de->de_lrulink);
+        list_insert_head(&dcache_lru, &de->de_lrulink);
+        if (DCACHE_NEGATIVE == (vno = de->de_vno)) {
+                ++dcache_nneg;
+                *result = NULL;
+        } else {
+                ++dcache_nhits;
+                *result = vget(dir->vn_fs, vno);
+                KASSERT(NULL != *result);
+        }
+        return 1;
+}
+
+uint32_t
+dcache_generation(void)
+{
+        return dcache_gen;
+}
+
+void
+dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *vn,
+             uint32_t gen)
+{
+        dentry_t *de;
+
+        if (dcache_skip(name, len) || (gen != dcache_gen))
+                return;
+        KASSERT((NULL == vn) || (vn->vn_fs == dir->vn_fs));
+
+        if (NULL == (de = dcache_find(dir, name, len))) {
+                if (DCACHE_MAX_ENTRIES <= dcache_count) {
+                        dcache_free(list_tail(&dcache_lru, dentry_t, de_lrulink));
+                        ++dcache_nevicts;
+                }
+                if (NULL == (de = slab_obj_alloc(dentry_allocator)))
+                        return;
+                de->de_fs = dir->vn_fs;
+                de->de_dir = dir->vn_vno;
+                de->de_namelen = len;
+                memcpy(de->de_name, name, len);
+                list_insert_head(dcache_bucket(dir, name, len), &de->de_hlink);
+                list_insert_head(&dcache_lru, &de->de_lrulink);
+                ++dcache_count;
+        }
+        de->de_vno = (NULL == vn) ? DCACHE_NEGATIVE : vn->vn_vno;
+}
+
+void
+dcache_remove(vnode_t *dir, const char *name, size_t len)
+{
+        dentry_t *de;
+
+        ++dcache_gen;
+        if (dcache_skip(name, len))
+                return;
+        if (NULL != (de = dcache_find(dir, name, len)))
+                dcache_free(de);
+}
+
+void
+dcache_purge_fs(fs_t *fs)
+{
+        dentry_t *de;
+
+        ++dcache_gen;
+        list_iterate_begin(&dcache_lru, de, dentry_t, de_lrulink) {
+                if (de->de_fs == fs)
+                        dcache_free(de);
+        } list_iterate_end();
+}
+
+size_t
+dcache_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "entries:   %u (max %u)\n", dcache_count,
+                DCACHE_MAX_ENTRIES);
+        iprintf(&buf, &size, "hits:      %u\n", dcache_nhits);
+        iprintf(&buf, &size, "negative:  %u\n", dcache_nneg);
+        iprintf(&buf, &size, "misses:    %u\n", dcache_nmisses);
+        iprintf(&buf, &size, "evicts:    %u\n", dcache_nevicts);
+
+        return osize - size;
+}
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+
+        for (i = 0; i < DCACHE_HASH_SIZE; ++i)
+                list_init(&dcache_hash[i]);
+        list_init(&dcache_lru);
+        dentry_allocator = slab_allocator_create("dentry", sizeof(dentry_t));
+        KASSERT(NULL != dentry_allocator);
+}
+init_func(dcache_init);
@@ -21,6 +21,9 @@
  * specific lookup() function, but you may want to special case
  * "." and/or ".." here depnding on your implementation.
  *
+ * Results, including names that do not exist, are kept in the name
+ * lookup cache (see fs/dcache.c), which is checked first.
+ *
  * If dir has no lookup(), return -ENOTDIR.
  *
  * Note: returns with the vnode refcount on *result incremented.
@@ -39,18 +42,19 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
         
         if(dir -> vn_ops -> lookup == NULL)
             return -ENOTDIR;
-        
-        /*  call the lookup function in vnode */
-        if(dir -> vn_ops -> lookup(dir, name, len, result) == -ENOENT){
-            return -ENOENT;
-        }
-        /*  
-        if(*result != NULL){
-            vref(*result);    
-        }
-        */
 
-        return 0;
+        if(dcache_lookup(dir, name, len, result))
+            return (*result == NULL) ? -ENOENT : 0;
+
+        /*  call the lookup function in vnode */
+        uint32_t gen = dcache_generation();
+        int res = dir -> vn_ops -> lookup(dir, name, len, result);
+        if(res == 0)
+            dcache_enter(dir, name, len, *result, gen);
+        else if(res == -ENOENT)
+            dcache_enter(dir, name, len, NULL, gen);
+
+        return res;
 }
 
 
@@ -219,7 +223,9 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
         res = lookup(dir_vnode, name, namelen, &result) ;
         if( res == -ENOENT){
             if((flag & O_CREAT) != 0){
-                if( (res = dir_vnode -> vn_ops -> create(dir_vnode, name, namelen, &result)) < 0){ 
+                res = dir_vnode -> vn_ops -> create(dir_vnode, name, namelen, &result);
+                dcache_remove(dir_vnode, name, namelen);
+                if(res < 0){
                     vput(dir_vnode);
                     return res;
                 }
@@ -229,6 +235,10 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
                 return -ENOENT;
             }
         }
+        else if(res < 0){
+            vput(dir_vnode);
+            return res;
+        }
         vput(dir_vnode);
         *res_vnode = result;
         return 0;
@@ -0,0 +1,180 @@
+/*
+ * Sequential readahead for the vnode page cache.
+ *
+ * Filesystem read paths call vnode_readahead() with the pages they are
+ * about to read. Once a file is being read front to back, each call
+ * that brings the reader within half a window of the end of what has
+ * been read ahead queues the next window, and the window doubles (up to
+ * READAHEAD_MAX_PAGES) every time. The reads themselves are issued by
+ * the readahead daemon through the vnode's readpages entry point, so
+ * the reading thread only blocks if it catches up with the daemon (it
+ * then sleeps on the busy page like any other waiter).
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+#include "config.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "fs/vnode.h"
+
+#include "mm/page.h"
+
+typedef struct ra_request {
+        vnode_t            *rr_vn;         /* referenced while queued */
+        uint32_t            rr_pagenum;
+        uint32_t            rr_npages;
+} ra_request_t;
+
+static ra_request_t ra_queue[READAHEAD_QUEUE_SIZE];
+static int ra_head = 0;
+static int ra_count = 0;
+
+static proc_t *readaheadd = NULL;
+static kthread_t *readaheadd_thr = NULL;
+static ktqueue_t readaheadd_waitq;
+
+static void *readaheadd_run(int arg1, void *arg2);
+
+void
+vnode_readahead(vnode_t *vn, uint32_t first, uint32_t last)
+{
+        uint32_t npages, start, count;
+        ra_request_t *req;
+
+        KASSERT(first <= last);
+
+        if ((NULL == vn->vn_ops->readpages) || (NULL == readaheadd_thr))
+                return;
+
+        if ((first == vn->vn_ra_prev) || (first == vn->vn_ra_prev + 1)) {
+                if (0 == vn->vn_ra_size) {
+                        vn->vn_ra_size = READAHEAD_MIN_PAGES;
+                        vn->vn_ra_end = last + 1;
+                }
+        } else {
+                /* random access; stop reading ahead until it is
+                 * sequential again */
+                vn->vn_ra_size = 0;
+        }
+        vn->vn_ra_prev = last;
+
+        if (0 == vn->vn_ra_size)
+                return;
+        /* the reader may have overtaken us */
+        if (vn->vn_ra_end <= last)
+                vn->vn_ra_end = last + 1;
+        /* still plenty read ahead */
+        if (vn->vn_ra_end - last > vn->vn_ra_size / 2)
+                return;
+
+        npages = ADDR_TO_PN(PAGE_ALIGN_UP(vn->vn_len));
+        start = vn->vn_ra_end;
+        if (start >= npages)
+                return;
+        count = MIN(vn->vn_ra_size, npages - start);
+
+        if (READAHEAD_QUEUE_SIZE == ra_count) {
+                dbg(DBG_VFS, "readahead queue full, dropping pages %u-%u of "
+                    "vnode %ld\n", start, start + count - 1, (long)vn->vn_vno);
+                return;
+        }
+        req = &ra_queue[(ra_head + ra_count) % READAHEAD_QUEUE_SIZE];
+        ++ra_count;
+        vref(vn);
+        req->rr_vn = vn;
+        req->rr_pagenum = start;
+        req->rr_npages = count;
+        sched_broadcast_on(&readaheadd_waitq);
+
+        vn->vn_ra_end = start + count;
+        vn->vn_ra_size = MIN(2 * vn->vn_ra_size, READAHEAD_MAX_PAGES);
+}
+
+/*
+ * Start the readahead daemon. Like pageoutd it is a child of idleproc.
+ */
+static __attribute__((unused)) void
+readahead_init(void)
+{
+        sched_queue_init(&readaheadd_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        readaheadd = proc_create("readaheadd");
+        KASSERT(NULL != readaheadd);
+        readaheadd_thr = kthread_create(readaheadd, readaheadd_run, 0, NULL);
+        KASSERT(NULL != readaheadd_thr);
+
+        sched_make_runnable(readaheadd_thr);
+}
+init_func(readahead_init);
+init_depends(sched_init);
+
+void
+readahead_shutdown(void)
+{
+        pid_t pid, child;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        KASSERT(NULL != readaheadd_thr);
+
+        kthread_cancel(readaheadd_thr, (void *) 0);
+        readaheadd_thr = NULL;
+
+        pid = readaheadd->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than readaheadd");
+}
+
+/*
+ * Service queued readahead requests until there are none left, then sleep
+ * until more arrive. Errors are not reported to anyone: the reader will
+ * simply fill whatever pages we did not manage to read. Requests still
+ * queued when we are cancelled are dropped.
+ * Both arguments unused.
+ */
+static void *
+readaheadd_run(int arg1, void *arg2)
+{
+        while (1) {
+                while (0 < ra_count) {
+                        ra_request_t req = ra_queue[ra_head];
+                        int err;
+
+                        ra_head = (ra_head + 1) % READAHEAD_QUEUE_SIZE;
+                        --ra_count;
+
+                        err = req.rr_vn->vn_ops->readpages(req.rr_vn,
+                                        (off_t) PN_TO_ADDR(req.rr_pagenum),
+                                        req.rr_npages);
+                        if (0 > err) {
+                                dbg(DBG_VFS, "readahead of pages %u-%u of vnode %ld "
+                                    "failed: %d\n", req.rr_pagenum,
+                                    req.rr_pagenum + req.rr_npages - 1,
+                                    (long)req.rr_vn->vn_vno, err);
+                        }
+                        vput(req.rr_vn);
+                }
+
+                if (sched_cancellable_sleep_on(&readaheadd_waitq)) {
+                        /* shutting down: drop what is still queued, but
+                         * let go of the vnodes so they can be freed */
+                        while (0 < ra_count) {
+                                vput(ra_queue[ra_head].rr_vn);
+                                ra_head = (ra_head + 1) % READAHEAD_QUEUE_SIZE;
+                                --ra_count;
+                        }
+                        kthread_exit((void *)0);
+                }
+        }
+        return NULL;
+}
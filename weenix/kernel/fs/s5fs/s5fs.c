@@ -25,6 +25,7 @@
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
+#include "drivers/blockq.h"
 
 #include "mm/kmalloc.h"
 #include "mm/pframe.h"
@@ -61,6 +62,9 @@ static int  s5fs_stat(vnode_t *vnode, struct stat *ss);
 static int  s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
 static int  s5fs_dirtypage(vnode_t *vnode, off_t offset);
 static int  s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int  s5fs_readpages(vnode_t *vnode, off_t offset, uint32_t npages);
+static int  s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs,
+                            uint32_t npages);
 
 fs_ops_t s5fs_fsops = {
         s5fs_read_vnode,
@@ -85,7 +89,8 @@ static vnode_ops_t s5fs_dir_vops = {
         .stat = s5fs_stat,
         .fillpage = s5fs_fillpage,
         .dirtypage = s5fs_dirtypage,
-        .cleanpage = s5fs_cleanpage
+        .cleanpage = s5fs_cleanpage,
+        .cleanpages = s5fs_cleanpages
 };
 
 /* vnode operations table for regular files: */
@@ -104,7 +109,9 @@ static vnode_ops_t s5fs_file_vops = {
         .stat = s5fs_stat,
         .fillpage = s5fs_fillpage,
         .dirtypage = s5fs_dirtypage,
-        .cleanpage = s5fs_cleanpage
+        .cleanpage = s5fs_cleanpage,
+        .readpages = s5fs_readpages,
+        .cleanpages = s5fs_cleanpages
 };
 
 /*
@@ -120,6 +127,7 @@ int
 s5fs_mount(struct fs *fs)
 {
         int num;
+        uint32_t level;
         blockdev_t *dev;
         s5fs_t *s5;
         pframe_t *vp;
@@ -164,6 +172,24 @@ s5fs_mount(struct fs *fs)
         /*     init s5f_fs: */
         s5->s5f_fs = fs;
 
+        s5->s5f_alloc_rotor = 0;
+
+        /*     init the file layout: */
+        if (s5->s5f_super->s5s_version >= S5_INDIRECT_VERSION) {
+                s5->s5f_ndirect = S5_DINDIRECT_SLOT;
+                s5->s5f_nlevels = S5_MAX_INDIRECT_LEVEL;
+        } else {
+                s5->s5f_ndirect = S5_NDIRECT_BLOCKS;
+                s5->s5f_nlevels = 1;
+        }
+        s5->s5f_max_blocks = s5->s5f_ndirect;
+        for (level = 1; level <= s5->s5f_nlevels; ++level)
+                s5->s5f_max_blocks += S5_INDIRECT_SPAN(level);
+        s5->s5f_max_blocks = MIN(s5->s5f_max_blocks, S5_MAX_OFF_BLOCKS);
+        memset(s5->s5f_bmap_cache, 0, sizeof(s5->s5f_bmap_cache));
+        list_init(&s5->s5f_dirhash_list);
+        s5->s5f_ndirhash = 0;
+
 
         /* Init the members of fs that we (the fs-implementation) are
          * responsible for initializing: */
@@ -339,7 +365,11 @@ s5fs_umount(fs_t *fs)
                     "and minor %d!!\n", MAJOR(bd->bd_id), MINOR(bd->bd_id));
         }
 
-        vnode_flush_all(fs);
+        if (0 > (ret = vnode_flush_all(fs))) {
+                dbg(DBG_PRINT, "s5fs_umount: WARNING: some file data could not be "
+                    "written back to the fs on block device with major %d "
+                    "and minor %d: %d\n", MAJOR(bd->bd_id), MINOR(bd->bd_id), ret);
+        }
 
         vput(fs->fs_root);
 
@@ -355,6 +385,7 @@ s5fs_umount(fs_t *fs)
 
         pframe_unpin(sbp);
 
+        s5_dirhash_purge_all(s5);
         kfree(s5);
 
         blockdev_flush_all(bd);
@@ -809,7 +840,7 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
     else{
         s5fs_t *s5 = VNODE_TO_S5FS(vnode);
         blockdev_t* blockdev = s5 -> s5f_bdev;
-        res = blockdev -> bd_ops -> read_block(blockdev, pagebuf, block_num, 1);
+        res = blockq_read(blockdev, pagebuf, block_num, 1);
     }
     return res;
 }
@@ -876,10 +907,30 @@ s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
     
     s5fs_t *s5 = VNODE_TO_S5FS(vnode);
     blockdev_t* blockdev = s5 -> s5f_bdev;
-    int res = blockdev -> bd_ops -> write_block(blockdev, pagebuf, block_num, 1);
+    int res = blockq_write(blockdev, pagebuf, block_num, 1);
     return res;
 }
 
+/*
+ * Read ahead; see s5_read_pages().
+ */
+static int
+s5fs_readpages(vnode_t *vnode, off_t offset, uint32_t npages)
+{
+        KASSERT(vnode != NULL);
+        return s5_read_pages(vnode, S5_DATA_BLOCK(offset), npages);
+}
+
+/*
+ * Clustered writeback; see s5_write_pages().
+ */
+static int
+s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs, uint32_t npages)
+{
+        KASSERT(vnode != NULL);
+        return s5_write_pages(vnode, S5_DATA_BLOCK(offset), pagebufs, npages);
+}
+
 /* Diagnostic/Utility: */
 
 /*
@@ -894,12 +945,21 @@ s5_check_super(s5_super_t *super)
                   || super->s5s_free_inode == (uint32_t) - 1)
               && super->s5s_root_inode < super->s5s_num_inodes))
                 return -1;
-        if (super->s5s_version != S5_CURRENT_VERSION) {
+        if ((super->s5s_version < S5_OLDEST_VERSION)
+            || (super->s5s_version > S5_CURRENT_VERSION)) {
                 dbg(DBG_PRINT, "Filesystem is version %d; "
-                    "only version %d is supported.\n",
-                    super->s5s_version, S5_CURRENT_VERSION);
+                    "only versions %d to %d are supported.\n",
+                    super->s5s_version, S5_OLDEST_VERSION, S5_CURRENT_VERSION);
                 return -1;
         }
+        if ((super->s5s_version >= S5_BITMAP_VERSION)
+            && !((super->s5s_bitmap_block > S5_INODE_BLOCK(super->s5s_num_inodes - 1))
+                 && (super->s5s_bitmap_block + super->s5s_bitmap_nblocks
+                     < super->s5s_num_blocks)
+                 && (super->s5s_bitmap_nblocks * S5_BITS_PER_BLOCK
+                     >= super->s5s_num_blocks)
+                 && (super->s5s_nfree_blocks < super->s5s_num_blocks)))
+                return -1;
         return 0;
 }
 
@@ -18,6 +18,7 @@
 #include "mm/mmobj.h"
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
+#include "drivers/blockq.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -42,40 +43,192 @@
 
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *fs, uint32_t goal);
 
 
+static int s5_bmap(vnode_t *vnode, uint32_t index, int alloc);
+static void s5_dirhash_purge(s5fs_t *fs, uint32_t ino);
+
 /* helper function, given a vnode and a block index, return the block
  * number */
-/* if the indirect block has not been allocated while the index is in the
- * indirect block, just return 0 
+/* if the block is sparse, or an indirect block on the way to it has not
+ * been allocated, just return 0
  */
- /*  return -1 if exceeds the maximum allowed blocks */
 uint32_t get_block_by_index(vnode_t* vnode, int index){
     
     KASSERT(vnode != NULL);
 
-    s5_inode_t* inode = VNODE_TO_S5INODE(vnode);
-    s5fs_t* s5 = VNODE_TO_S5FS(vnode);
-    struct mmobj *s5obj = S5FS_TO_VMOBJ(s5); 
+    int block = s5_bmap(vnode, index, 0);
+    if(block < 0)
+        return 0;
+    return block;
+}
 
-    if(index < S5_NDIRECT_BLOCKS)
-        return inode -> s5_direct_blocks[index];
+/*
+ * Allocation goal for block 'index' of a file: the disk block after the
+ * one holding the previous block of the file, so that files written front
+ * to back are laid out contiguously. 0 (no preference) for the first
+ * block, or if the previous block is sparse.
+ */
+static uint32_t
+s5_alloc_goal(vnode_t *vnode, int index)
+{
+        uint32_t prev;
 
-    uint32_t indirect_block = inode -> s5_indirect_block;
-    if(indirect_block == 0)
-        return 0;
+        if ((0 == index) || (0 == (prev = get_block_by_index(vnode, index - 1))))
+                return 0;
+        return prev + 1;
+}
 
-    else{
-        pframe_t* indirect_block_frame;
-        int res = pframe_get(s5obj, indirect_block, &indirect_block_frame);
-        if(res < 0){
-            return 0;
+#define s5_bmap_cache_slot(fs, ino, group) \
+        (&(fs)->s5f_bmap_cache[((ino) * 31 + (group)) & (S5_BMAP_CACHE_SIZE - 1)])
+
+/*
+ * Forget every cached translation for inode 'ino'. Entries only ever
+ * point at indirect blocks that exist, and the indirect blocks of an
+ * inode do not move while it is in use, so this is only needed when the
+ * inode is freed.
+ */
+static void
+s5_bmap_cache_purge(s5fs_t *fs, uint32_t ino)
+{
+        int i;
+
+        for (i = 0; i < S5_BMAP_CACHE_SIZE; ++i) {
+                if (fs->s5f_bmap_cache[i].sbc_ino == ino)
+                        fs->s5f_bmap_cache[i].sbc_block = 0;
+        }
+}
+
+/*
+ * Allocate a zeroed indirect block near 'goal'. Returns the block number
+ * or -errno.
+ */
+static int
+s5_alloc_indirect(s5fs_t *fs, uint32_t goal)
+{
+        pframe_t *pf;
+        int block, err;
+
+        if (0 > (block = s5_alloc_block(fs, goal)))
+                return block;
+        /* whatever is on disk there now is of no interest */
+        if (0 > (err = pframe_get_range(S5FS_TO_VMOBJ(fs), block, 1, 1, &pf))) {
+                s5_free_block(fs, block);
+                return err;
+        }
+        /* the zeros must not be seen before the page is dirty */
+        if (pframe_is_busy(pf)) {
+                pframe_zero(pf);
+                err = pframe_dirty_overwritten(pf);
+        } else if (0 == (err = pframe_dirty(pf))) {
+                memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+        }
+        KASSERT(!err && "shouldn\'t fail for a page belonging to a block device");
+        pframe_unpin(pf);
+        return block;
+}
+
+/*
+ * Map block 'index' of the file to a disk block. Blocks past the direct
+ * blocks are found through the single, double or (from
+ * S5_INDIRECT_VERSION on) triple indirect block, in that order. The
+ * translation cache lets deep lookups start at the last indirect block.
+ *
+ * If the block is sparse and alloc is false, return 0; if alloc is true,
+ * allocate it and any indirect blocks missing on the way.
+ *
+ * Returns the disk block number or -errno.
+ */
+static int
+s5_bmap(vnode_t *vnode, uint32_t index, int alloc)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_bmap_cache_t *ent = NULL;
+        uint32_t *root, *entries;
+        uint32_t rel, group, level, slot;
+        pframe_t *pf;
+        int block, next, err;
+
+        if (index >= fs->s5f_max_blocks)
+                return -ENOSPC;
+
+        if (index < fs->s5f_ndirect) {
+                root = &inode->s5_direct_blocks[index];
+                if ((0 == *root) && alloc) {
+                        if (0 > (block = s5_alloc_block(fs, s5_alloc_goal(vnode, index))))
+                                return block;
+                        *root = block;
+                        s5_dirty_inode(fs, inode);
+                }
+                return *root;
+        }
+
+        /* find which indirect tree holds the block, and where in it */
+        rel = index - fs->s5f_ndirect;
+        group = rel >> S5_NIDIRECT_SHIFT;
+        for (level = 1; rel >= S5_INDIRECT_SPAN(level); ++level)
+                rel -= S5_INDIRECT_SPAN(level);
+        KASSERT(level <= fs->s5f_nlevels);
+        if (1 == level)
+                root = &inode->s5_indirect_block;
+        else if (2 == level)
+                root = &inode->s5_direct_blocks[S5_DINDIRECT_SLOT];
+        else
+                root = &inode->s5_direct_blocks[S5_TINDIRECT_SLOT];
+
+        block = *root;
+        if (1 < level) {
+                ent = s5_bmap_cache_slot(fs, inode->s5_number, group);
+                if ((0 != ent->sbc_block) && (ent->sbc_ino == inode->s5_number)
+                    && (ent->sbc_group == group)) {
+                        block = ent->sbc_block;
+                        level = 1;
+                }
+        }
+
+        if (0 == block) {
+                if (!alloc)
+                        return 0;
+                if (0 > (block = s5_alloc_indirect(fs, s5_alloc_goal(vnode, index))))
+                        return block;
+                *root = block;
+                s5_dirty_inode(fs, inode);
         }
-        uint32_t index_in_indirect = index - S5_NDIRECT_BLOCKS;
-        uint32_t* block_array = (uint32_t*)indirect_block_frame->pf_addr;
-        return block_array[index_in_indirect];
-    }
+
+        for (; level > 0; --level) {
+                if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs), block, &pf)))
+                        return err;
+                if ((1 == level) && (NULL != ent)) {
+                        ent->sbc_ino = inode->s5_number;
+                        ent->sbc_group = group;
+                        ent->sbc_block = block;
+                }
+
+                entries = (uint32_t *) pf->pf_addr;
+                slot = (rel >> ((level - 1) * S5_NIDIRECT_SHIFT)) & (S5_NIDIRECT_BLOCKS - 1);
+                if (0 == (next = entries[slot])) {
+                        if (!alloc)
+                                return 0;
+                        pframe_pin(pf);
+                        if (1 == level)
+                                next = s5_alloc_block(fs, s5_alloc_goal(vnode, index));
+                        else
+                                next = s5_alloc_indirect(fs, s5_alloc_goal(vnode, index));
+                        if (0 > next) {
+                                pframe_unpin(pf);
+                                return next;
+                        }
+                        entries[slot] = next;
+                        err = pframe_dirty(pf);
+                        KASSERT(!err && "shouldn\'t fail for a page belonging to a block device");
+                        pframe_unpin(pf);
+                }
+                block = next;
+        }
+
+        return block;
 }
 
 /*
@@ -87,109 +240,16 @@ uint32_t get_block_by_index(vnode_t* vnode, int index){
  * alloc is true, then allocate a new disk block (and make the inode
  * point to it) and return it.
  *
- * Be sure to handle indirect blocks!
+ * Indirect blocks are handled by s5_bmap().
  *
  * If there is an error, return -errno.
- *
- * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
  */
 int
 s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
 {
         KASSERT(vnode != NULL);
 
-        s5fs_t* s5 = VNODE_TO_S5FS(vnode);
-        struct mmobj *s5obj = S5FS_TO_VMOBJ(s5); 
-        s5_inode_t* inode = VNODE_TO_S5INODE(vnode);
-
-        int nth_block = S5_DATA_BLOCK(seekptr);
-        uint32_t file_size =  inode -> s5_size;
-        int block_num = 0;
-        /* check whether in the indirect block */
-        if(nth_block < S5_NDIRECT_BLOCKS){
-            block_num = inode -> s5_direct_blocks[nth_block];
-            if(block_num == 0){
-                if(alloc != 0){
-                    /* sparse block */
-                    block_num = s5_alloc_block(s5);
-                    if(block_num < 0){
-                        /* allocation fails */
-                        return -ENOSPC;
-                    }
-                    inode -> s5_direct_blocks[nth_block] = block_num;           
-                    /*  the content of inode is modified */
-                    s5_dirty_inode(s5, inode);
-                }
-            }
-            return block_num;
-        }
-
-        else{
-            
-            /*  get content or modify the indirect block */
-            uint32_t index_in_indirect = nth_block - S5_NDIRECT_BLOCKS;
-            if(index_in_indirect >= S5_NIDIRECT_BLOCKS){
-                return -ENOSPC;
-            }
-
-            /*  indirect blocks */
-            int indirect_block = inode-> s5_indirect_block;
-            pframe_t* indirect_block_frame;
-            if(indirect_block == 0){
-                /* allocate the indirect block first */
-                indirect_block = s5_alloc_block(s5);
-                if(indirect_block < 0){
-                    return -ENOSPC;
-                }
-                /*  clean the content of indirect block */
-                int res = pframe_get(S5FS_TO_VMOBJ(s5), indirect_block ,&indirect_block_frame);
-                if(res < 0){
-                    return res;
-                }
-                pframe_pin(indirect_block_frame);
-                memset(indirect_block_frame -> pf_addr, 0, PAGE_SIZE);
-                inode -> s5_indirect_block = indirect_block;
-                pframe_dirty(indirect_block_frame);
-                pframe_unpin(indirect_block_frame);
-                s5_dirty_inode(s5, inode);
-            }
-            else{
-                /*  get the contents of indirect block */
-                int res = pframe_get(s5obj, indirect_block, &indirect_block_frame);
-                if(res < 0){
-                    return res;
-                }
-            }
-            pframe_pin(indirect_block_frame);
-            /*  get the block number in indirect block */
-            uint32_t* block_array = (uint32_t*)indirect_block_frame->pf_addr;
-            block_num = block_array[index_in_indirect];
-            if(block_num == 0 && alloc != 0){
-                /*  allocate a new block */
-                block_num = s5_alloc_block(s5);
-                if(block_num < 0){
-                    /* allocation fails */
-                    pframe_unpin(indirect_block_frame);
-                    return -ENOSPC;
-                }
-                
-                /*  set the new page content to zero */
-                /*  pframe_t* new_block_frame;
-                int res = pframe_get(S5FS_TO_VMOBJ(s5), block_num, &new_block_frame);
-                if(res < 0){
-                    pframe_unpin(indirect_block_frame);
-                    return -1;
-                }
-                pframe_pin(new_block_frame);
-                memset(new_block_frame -> pf_addr, 0, PAGE_SIZE);
-                pframe_dirty(new_block_frame);
-                pframe_unpin(new_block_frame);*/
-                block_array[index_in_indirect] = block_num;           
-                pframe_dirty(indirect_block_frame);
-            }
-            pframe_unpin(indirect_block_frame);
-            return block_num;           
-        }
+        return s5_bmap(vnode, S5_DATA_BLOCK(seekptr), alloc);
 }
 
 
@@ -236,65 +296,83 @@ unlock_s5(s5fs_t *fs)
 int
 s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 {
-        /*  get the block, we need to write */
+        s5fs_t *s5;
+        s5_inode_t *inode;
+        pframe_t *pfs[S5_RW_BATCH_PAGES];
+        char unfilled[S5_RW_BATCH_PAGES];
+        uint32_t pos, end, first, n, i, off, count;
+        int written = 0, ret = 0, overwrite;
+
         KASSERT(vnode != NULL);
-        s5fs_t* s5 = VNODE_TO_S5FS(vnode);
-        s5_inode_t* inode = VNODE_TO_S5INODE(vnode);
-
-        /*  get the block frame to write to */
-        struct mmobj* fileobj = &vnode -> vn_mmobj;
-        struct mmobj *s5obj = S5FS_TO_VMOBJ(s5); 
-        uint32_t block_index = S5_DATA_BLOCK(seek);
-        if(block_index >= S5_MAX_FILE_BLOCKS)
-            return 0;
-        int res;
-        pframe_t* block = NULL;
-
-        /*  get the start location (offset) in the block */
-        uint32_t offset = S5_DATA_OFFSET(seek);
-        uint32_t remaining = S5_BLOCK_SIZE - offset;
-        int written = 0;
-        /* look to see if remaining space could be written */
-        uint32_t to_write = len;
-        while(to_write > 0){
-            res = pframe_get(fileobj, block_index, &block);
-            if(res < 0){
-                return written;
-            }
-            pframe_pin(block);
-            if(to_write <= remaining){
-                res = pframe_dirty(block);
-                if(res < 0) return res;
-                memcpy((char*) block->pf_addr + offset, bytes + written, to_write);
-                written += to_write;
-                to_write = 0;
-                offset = 0;
-            }
-            else{
-                res = pframe_dirty(block);
-                if(res < 0) return res;
-                memcpy( (char*) block->pf_addr + offset, bytes + written, to_write);
-                to_write -= remaining;
-                written += remaining;
-                offset = 0;
-            }
-            pframe_unpin(block);
-            /*see whether we need to go to next block*/
-            if(to_write > 0){
-                block_index ++;
-                remaining = S5_BLOCK_SIZE;
-                if(block_index == S5_MAX_FILE_BLOCKS)
-                    break;
-            }
-        }
+        s5 = VNODE_TO_S5FS(vnode);
+        inode = VNODE_TO_S5INODE(vnode);
+
+        pos = (uint32_t) seek;
+        end = s5->s5f_max_blocks * S5_BLOCK_SIZE;
+        if (pos >= end)
+                return 0;
+        if (len < end - pos)
+                end = pos + len;
+
+        /* Work through the range a batch of pages at a time: get them all
+         * pinned, then dirty and fill each. A page that is already dirty
+         * already has its block, so there is nothing to tell the fs.
+         * Pages we write all of are not read in first; only a partial
+         * page at either end of the range goes through a fill. */
+        while ((pos < end) && (0 == ret)) {
+                first = S5_DATA_BLOCK(pos);
+                overwrite = (0 == S5_DATA_OFFSET(pos)) && (end - pos >= S5_BLOCK_SIZE);
+                n = overwrite ? MIN((end - pos) / S5_BLOCK_SIZE, S5_RW_BATCH_PAGES) : 1;
+                if (0 > (ret = pframe_get_range(&vnode->vn_mmobj, first, n, overwrite, pfs)))
+                        break;
+
+                /* The pages that were not filled come back busy, so nobody
+                 * has seen them yet; fill them before anything blocks. They
+                 * stay busy until they are dirty, so their new contents are
+                 * only ever seen if they are going to reach the disk. */
+                for (i = 0; i < n; ++i) {
+                        if ((unfilled[i] = overwrite && pframe_is_busy(pfs[i])))
+                                memcpy(pfs[i]->pf_addr, bytes + written + i * S5_BLOCK_SIZE,
+                                       S5_BLOCK_SIZE);
+                }
 
-        /*  update the frame of vnode */
-        if(seek + written > vnode -> vn_len){
-            vnode->vn_len = seek + written;
-            inode->s5_size = seek+ written;
+                for (i = 0; i < n; ++i) {
+                        if (unfilled[i]) {
+                                if (0 != ret) {
+                                        /* nobody has seen it; just drop it */
+                                        pframe_overwritten(pfs[i]);
+                                        pframe_unpin(pfs[i]);
+                                        pframe_free(pfs[i]);
+                                        continue;
+                                }
+                                /* this drops the page if it fails */
+                                if (0 > (ret = pframe_dirty_overwritten(pfs[i])))
+                                        continue;
+                        } else if ((0 != ret) || (!pframe_is_dirty(pfs[i])
+                                                  && (0 > (ret = pframe_dirty(pfs[i]))))) {
+                                pframe_unpin(pfs[i]);
+                                continue;
+                        }
+                        off = S5_DATA_OFFSET(pos);
+                        count = MIN(end - pos, S5_BLOCK_SIZE - off);
+                        if (!unfilled[i])
+                                memcpy((char *) pfs[i]->pf_addr + off, bytes + written, count);
+                        written += count;
+                        pos += count;
+                        pframe_unpin(pfs[i]);
+                }
         }
 
-        s5_dirty_inode(s5, inode);
+        if (0 == written)
+                return ret;
+
+        /* Blocks allocated above have dirtied the inode already; an
+         * overwrite within the file leaves it alone. */
+        if (seek + written > vnode->vn_len) {
+                vnode->vn_len = seek + written;
+                inode->s5_size = seek + written;
+                s5_dirty_inode(s5, inode);
+        }
         return written;
 }
 
@@ -321,88 +399,201 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 int
 s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
 {
+        pframe_t *pfs[S5_RW_BATCH_PAGES];
+        uint32_t pos, end, first, last, n, i, off, count;
+        int ret;
+
         KASSERT(vnode != NULL);
         KASSERT(dest != NULL);
 
-        /*  get the block frame to read from */
-        s5_inode_t* inode = VNODE_TO_S5INODE(vnode);
-        s5fs_t* s5 = VNODE_TO_S5FS(vnode);
-        struct mmobj *s5obj = S5FS_TO_VMOBJ(s5); 
-        struct mmobj *fileobj = &vnode -> vn_mmobj;
-
-        uint32_t block_index = S5_DATA_BLOCK(seek);
-        if(block_index >= S5_MAX_FILE_BLOCKS)
-            return 0;
-    
-        /*  seek location exceeds the file length */
-        if(seek >= vnode->vn_len){
-            return 0;
-        }
-        
-        /*  get the start location (offset) in the block */
-        uint32_t offset = S5_DATA_OFFSET(seek);
-        uint32_t remaining = S5_BLOCK_SIZE - offset;
-        int has_read = 0;
-        uint32_t to_read = (uint32_t)seek + (uint32_t)len > (uint32_t)vnode -> vn_len ?  (uint32_t)vnode->vn_len - (uint32_t)seek : (uint32_t)len;  
-        while(to_read > 0){
-            if(to_read <= remaining){
-                uint32_t block_num_to_read = get_block_by_index(vnode, block_index);
-                if(block_num_to_read == 0){
-                    /*  sparse block */
-                    memset((char*)dest + has_read, 0, to_read);
-                }
-                else{
-                    /*  get the block content */
-                    pframe_t* block = NULL;
-                    int res = pframe_get(fileobj, block_index, &block);
-                    if(res < 0)
-                        return res;
-                    /*  do the reading */
-                    pframe_pin(block);
-                    memcpy((char*)dest + has_read, (char*) block->pf_addr + offset, to_read);    
-                    pframe_unpin(block);
+        /* seek location exceeds the file length */
+        if (seek >= vnode->vn_len)
+                return 0;
+        pos = (uint32_t) seek;
+        end = (uint32_t) vnode->vn_len;
+        if (len < end - pos)
+                end = pos + len;
+        if (pos == end)
+                return 0;
+
+        first = S5_DATA_BLOCK(pos);
+        last = S5_DATA_BLOCK(end - 1);
+        vnode_readahead(vnode, first, last);
+
+        /* Sparse blocks read as zeros without bringing a page in; each run
+         * of up to S5_RW_BATCH_PAGES allocated blocks is got in one go. */
+        while (pos < end) {
+                first = S5_DATA_BLOCK(pos);
+                if (0 == get_block_by_index(vnode, first)) {
+                        count = MIN(end - pos, S5_BLOCK_SIZE - S5_DATA_OFFSET(pos));
+                        memset(dest + (pos - seek), 0, count);
+                        pos += count;
+                        continue;
                 }
-                has_read += to_read;
-                to_read = 0;
-                offset = 0;
-            }
-            else{
-                uint32_t block_num_to_read = get_block_by_index(vnode, block_index);
-                if(block_num_to_read == 0){
-                    /*  sparse block */
-                    memcpy(dest + has_read, 0, remaining);
+
+                for (n = 1; (n < S5_RW_BATCH_PAGES) && (first + n <= last)
+                     && (0 != get_block_by_index(vnode, first + n)); ++n)
+                        ;
+                if (0 > (ret = pframe_get_range(&vnode->vn_mmobj, first, n, 0, pfs)))
+                        return (pos == (uint32_t) seek) ? ret : (int) (pos - seek);
+
+                for (i = 0; i < n; ++i) {
+                        off = S5_DATA_OFFSET(pos);
+                        count = MIN(end - pos, S5_BLOCK_SIZE - off);
+                        memcpy(dest + (pos - seek), (char *) pfs[i]->pf_addr + off, count);
+                        pos += count;
+                        pframe_unpin(pfs[i]);
                 }
-                else{
-                    /*  get the block content */
-                    pframe_t* block = NULL;
-                    int res = pframe_get(fileobj, block_index, &block);
-                    if(res < 0)
-                        return res;
-                    pframe_pin(block);
-                    /*  do the reading */
-                    memcpy((char*)dest + has_read, (char*) block->pf_addr + offset, remaining);    
-                    pframe_unpin(block);
+        }
+
+        return (int) (pos - seek);
+}
+
+/*
+ * Fill the busy readahead pages run[0..n) from the n consecutive disk
+ * blocks starting at 'block'. The pages are queued as one request each
+ * and the block request queue carries them out together; every page is
+ * handed back with pframe_readahead_done() once its request completes.
+ */
+static int
+s5_read_run(s5fs_t *fs, uint32_t block, pframe_t **run, uint32_t n)
+{
+        bio_t bios[READAHEAD_MAX_PAGES];
+        uint32_t i;
+        int ret = 0, err;
+
+        KASSERT(n <= READAHEAD_MAX_PAGES);
+        for (i = 0; i < n; ++i) {
+                bio_init(&bios[i], fs->s5f_bdev, 0, block + i, 1, run[i]->pf_addr);
+                blockq_submit(&bios[i]);
+        }
+        for (i = 0; i < n; ++i) {
+                if (0 > (err = blockq_wait(&bios[i])))
+                        ret = err;
+                pframe_readahead_done(run[i], err);
+        }
+
+        return ret;
+}
+
+/*
+ * Read ahead npages pages of the file starting at page 'pagenum', for the
+ * vnode's readpages entry point. Pages are grouped into runs whose disk
+ * blocks are consecutive, and each run is read with one request. Pages
+ * that are resident or sparse end a run and are skipped (sparse pages
+ * cost nothing to fill later); running out of memory ends the readahead.
+ *
+ * Does not take vn_mutex: the pages we fill are busy until they are
+ * complete, so anyone who wants them waits, and the vnode cannot go away
+ * since the readahead daemon holds a reference.
+ *
+ * Returns 0 or the last -errno from the block device.
+ */
+int
+s5_read_pages(struct vnode *vnode, uint32_t pagenum, uint32_t npages)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        pframe_t *run[READAHEAD_MAX_PAGES];
+        uint32_t end, i, n, first = 0;
+        int ret = 0, err, rerr;
+
+        end = MIN(pagenum + npages, fs->s5f_max_blocks);
+        i = pagenum;
+        while (i < end) {
+                /* collect a run */
+                n = 0;
+                err = 0;
+                while ((i < end) && (n < READAHEAD_MAX_PAGES)) {
+                        uint32_t block = get_block_by_index(vnode, i);
+                        if ((0 == block) || ((0 < n) && (block != first + n)))
+                                break;
+                        if (0 > (err = pframe_readahead_alloc(&vnode->vn_mmobj, i, &run[n])))
+                                break;
+                        if (0 == n)
+                                first = block;
+                        ++n;
+                        ++i;
                 }
-                has_read += remaining;
-                to_read -= remaining;
-                offset = 0;
-            }
 
-            if(to_read > 0){
-                /*  get next page.. */
-                block_index ++;
-                remaining = S5_BLOCK_SIZE;
-                if(block_index == S5_MAX_FILE_BLOCKS)
-                    break;
-            }
+                if ((0 < n) && (0 > (rerr = s5_read_run(fs, first, run, n))))
+                        ret = rerr;
+                if (-ENOMEM == err)
+                        break;
+                /* skip the page that ended the run, if it was not the
+                 * start of the next one */
+                if (0 == n)
+                        ++i;
+        }
+
+        return ret;
+}
+
+/*
+ * Write the n page buffers bufs[0..n) to the n consecutive disk blocks
+ * starting at 'block'. As in s5_read_run(), each page is queued on its
+ * own and the block request queue merges them.
+ */
+static int
+s5_write_run(s5fs_t *fs, uint32_t block, void **bufs, uint32_t n)
+{
+        bio_t bios[PF_CLEAN_CLUSTER_PAGES];
+        uint32_t i;
+        int ret = 0, err;
+
+        KASSERT(n <= PF_CLEAN_CLUSTER_PAGES);
+        for (i = 0; i < n; ++i) {
+                bio_init(&bios[i], fs->s5f_bdev, 1, block + i, 1, bufs[i]);
+                blockq_submit(&bios[i]);
+        }
+        for (i = 0; i < n; ++i) {
+                if (0 > (err = blockq_wait(&bios[i])))
+                        ret = err;
+        }
+
+        return ret;
+}
+
+/*
+ * Write back npages pages of the file starting at page 'pagenum' from
+ * pagebufs, for the vnode's cleanpages entry point. The pages are split
+ * into runs whose disk blocks are consecutive and each run is written
+ * with one request. A dirty page always has a block (s5fs_dirtypage
+ * allocates it), so a sparse page here has nothing to write and is
+ * skipped.
+ *
+ * Returns 0 or the last -errno from the block device.
+ */
+int
+s5_write_pages(struct vnode *vnode, uint32_t pagenum, void **pagebufs,
+               uint32_t npages)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        uint32_t i, n, first;
+        int ret = 0, err;
+
+        i = 0;
+        while (i < npages) {
+                if (0 == (first = get_block_by_index(vnode, pagenum + i))) {
+                        ++i;
+                        continue;
+                }
+                n = 1;
+                while ((i + n < npages)
+                       && (get_block_by_index(vnode, pagenum + i + n) == first + n))
+                        ++n;
+
+                if (0 > (err = s5_write_run(fs, first, pagebufs + i, n)))
+                        ret = err;
+                i += n;
         }
 
-        return has_read;
+        return ret;
 }
 
 /*
  * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
+ * there are no free blocks, return -ENOSPC. Only used by filesystems
+ * older than S5_BITMAP_VERSION.
  *
  * This will not initialize the contents of an allocated block; these
  * contents are undefined.
@@ -418,7 +609,7 @@ s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
  * and s5_dirty_super()
  */
 static int
-s5_alloc_block(s5fs_t *fs)
+s5_alloc_block_list(s5fs_t *fs)
 {
         /*  get the super block frame */
         s5_super_t* super_block = fs -> s5f_super;
@@ -433,7 +624,7 @@ s5_alloc_block(s5fs_t *fs)
         int to_return; 
         /*  get a free node */
         if(super_block -> s5s_nfree != 0){
-            to_return = super_block->s5s_free_blocks[super_block->s5s_nfree -- ];
+            to_return = super_block->s5s_free_blocks[-- super_block->s5s_nfree];
         }
         /*  move the next  */
         else{
@@ -467,7 +658,7 @@ s5_alloc_block(s5fs_t *fs)
  * the free list is actually free and is not resident.
  */
 static void
-s5_free_block(s5fs_t *fs, int blockno)
+s5_free_block_list(s5fs_t *fs, int blockno)
 {
         s5_super_t *s = fs->s5f_super;
 
@@ -499,6 +690,185 @@ s5_free_block(s5fs_t *fs, int blockno)
         unlock_s5(fs);
 }
 
+/*
+ * Search the block bitmap for free blocks in [from, to). Returns the
+ * first block of the first run of at least 'run' free blocks, -ENOSPC if
+ * there is none, or the error from reading the bitmap. If *first_free is
+ * 0 it is set to the first free block seen, run or not.
+ *
+ * Must be called with the fs locked.
+ */
+static int
+s5_bitmap_find(s5fs_t *fs, uint32_t from, uint32_t to, uint32_t run,
+               uint32_t *first_free)
+{
+        s5_super_t *s = fs->s5f_super;
+        pframe_t *pf;
+        uint32_t *map = NULL;
+        uint32_t b, bit, start = 0, len = 0, mapblock = (uint32_t) -1;
+        int err;
+
+        for (b = from; b < to; ++b) {
+                if (b / S5_BITS_PER_BLOCK != mapblock) {
+                        mapblock = b / S5_BITS_PER_BLOCK;
+                        if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs),
+                                                  s->s5s_bitmap_block + mapblock, &pf)))
+                                return err;
+                        map = (uint32_t *) pf->pf_addr;
+                }
+                bit = b % S5_BITS_PER_BLOCK;
+                /* skip whole words of used blocks */
+                if ((0 == bit % 32) && (0xffffffff == map[bit / 32]) && (b + 32 <= to)) {
+                        len = 0;
+                        b += 31;
+                        continue;
+                }
+                if (map[bit / 32] & (1U << (bit % 32))) {
+                        len = 0;
+                        continue;
+                }
+                if (0 == len++)
+                        start = b;
+                if (0 == *first_free)
+                        *first_free = b;
+                if (len >= run)
+                        return start;
+        }
+        return -ENOSPC;
+}
+
+/*
+ * Mark block b used (inuse != 0) or free in the block bitmap, keeping
+ * s5s_nfree_blocks in step. Must be called with the fs locked.
+ */
+static int
+s5_bitmap_set(s5fs_t *fs, uint32_t b, int inuse)
+{
+        s5_super_t *s = fs->s5f_super;
+        pframe_t *pf;
+        uint32_t *word, mask;
+        int err;
+
+        if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs),
+                                  s->s5s_bitmap_block + b / S5_BITS_PER_BLOCK, &pf)))
+                return err;
+        word = (uint32_t *) pf->pf_addr + (b % S5_BITS_PER_BLOCK) / 32;
+        mask = 1U << (b % 32);
+        KASSERT(!(*word & mask) == !!inuse && "block already in that state");
+
+        /* dirtying may block; keep the page resident until the word is
+         * changed, and only change it once the page is dirty */
+        pframe_pin(pf);
+        if (0 > (err = pframe_dirty(pf))) {
+                pframe_unpin(pf);
+                return err;
+        }
+        s5_dirty_super(fs);
+
+        if (inuse) {
+                *word |= mask;
+                s->s5s_nfree_blocks--;
+        } else {
+                *word &= ~mask;
+                s->s5s_nfree_blocks++;
+        }
+        pframe_unpin(pf);
+        return 0;
+}
+
+/*
+ * Allocate a free block from the bitmap, as close after 'goal' as we can:
+ * goal itself if it is free, otherwise the start of the next free extent
+ * of S5_ALLOC_EXTENT blocks (wrapping around to the start of the data
+ * area), otherwise the first free block seen. A goal of 0 means the
+ * caller has no preference, and we carry on from the last allocation.
+ * Giving each file's next block the block after its previous one keeps
+ * sequentially written files contiguous, and starting a file that cannot
+ * continue in place at the head of a free extent leaves it room to grow.
+ */
+static int
+s5_alloc_block_bitmap(s5fs_t *fs, uint32_t goal)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t data = s->s5s_bitmap_block + s->s5s_bitmap_nblocks;
+        uint32_t first_free = 0;
+        int ret;
+
+        lock_s5(fs);
+        if (0 == s->s5s_nfree_blocks) {
+                unlock_s5(fs);
+                return -ENOSPC;
+        }
+
+        if (0 == goal)
+                goal = fs->s5f_alloc_rotor;
+        if ((goal < data) || (goal >= s->s5s_num_blocks))
+                goal = data;
+
+        ret = s5_bitmap_find(fs, goal, goal + 1, 1, &first_free);
+        if (-ENOSPC == ret)
+                ret = s5_bitmap_find(fs, goal, s->s5s_num_blocks, S5_ALLOC_EXTENT, &first_free);
+        if (-ENOSPC == ret)
+                ret = s5_bitmap_find(fs, data, goal, S5_ALLOC_EXTENT, &first_free);
+        if ((-ENOSPC == ret) && (0 != first_free))
+                ret = first_free;
+
+        if (0 <= ret) {
+                int err;
+                if (0 > (err = s5_bitmap_set(fs, ret, 1)))
+                        ret = err;
+                else
+                        fs->s5f_alloc_rotor = ret + 1;
+        }
+        unlock_s5(fs);
+        return ret;
+}
+
+/*
+ * Allocate a new disk block, preferably 'goal' or soon after it (0 for no
+ * preference; filesystems without a block bitmap ignore it). Returns the
+ * block number, or -ENOSPC if the disk is full.
+ *
+ * Any copy of the block still cached by the block device (from its life
+ * as an indirect block or free list node) is dropped, so that it cannot
+ * later be written back over the block's new contents.
+ */
+static int
+s5_alloc_block(s5fs_t *fs, uint32_t goal)
+{
+        int block;
+
+        if (fs->s5f_super->s5s_version >= S5_BITMAP_VERSION)
+                block = s5_alloc_block_bitmap(fs, goal);
+        else
+                block = s5_alloc_block_list(fs);
+
+        if (0 < block)
+                pframe_invalidate_range(S5FS_TO_VMOBJ(fs), block, block + 1);
+        return block;
+}
+
+/*
+ * Given a filesystem and a block number, frees the given block in the
+ * filesystem, in the bitmap or on the free list as the version requires.
+ *
+ * This function may potentially block.
+ */
+static void
+s5_free_block(s5fs_t *fs, int blockno)
+{
+        int err;
+
+        if (fs->s5f_super->s5s_version >= S5_BITMAP_VERSION) {
+                lock_s5(fs);
+                err = s5_bitmap_set(fs, blockno, 0);
+                KASSERT(!err && "could not read the block bitmap");
+                unlock_s5(fs);
+        } else {
+                s5_free_block_list(fs, blockno);
+        }
+}
+
 /*
  * Creates a new inode from the free list and initializes its fields.
  * Uses S5_INODE_BLOCK to get the page from which to create the inode
@@ -563,6 +933,39 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
 }
 
 
+/*
+ * Free the indirect block 'block' of the given level (1 for a single
+ * indirect block) and every block under it.
+ */
+static void
+s5_free_indirect(s5fs_t *fs, uint32_t block, uint32_t level)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp
+                && "because never fails for block_device "
+                "vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != block);
+                if (0 == b[i])
+                        continue;
+                if (1 < level)
+                        s5_free_indirect(fs, b[i], level - 1);
+                else
+                        s5_free_block(fs, b[i]);
+        }
+
+        pframe_unpin(ibp);
+
+        s5_free_block(fs, block);
+}
+
 /*
  * Free an inode by freeing its disk blocks and putting it back on the
  * inode free list.
@@ -587,7 +990,7 @@ s5_free_inode(vnode_t *vnode)
                 || (S5_TYPE_BLK == inode->s5_type));
 
         /* free any direct blocks */
-        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+        for (i = 0; i < fs->s5f_ndirect; ++i) {
                 if (inode->s5_direct_blocks[i]) {
                         dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
                         s5_free_block(fs, inode->s5_direct_blocks[i]);
@@ -597,33 +1000,23 @@ s5_free_inode(vnode_t *vnode)
                 }
         }
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (unsigned)inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
-
-                pframe_unpin(ibp);
-
-                s5_free_block(fs, inode->s5_indirect_block);
+        if ((S5_TYPE_DATA == inode->s5_type)
+            || (S5_TYPE_DIR == inode->s5_type)) {
+                if (inode->s5_indirect_block)
+                        s5_free_indirect(fs, inode->s5_indirect_block, 1);
+                if (fs->s5f_nlevels >= 2 && inode->s5_direct_blocks[S5_DINDIRECT_SLOT])
+                        s5_free_indirect(fs, inode->s5_direct_blocks[S5_DINDIRECT_SLOT], 2);
+                if (fs->s5f_nlevels >= 3 && inode->s5_direct_blocks[S5_TINDIRECT_SLOT])
+                        s5_free_indirect(fs, inode->s5_direct_blocks[S5_TINDIRECT_SLOT], 3);
+                s5_bmap_cache_purge(fs, inode->s5_number);
+                s5_dirhash_purge(fs, inode->s5_number);
         }
 
         inode->s5_indirect_block = 0;
+        if (fs->s5f_nlevels >= 2) {
+                inode->s5_direct_blocks[S5_DINDIRECT_SLOT] = 0;
+                inode->s5_direct_blocks[S5_TINDIRECT_SLOT] = 0;
+        }
         inode->s5_type = S5_TYPE_FREE;
         s5_dirty_inode(fs, inode);
 
@@ -636,44 +1029,243 @@ s5_free_inode(vnode_t *vnode)
         s5_dirty_super(fs);
 }
 
+/* Number of entries in a directory */
+#define s5_dirent_count(vnode)  ((uint32_t)(vnode)->vn_len / sizeof(s5_dirent_t))
+
+/*
+ * Hash of a name for the directory index. The name ends at its first NUL
+ * or after len bytes, so both names from dirents and (unterminated) path
+ * components can be hashed.
+ */
+static uint32_t
+s5_dirhash_name(const char *name, size_t len)
+{
+        uint32_t h = 2166136261U;
+        size_t i;
+
+        for (i = 0; (i < len) && ('\0' != name[i]); ++i) {
+                h ^= (uint8_t) name[i];
+                h *= 16777619;
+        }
+        return h;
+}
+
+#define s5_dirhash_bucket(dh, h) (&(dh)->sdh_buckets[(h) & ((dh)->sdh_size - 1)])
+
+static void
+s5_dirhash_link(s5_dirhash_t *dh, uint32_t pos, uint32_t h)
+{
+        int32_t *b = s5_dirhash_bucket(dh, h);
+
+        KASSERT(pos < dh->sdh_size);
+        dh->sdh_next[pos] = *b;
+        *b = pos;
+}
+
+static void
+s5_dirhash_unlink(s5_dirhash_t *dh, uint32_t pos, uint32_t h)
+{
+        int32_t *p = s5_dirhash_bucket(dh, h);
+
+        while (*p != (int32_t) pos) {
+                KASSERT(0 <= *p && "entry missing from directory index");
+                p = &dh->sdh_next[*p];
+        }
+        *p = dh->sdh_next[pos];
+}
+
+static void
+s5_dirhash_drop(s5fs_t *fs, s5_dirhash_t *dh)
+{
+        list_remove(&dh->sdh_link);
+        --fs->s5f_ndirhash;
+        kfree(dh->sdh_buckets);
+        kfree(dh);
+}
+
+/* Forget the index of directory 'ino', if it has one */
+static void
+s5_dirhash_purge(s5fs_t *fs, uint32_t ino)
+{
+        s5_dirhash_t *dh;
+
+        list_iterate_begin(&fs->s5f_dirhash_list, dh, s5_dirhash_t, sdh_link) {
+                if (dh->sdh_ino == ino) {
+                        s5_dirhash_drop(fs, dh);
+                        return;
+                }
+        } list_iterate_end();
+}
+
+void
+s5_dirhash_purge_all(s5fs_t *fs)
+{
+        while (!list_empty(&fs->s5f_dirhash_list))
+                s5_dirhash_drop(fs, list_head(&fs->s5f_dirhash_list, s5_dirhash_t, sdh_link));
+}
+
+/*
+ * Index every entry of directory 'vnode'. Returns NULL if the directory
+ * is too small or too big to be worth indexing, or if we run out of
+ * memory; the caller then scans the directory instead.
+ */
+static s5_dirhash_t *
+s5_dirhash_build(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        uint32_t n = s5_dirent_count(vnode);
+        uint32_t size, pos, i;
+        s5_dirhash_t *dh, *victim;
+        s5_dirent_t *ent;
+        pframe_t *pf;
+
+        if (n < S5_DIRHASH_MIN_ENTRIES)
+                return NULL;
+        for (size = S5_DIRHASH_MIN_ENTRIES; size < 2 * n; size <<= 1)
+                ;
+        if (size > S5_DIRHASH_MAX_ENTRIES)
+                return NULL;
+
+        if (NULL == (dh = kmalloc(sizeof(s5_dirhash_t))))
+                return NULL;
+        if (NULL == (dh->sdh_buckets = kmalloc(2 * size * sizeof(int32_t)))) {
+                kfree(dh);
+                return NULL;
+        }
+        dh->sdh_next = dh->sdh_buckets + size;
+        dh->sdh_ino = vnode->vn_vno;
+        dh->sdh_size = size;
+        dh->sdh_busy = 1;
+        for (i = 0; i < size; ++i)
+                dh->sdh_buckets[i] = -1;
+
+        for (pos = 0; pos < n; pos += S5_DIRENTS_PER_BLOCK) {
+                if (0 > pframe_get(&vnode->vn_mmobj, pos / S5_DIRENTS_PER_BLOCK, &pf)) {
+                        kfree(dh->sdh_buckets);
+                        kfree(dh);
+                        return NULL;
+                }
+                ent = (s5_dirent_t *) pf->pf_addr;
+                for (i = 0; (i < S5_DIRENTS_PER_BLOCK) && (pos + i < n); ++i)
+                        s5_dirhash_link(dh, pos + i, s5_dirhash_name(ent[i].s5d_name, S5_NAME_LEN));
+        }
+
+        list_insert_head(&fs->s5f_dirhash_list, &dh->sdh_link);
+        if (++fs->s5f_ndirhash > S5_DIRHASH_MAX) {
+                list_iterate_reverse(&fs->s5f_dirhash_list, victim, s5_dirhash_t, sdh_link) {
+                        if (!victim->sdh_busy) {
+                                s5_dirhash_drop(fs, victim);
+                                break;
+                        }
+                } list_iterate_end();
+        }
+        dprintf("indexed %u entries of directory %d\n", n, vnode->vn_vno);
+        return dh;
+}
+
+/*
+ * Return the index of directory 'vnode', building it if the directory is
+ * big enough, or NULL if there is none. The index is marked busy so that
+ * it is not evicted while we block; release it with s5_dirhash_put().
+ * The caller must hold the directory's vn_mutex.
+ */
+static s5_dirhash_t *
+s5_dirhash_get(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_dirhash_t *dh;
+
+        list_iterate_begin(&fs->s5f_dirhash_list, dh, s5_dirhash_t, sdh_link) {
+                if (dh->sdh_ino == (uint32_t) vnode->vn_vno) {
+                        list_remove(&dh->sdh_link);
+                        list_insert_head(&fs->s5f_dirhash_list, &dh->sdh_link);
+                        KASSERT(!dh->sdh_busy);
+                        dh->sdh_busy = 1;
+                        return dh;
+                }
+        } list_iterate_end();
+
+        return s5_dirhash_build(vnode);
+}
+
+#define s5_dirhash_put(dh)                                              \
+        do {                                                            \
+                if (NULL != (dh))                                       \
+                        (dh)->sdh_busy = 0;                             \
+        } while (0)
+
+/*
+ * Find the entry with the given name in a directory, through its index
+ * 'dh' if it has one or by reading the directory a block at a time if
+ * not. On success the entry's position is stored in *posp and its inode
+ * number returned; otherwise returns -ENOENT or -errno.
+ */
+static int
+s5_dirent_locate(vnode_t *vnode, s5_dirhash_t *dh, const char *name,
+                 size_t namelen, uint32_t *posp)
+{
+        uint32_t n = s5_dirent_count(vnode);
+        uint32_t pos, i;
+        s5_dirent_t *ent;
+        pframe_t *pf;
+        int32_t p;
+        int err;
+
+        if (NULL != dh) {
+                p = *s5_dirhash_bucket(dh, s5_dirhash_name(name, namelen));
+                for (; 0 <= p; p = dh->sdh_next[p]) {
+                        if (0 > (err = pframe_get(&vnode->vn_mmobj,
+                                                  p / S5_DIRENTS_PER_BLOCK, &pf)))
+                                return err;
+                        ent = (s5_dirent_t *) pf->pf_addr + p % S5_DIRENTS_PER_BLOCK;
+                        if (name_match(ent->s5d_name, name, namelen)) {
+                                *posp = p;
+                                return ent->s5d_inode;
+                        }
+                }
+                return -ENOENT;
+        }
+
+        for (pos = 0; pos < n; pos += S5_DIRENTS_PER_BLOCK) {
+                if (0 > (err = pframe_get(&vnode->vn_mmobj, pos / S5_DIRENTS_PER_BLOCK, &pf)))
+                        return err;
+                ent = (s5_dirent_t *) pf->pf_addr;
+                for (i = 0; (i < S5_DIRENTS_PER_BLOCK) && (pos + i < n); ++i) {
+                        if (name_match(ent[i].s5d_name, name, namelen)) {
+                                *posp = pos + i;
+                                return ent[i].s5d_inode;
+                        }
+                }
+        }
+        return -ENOENT;
+}
+
 /*
  * Locate the directory entry in the given inode with the given name,
  * and return its inode number. If there is no entry with the given
  * name, return -ENOENT.
  *
- * You'll probably want to use s5_read_file and name_match
- *
- * You can either read one dirent at a time or optimize and read more.
- * Either is fine.
+ * Large directories are looked up through their hash index, small ones
+ * by scanning whole blocks of entries in the page cache.
  */
 int
 s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
+        s5_dirhash_t *dh;
+        uint32_t pos;
+        int ino;
 
         KASSERT(vnode != NULL);
         KASSERT(name != NULL);
         KASSERT(vnode -> vn_mode == S_IFDIR);
-        
+
         if(namelen == 0)
             return 0;
-        /*  read one by one.. */
-        int res = 0;
-        uint8_t buffer[sizeof(s5_dirent_t)];
-        s5_dirent_t* entry = (s5_dirent_t*)buffer;
-        int offset = 0;
-        while(offset < vnode -> vn_len){
-            int length = s5_read_file(vnode, offset, (char*)entry, sizeof(s5_dirent_t));
-            if(length != sizeof(s5_dirent_t))
-                break;
-            /* compare */
-            /*  if(name_match(name, entry -> s5d_name, namelen)){ */
-            if( strcmp(name, entry -> s5d_name) == 0){ 
-                res = entry -> s5d_inode;
-                return res;
-            }
-            offset += length;
-        }
-        return -ENOENT;
+
+        dh = s5_dirhash_get(vnode);
+        ino = s5_dirent_locate(vnode, dh, name, namelen, &pos);
+        s5_dirhash_put(dh);
+        return ino;
 }
 
 /*
@@ -682,83 +1274,76 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * -ENOENT.
  *
  * In order to ensure that the directory entries are contiguous in the
- * directory file, you will need to move the last directory entry into
- * the remove dirent's place.
+ * directory file, the last directory entry is moved into the removed
+ * dirent's place.
  *
  * When this function returns, the inode refcount on the removed file
  * should be decremented.
  *
- * It would be a nice extension to free blocks from the end of the
- * directory file which are no longer needed.
- *
- * Don't forget to dirty appropriate blocks!
- *
- * You probably want to use vget(), vput(), s5_read_file(),
- * s5_write_file(), and s5_dirty_inode().
+ * The directory's last block is kept when it empties; it is still mapped
+ * past the end of the directory and gets reused when the directory grows
+ * again, and s5_free_inode() frees it with the rest.
  */
 int
 s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
+        s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+        s5_inode_t *dir_inode = VNODE_TO_S5INODE(vnode);
+        s5_dirhash_t *dh;
+        s5_dirent_t last;
+        vnode_t *target_vno;
+        s5_inode_t *target_ino;
+        uint32_t pos, lastpos;
+        int ino, res;
+
         KASSERT(vnode != NULL);
         KASSERT(name != NULL);
         KASSERT(vnode -> vn_mode == S_IFDIR);
-        s5fs_t *s5 = VNODE_TO_S5FS(vnode);
 
-        /*  try to get the last entry.. */
-        int target_ino_num = -1;
-        uint8_t buffer[sizeof(s5_dirent_t)];
-        s5_dirent_t* entry = (s5_dirent_t*)buffer;
-        /*  the offset where should be replaced with the last entry */
-        int offset = 0;
-        while(1){
-            int length = s5_read_file(vnode, offset, (char*)entry, sizeof(s5_dirent_t));
-            if(length != sizeof(s5_dirent_t))
-                break;
-            /* compare */
-            if(strcmp(name, entry -> s5d_name) == 0){
-                target_ino_num = entry -> s5d_inode;
-                break;
-            }
-            offset += length;
+        dh = s5_dirhash_get(vnode);
+        if (0 > (ino = s5_dirent_locate(vnode, dh, name, namelen, &pos))) {
+                s5_dirhash_put(dh);
+                return ino;
         }
-        if(target_ino_num == -1)
-            return -ENOENT;
 
-        /*  decrement teh link count here */
-        vnode_t* target_vno = vget(vnode->vn_fs, target_ino_num);
-        s5_inode_t* target_ino = VNODE_TO_S5INODE(target_vno);
+        /*  decrement the link count here */
+        target_vno = vget(vnode->vn_fs, ino);
+        target_ino = VNODE_TO_S5INODE(target_vno);
         target_ino->s5_linkcount --;
-        /* update the block where the deleted entry locates in */
         s5_dirty_inode(s5, target_ino);
         vput(target_vno);
-        
-        /*  fetch the last */
-        if(offset != (int)(vnode->vn_len - sizeof(s5_dirent_t))){
-            int length = s5_read_file(vnode, vnode->vn_len - sizeof(s5_dirent_t), (char*)entry, sizeof(s5_dirent_t));
-            if(length != sizeof(s5_dirent_t))
-                return -1;
-            /* write to the hole */
-            length = s5_write_file(vnode, offset, (char*)entry, sizeof(s5_dirent_t));
-        }
-
-        /*  see if the last block could be freed */
-        int last_offset = S5_DATA_OFFSET(vnode->vn_len - sizeof(s5_dirent_t));
-        if(last_offset == 0){
-            int last_index = S5_DATA_BLOCK(vnode->vn_len - sizeof(s5_dirent_t));
-            uint32_t free_block_num = get_block_by_index(vnode, last_index);
-            /*  free it  */
-            s5_free_block(s5, free_block_num);
-        }
-
-        s5_inode_t* dir_inode = VNODE_TO_S5INODE(vnode);
-        /*  update the directory vnode length */
+
+        /*  move the last entry into the hole */
+        lastpos = s5_dirent_count(vnode) - 1;
+        if (pos != lastpos) {
+                res = s5_read_file(vnode, lastpos * sizeof(s5_dirent_t),
+                                   (char *) &last, sizeof(s5_dirent_t));
+                if (res == sizeof(s5_dirent_t))
+                        res = s5_write_file(vnode, pos * sizeof(s5_dirent_t),
+                                            (char *) &last, sizeof(s5_dirent_t));
+                if (res != sizeof(s5_dirent_t)) {
+                        /* the index no longer matches the directory */
+                        if (NULL != dh)
+                                s5_dirhash_drop(s5, dh);
+                        return (res < 0) ? res : -EIO;
+                }
+        }
+
+        if (NULL != dh) {
+                s5_dirhash_unlink(dh, pos, s5_dirhash_name(name, namelen));
+                if (pos != lastpos) {
+                        s5_dirhash_unlink(dh, lastpos, s5_dirhash_name(last.s5d_name, S5_NAME_LEN));
+                        s5_dirhash_link(dh, pos, s5_dirhash_name(last.s5d_name, S5_NAME_LEN));
+                }
+                s5_dirhash_put(dh);
+        }
+
+        /*  update the directory length */
         vnode->vn_len -= sizeof(s5_dirent_t);
         dir_inode -> s5_size -= sizeof(s5_dirent_t);
-        /*  update the vnode content on disk.. */
         s5_dirty_inode(s5, dir_inode);
 
         return 0;
-
 }
 
 /*
@@ -768,102 +1353,138 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * When this function returns, the inode refcount on the file that was linked to
  * should be incremented.
  *
- * Remember to incrament the ref counts appropriately
- *
- * You probably want to use s5_find_dirent(), s5_write_file(), and s5_dirty_inode().
+ * The new entry goes at the end of the directory and into its index, if
+ * it has one.
  */
 int
 s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 {
+        s5fs_t *s5 = VNODE_TO_S5FS(parent);
+        s5_inode_t *child_inode = VNODE_TO_S5INODE(child);
+        s5_dirhash_t *dh;
+        s5_dirent_t new_entry;
+        uint32_t pos;
+        int res;
+
         KASSERT(parent != NULL);
         KASSERT(parent->vn_mode == S_IFDIR);
         KASSERT(child != NULL);
         KASSERT(name != NULL);
-        s5fs_t *s5 = VNODE_TO_S5FS(parent);
+
+        /* the name must leave room for its NUL */
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+
+        dh = s5_dirhash_get(parent);
         /*  if already exists? */
-        if(s5_find_dirent(parent, name, namelen) >= 0){
-            return -1;
+        if (-ENOENT != (res = s5_dirent_locate(parent, dh, name, namelen, &pos))) {
+                s5_dirhash_put(dh);
+                return (res < 0) ? res : -EEXIST;
         }
 
         /*  construct a dirent */
-        s5_dirent_t* new_entry = kmalloc(sizeof(s5_dirent_t));
-        memset(new_entry, 0, sizeof(s5_dirent_t));
-        s5_inode_t* child_inode = VNODE_TO_S5INODE(child);
-        new_entry->s5d_inode = child_inode -> s5_number;
-        memcpy(new_entry->s5d_name, name, namelen);
-        new_entry->s5d_name[namelen] = '\0';
+        memset(&new_entry, 0, sizeof(s5_dirent_t));
+        new_entry.s5d_inode = child_inode -> s5_number;
+        memcpy(new_entry.s5d_name, name, namelen);
+        new_entry.s5d_name[namelen] = '\0';
 
         /* insert the new entry */
-        int length = s5_write_file(parent, parent -> vn_len, (char*)new_entry, sizeof(s5_dirent_t));
-        if(length != sizeof(s5_dirent_t)){
-            kfree(new_entry);
-            return length;
+        pos = s5_dirent_count(parent);
+        res = s5_write_file(parent, parent -> vn_len, (char *) &new_entry, sizeof(s5_dirent_t));
+        if (res != sizeof(s5_dirent_t)) {
+                s5_dirhash_put(dh);
+                return (res < 0) ? res : -ENOSPC;
         }
-    
+
+        if (NULL != dh) {
+                /* out of room; the next lookup rebuilds it bigger */
+                if (pos >= dh->sdh_size) {
+                        s5_dirhash_drop(s5, dh);
+                } else {
+                        s5_dirhash_link(dh, pos, s5_dirhash_name(name, namelen));
+                        s5_dirhash_put(dh);
+                }
+        }
+
         /*  increase the child refcount */
         child_inode->s5_linkcount ++;
-        /* update the block where the deleted entry locates in */
         s5_dirty_inode(s5, child_inode);
-        kfree(new_entry);
         return 0;
 }
 
+/*
+ * Count the blocks in use under the indirect block 'block' of the given
+ * level, including the indirect blocks themselves. Returns -errno if an
+ * indirect block could not be read.
+ */
+static int
+s5_count_indirect(s5fs_t *fs, uint32_t block, uint32_t level)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+        int count = 1, n;
+
+        if (0 > (n = pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp)))
+                return n;
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (0 == b[i])
+                        continue;
+                if (1 == level) {
+                        count++;
+                } else if (0 > (n = s5_count_indirect(fs, b[i], level - 1))) {
+                        count = n;
+                        break;
+                } else {
+                        count += n;
+                }
+        }
+
+        pframe_unpin(ibp);
+        return count;
+}
+
 /*
  * Return the number of blocks that this inode has allocated on disk.
- * This should include the indirect block, but not include sparse
+ * This should include the indirect blocks, but not include sparse
  * blocks.
  *
  * This is only used by s5fs_stat().
- *
- * You'll probably want to use pframe_get().
  */
 int
 s5_inode_blocks(vnode_t *vnode)
 {
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        uint32_t roots[S5_MAX_INDIRECT_LEVEL];
+        uint32_t i;
+        int count = 0, n;
 
         KASSERT(vnode != NULL);
-        s5_inode_t* inode = VNODE_TO_S5INODE(vnode);
-        s5fs_t* s5 = VNODE_TO_S5FS(vnode);
-        struct mmobj *s5obj = S5FS_TO_VMOBJ(s5); 
-
-        /* count */
-        int file_size = vnode -> vn_len;
-        /*  total possible number of blocks */
-        int total_possible = S5_DATA_BLOCK(file_size);
-        int block_count = 0;
-        int indirect_block = inode-> s5_indirect_block;
-        pframe_t* indirect_block_frame = NULL;
-        int i =0;
-        for(; i < total_possible; i ++){
-            if( i < S5_NDIRECT_BLOCKS){
-                if(inode->s5_direct_blocks[i] != 0)
-                    block_count ++;
-            }
-            else{
-                /*  get the frame of indirect block */
-                if(indirect_block == 0){
-                    /*  following are all sparse */
-                    break;
-                }
-                else{
-                    if(indirect_block_frame == NULL){
-                        block_count ++;
-                        int res = pframe_get(s5obj, indirect_block, &indirect_block_frame);
-                        if(res < 0){
-                            return res;
-                        }
-                        pframe_pin(indirect_block_frame);
-                    }
-                    uint32_t* block_array = (uint32_t*)indirect_block_frame->pf_addr;
-                    if( block_array[ i - S5_NDIRECT_BLOCKS] != 0)
-                        block_count ++;
-                }
-            }
+
+        for (i = 0; i < fs->s5f_ndirect; ++i) {
+                if (inode->s5_direct_blocks[i])
+                        count++;
+        }
+
+        /* device files keep their device id in the indirect block slot */
+        if ((S5_TYPE_DATA != inode->s5_type) && (S5_TYPE_DIR != inode->s5_type))
+                return count;
+
+        roots[0] = inode->s5_indirect_block;
+        roots[1] = (fs->s5f_nlevels >= 2) ? inode->s5_direct_blocks[S5_DINDIRECT_SLOT] : 0;
+        roots[2] = (fs->s5f_nlevels >= 3) ? inode->s5_direct_blocks[S5_TINDIRECT_SLOT] : 0;
+        for (i = 0; i < S5_MAX_INDIRECT_LEVEL; ++i) {
+                if (0 == roots[i])
+                        continue;
+                if (0 > (n = s5_count_indirect(fs, roots[i], i + 1)))
+                        return n;
+                count += n;
         }
-        
-        if(total_possible > S5_NDIRECT_BLOCKS && indirect_block != 0)
-            pframe_unpin(indirect_block_frame);
 
-        return block_count;
+        return count;
 }
 
@@ -166,6 +166,11 @@ vfs_shutdown()
                       "filesystem!!! This shouldn't happen!!\n");
         }
 
+        dcache_purge_fs(fs);
+        /* whatever the fs's umount does, vnodes kept for reuse must not
+         * outlive it */
+        vnode_purge_lru(fs);
+
         if (vn->vn_fs->fs_op->umount) {
                 ret = vn->vn_fs->fs_op->umount(fs);
         } else {
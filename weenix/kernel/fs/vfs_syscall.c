@@ -263,9 +263,11 @@ do_mknod(const char *path, int mode, unsigned devid)
             return -EEXIST;
         }
         
-        if(res == -ENOENT)
+        if(res == -ENOENT){
         /*  make the node */
             res = dir_vnode -> vn_ops -> mknod(dir_vnode, name, namelen, mode, devid);
+            dcache_remove(dir_vnode, name, namelen);
+        }
         
         vput(dir_vnode); 
         if(res_vnode){
@@ -314,8 +316,10 @@ do_mkdir(const char *path)
             else return res;
         }
 
-        if(res == -ENOENT)
+        if(res == -ENOENT){
             res = dir_vnode -> vn_ops -> mkdir(dir_vnode, name, namelen);
+            dcache_remove(dir_vnode, name, namelen);
+        }
           
         vput(dir_vnode);
         
@@ -366,6 +370,7 @@ do_rmdir(const char *path)
         }
 
         res = dir_vnode->vn_ops->rmdir(dir_vnode, name, namelen);
+        dcache_remove(dir_vnode, name, namelen);
         vput(dir_vnode);
         return res;
 }
@@ -415,6 +420,7 @@ do_unlink(const char *path)
         }
 
         res = dir_vnode->vn_ops->unlink(dir_vnode, name, namelen);
+        dcache_remove(dir_vnode, name, namelen);
         vput(dir_vnode);
         vput(res_vnode);
         return res;
@@ -479,6 +485,7 @@ do_link(const char *from, const char *to)
     }
     
     res = dir_vnode->vn_ops->link(from_vnode, dir_vnode, name, namelen);
+    dcache_remove(dir_vnode, name, namelen);
     vput(from_vnode);
     vput(dir_vnode);
     return res;
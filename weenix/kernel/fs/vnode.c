@@ -6,6 +6,7 @@
  */
 
 #include "kernel.h"
+#include "config.h"
 #include "util/init.h"
 #include "util/string.h"
 #include "util/printf.h"
@@ -14,6 +15,8 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "mm/slab.h"
+#include "mm/page.h"
+#include "drivers/blockq.h"
 #include "proc/sched.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
@@ -21,11 +24,31 @@
 
 static slab_allocator_t *vnode_allocator;
 
+/* Every vnode is on vnode_inuse_list, which is only walked when a file
+ * system is unmounted, and on the hash chain for its fs and vnode number,
+ * which vget searches. */
 static list_t vnode_inuse_list;
+static list_t vnode_hash[VNODE_HASH_SIZE];
+
+#define vnode_bucket(fs, vno) \
+        (&vnode_hash[(((uint32_t) (fs) >> 4) ^ ((uint32_t) (vno) * 2654435761U)) \
+                     & (VNODE_HASH_SIZE - 1)])
+
+/* Unreferenced vnodes of linked files, most recently used first */
+static list_t vnode_lru;
+static int vnode_nlru = 0;
+
+static uint32_t vnode_nhits = 0;        /* vget found it in use */
+static uint32_t vnode_nreuses = 0;      /* vget found it unreferenced */
+static uint32_t vnode_nmisses = 0;      /* vget had to read it in */
+static uint32_t vnode_nreclaims = 0;    /* unreferenced vnodes freed */
+
+static void vnode_destroy(vnode_t *vn);
 
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
 static int special_file_read(vnode_t *file, off_t offset, void *buf, size_t count);
+static int blockdev_file_read(vnode_t *file, off_t offset, void *buf, size_t count);
 static int special_file_write(vnode_t *file, off_t offset, const void *buf, size_t count);
 static int special_file_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 static int special_file_stat(vnode_t *vnode, struct stat *ss);
@@ -40,6 +63,7 @@ static int  vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **p
 static int  vreadpage(mmobj_t *o, pframe_t *pf);
 static int  vdirtypage(mmobj_t *o, pframe_t *pf);
 static int  vcleanpage(mmobj_t *o, pframe_t *pf);
+static int  vcleanpages(mmobj_t *o, pframe_t **pfs, uint32_t npages);
 
 static mmobj_ops_t vnode_mmobj_ops = {
         .ref = vo_vref,
@@ -47,7 +71,8 @@ static mmobj_ops_t vnode_mmobj_ops = {
         .lookuppage = vlookuppage,
         .fillpage = vreadpage,
         .dirtypage = vdirtypage,
-        .cleanpage = vcleanpage
+        .cleanpage = vcleanpage,
+        .cleanpages = vcleanpages
 };
 
 /* vnode operations tables for special files: */
@@ -70,7 +95,7 @@ static vnode_ops_t bytedev_spec_vops = {
 };
 
 static vnode_ops_t blockdev_spec_vops = {
-        .read = NULL,
+        .read = blockdev_file_read,
         .write = NULL,
         .mmap = NULL,
         .create = NULL,
@@ -93,7 +118,12 @@ static vnode_ops_t blockdev_spec_vops = {
 static __attribute__((unused)) void
 vnode_init(void)
 {
+        int i;
+
         list_init(&vnode_inuse_list);
+        for (i = 0; i < VNODE_HASH_SIZE; ++i)
+                list_init(&vnode_hash[i]);
+        list_init(&vnode_lru);
         vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
 }
 init_func(vnode_init);
@@ -120,7 +150,7 @@ vget(struct fs *fs, ino_t vno)
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        list_iterate_begin(vnode_bucket(fs, vno), vn, vnode_t, vn_hlink) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -135,6 +165,21 @@ find:
                                 goto find;
                         }
 
+                        if (0 == vn->vn_refcount) {
+                                /* kept for reuse; bring it back */
+                                list_remove(&vn->vn_lrulink);
+                                vnode_nlru--;
+                                vnode_nreuses++;
+                                vn->vn_refcount = 1;
+#ifdef __MOUNTING__
+                                /* a mount point is referenced by its
+                                 * mount, so is never kept for reuse */
+                                KASSERT(vn->vn_mount == vn);
+#endif
+                                return vn;
+                        }
+                        vnode_nhits++;
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -153,6 +198,8 @@ find:
         /* if we got here, we didn't find the vnode. */
         /*   alloc a new vnode: */
         vn = slab_obj_alloc(vnode_allocator);
+        if (!vn && vnode_reclaim(1))
+                goto find;
         if (!vn) {
                 dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                     "will then re-attempt to vget vnode later %d of fs %p\n", vno, fs);
@@ -168,6 +215,8 @@ find:
         kmutex_init(&vn->vn_mutex);
         mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
         sched_queue_init(&vn->vn_waitq);
+        /* so that a first read of page 0 counts as sequential */
+        vn->vn_ra_prev = (uint32_t) -1;
 
 #ifdef __MOUNTING__
         vn->vn_mount = vn;
@@ -185,6 +234,8 @@ find:
          */
         vn->vn_flags |= VN_BUSY;
         list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head(vnode_bucket(fs, vno), &vn->vn_hlink);
+        vnode_nmisses++;
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -275,7 +326,30 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(0 == vn->vn_nrespages);
+
+        /* Keep it for the next vget if the file still exists. The root
+         * vnode is only let go of when its fs is unmounted, so it never
+         * is kept. */
+        if ((vn != vn->vn_fs->fs_root) && vn->vn_fs->fs_op->query_vnode(vn)) {
+                list_insert_head(&vnode_lru, &vn->vn_lrulink);
+                if (++vnode_nlru > VNODE_CACHE_MAX)
+                        vnode_reclaim(vnode_nlru - VNODE_CACHE_MAX);
+                return;
+        }
+
+        vnode_destroy(vn);
+}
+
+/*
+ * Free a vnode that has no references, calling the fs's delete_vnode
+ * entry point first. May block.
+ */
+static void
+vnode_destroy(vnode_t *vn)
+{
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
 
@@ -298,9 +372,28 @@ vput(struct vnode *vn)
         sched_broadcast_on(&vn->vn_waitq);
 
         list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+        list_remove(&vn->vn_hlink);
         slab_obj_free(vnode_allocator, vn);
 }
 
+int
+vnode_reclaim(int n)
+{
+        vnode_t *vn;
+        int freed = 0;
+
+        while ((freed < n) && !list_empty(&vnode_lru)) {
+                vn = list_tail(&vnode_lru, vnode_t, vn_lrulink);
+                list_remove(&vn->vn_lrulink);
+                vnode_nlru--;
+                vnode_nreclaims++;
+                /* this may block, but vn is off the list and busy */
+                vnode_destroy(vn);
+                freed++;
+        }
+        return freed;
+}
+
 int
 vfs_is_in_use(fs_t *fs)
 {
@@ -356,44 +449,75 @@ vfs_is_in_use(fs_t *fs)
 }
 
 
-void
+int
 vnode_flush_all(struct fs *fs)
 {
         vnode_t *v;
-        pframe_t *p;
-        int err;
+        int err, ret = 0;
 
+        /* Only vnodes whose page tree still carries a dirty tag need
+         * writing back, and pframe_clean_range visits only their dirty
+         * pages, so restarting after blocking is cheap. A vnode that
+         * could not be cleaned (a dirty page is pinned, or the write
+         * failed) stays dirty, so it is marked and not tried again. */
 clean:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
-                        if (pframe_is_dirty(p)) {
-                                if (0 > (err = pframe_clean(p))) {
-                                        dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean page %d of "
-                                            "vnode %ld of fs %p of type %s\n", p->pf_pagenum,
-                                            (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
-                                }
-                                KASSERT((!err)
-                                        && "as things presently stand, "
-                                        "this shouldn't happen");
-                                /* This may have blocked. */
-                                goto clean;
+                if ((v->vn_fs == fs) && !(v->vn_flags & VN_FLUSHFAILED)
+                    && radix_tagged(&v->vn_mmobj.mmo_pages, PF_TAG_DIRTY)) {
+                        if (0 > (err = pframe_clean_range(&v->vn_mmobj, 0, (uint32_t) -1))) {
+                                dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean pages of "
+                                    "vnode %ld of fs %p of type %s: %d\n",
+                                    (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type, err);
+                                v->vn_flags |= VN_FLUSHFAILED;
+                                ret = err;
                         }
-                } list_iterate_end();
+                        /* This may have blocked. */
+                        goto clean;
+                }
         } list_iterate_end();
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
-         * Now, uncache all of them: */
-          list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
-                        KASSERT(!pframe_is_dirty(p));
-                        pframe_free(p);
-                } list_iterate_end();
+         * Now, uncache all of them. Hold a reference so freeing the last
+         * page does not free the vnode out from under us. */
+        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+                if ((v->vn_fs == fs) && (0 < v->vn_refcount)) {
+                        vref(v);
+                        pframe_invalidate_range(&v->vn_mmobj, 0, (uint32_t) -1);
+                        vput(v);
+                }
+        } list_iterate_end();
+
+        /* and free the ones that are only being kept for reuse */
+        vnode_purge_lru(fs);
+
+        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+                if (v->vn_fs == fs)
+                        v->vn_flags &= ~VN_FLUSHFAILED;
         } list_iterate_end();
+        return ret;
 }
 
 
+/*
+ * Free the vnodes of fs that vput kept for reuse. May block.
+ */
+void
+vnode_purge_lru(struct fs *fs)
+{
+        vnode_t *v;
+
+again:
+        list_iterate_begin(&vnode_lru, v, vnode_t, vn_lrulink) {
+                if (v->vn_fs == fs) {
+                        list_remove(&v->vn_lrulink);
+                        vnode_nlru--;
+                        vnode_destroy(v);
+                        /* This may have blocked. */
+                        goto again;
+                }
+        } list_iterate_end();
+}
+
 /*
  * Return the number of vnodes from the given filesystem which are in use.
  */
@@ -410,6 +534,35 @@ vnode_inuse(struct fs *fs)
         return n;
 }
 
+size_t
+vnode_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+        uint32_t i, len, used = 0, maxlen = 0;
+        list_link_t *link;
+
+        KASSERT(NULL != buf);
+
+        for (i = 0; i < VNODE_HASH_SIZE; ++i) {
+                len = 0;
+                for (link = vnode_hash[i].l_next; link != &vnode_hash[i]; link = link->l_next)
+                        ++len;
+                if (len)
+                        ++used;
+                maxlen = MAX(maxlen, len);
+        }
+
+        iprintf(&buf, &size, "unreferenced: %d (max %d)\n", vnode_nlru, VNODE_CACHE_MAX);
+        iprintf(&buf, &size, "hits:     %u\n", vnode_nhits);
+        iprintf(&buf, &size, "reuses:   %u\n", vnode_nreuses);
+        iprintf(&buf, &size, "misses:   %u\n", vnode_nmisses);
+        iprintf(&buf, &size, "reclaims: %u\n", vnode_nreclaims);
+        iprintf(&buf, &size, "hash:     %u of %u buckets used, longest chain %u\n",
+                used, VNODE_HASH_SIZE, maxlen);
+
+        return osize - size;
+}
+
 static void
 init_special_vnode(vnode_t *vn)
 {
@@ -443,6 +596,39 @@ special_file_read(vnode_t *file, off_t offset, void *buf, size_t count)
         return res;
 }
 
+/*
+ * Read from a block device, straight from the disk: the blocks are read
+ * through the device's request queue and not through any cache, so this
+ * shows what has actually been written back. At most the rest of the
+ * block containing offset is read; a read that would cross into the next
+ * block comes up short.
+ */
+static int
+blockdev_file_read(vnode_t *file, off_t offset, void *buf, size_t count)
+{
+        char *page;
+        size_t off;
+        int ret;
+
+        KASSERT(S_ISBLK(file->vn_mode));
+
+        if (NULL == file->vn_bdev)
+                return -ENXIO;
+        if (0 > offset)
+                return -EINVAL;
+        off = offset % BLOCK_SIZE;
+        count = MIN(count, BLOCK_SIZE - off);
+
+        if (NULL == (page = page_alloc()))
+                return -ENOMEM;
+        if (0 == (ret = blockq_read(file->vn_bdev, page, offset / BLOCK_SIZE, 1))) {
+                memcpy(buf, page + off, count);
+                ret = count;
+        }
+        page_free(page);
+        return ret;
+}
+
 /*
  * If the file is a byte device find the file's
  * bytedev_t, and call its write. Return what write returns.
@@ -593,3 +779,30 @@ vcleanpage(mmobj_t *o, pframe_t *pf)
         vnode_t *v = mmobj_to_vnode(o);
         return v->vn_ops->cleanpage(v, (int) PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
+
+static int
+vcleanpages(mmobj_t *o, pframe_t **pfs, uint32_t npages)
+{
+        void *bufs[PF_CLEAN_CLUSTER_PAGES];
+        uint32_t i;
+        int ret;
+
+        KASSERT(NULL != pfs);
+        KASSERT(NULL != o);
+        KASSERT(0 < npages && npages <= PF_CLEAN_CLUSTER_PAGES);
+
+        vnode_t *v = mmobj_to_vnode(o);
+        if (NULL == v->vn_ops->cleanpages) {
+                for (i = 0; i < npages; ++i) {
+                        if (0 > (ret = vcleanpage(o, pfs[i])))
+                                return ret;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < npages; ++i) {
+                KASSERT(pfs[i]->pf_pagenum == pfs[0]->pf_pagenum + i);
+                bufs[i] = pfs[i]->pf_addr;
+        }
+        return v->vn_ops->cleanpages(v, (int) PN_TO_ADDR(pfs[0]->pf_pagenum), bufs, npages);
+}
@@ -25,10 +25,26 @@
 #define KMEM_FRAC(x)               (((x)>>2)+((x)>>3)) /* 37.5%-ish */
 
 /*     pframe/mmobj-system-related: */
-#define PF_HASH_SIZE                  17 /* Number of buckets in pn/mmobj->pframe hash */
+#define PF_HASH_SIZE                  64 /* Initial buckets in pn/mmobj->pframe hash (power of 2) */
+#define PF_HASH_MAX_LOAD               2 /* Grow the hash past this many pages per bucket */
+#define PF_HASH_MAX_SHIFT             16 /* Never grow past 2^16 buckets (128 pages of table) */
 /*         Pageout-related: */
 #define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
 #define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+#define PF_INACTIVE_MIN_SHIFT          2 /* keep >= 25% of unpinned pages inactive */
+#define PF_CLEAN_CLUSTER_PAGES        16 /* most dirty pages written back together */
+/*         Writeback-related (fractions of the pages the cache could use): */
+#define PF_DIRTY_BG_SHIFT              4 /* flushd writes back above 6.25% dirty */
+#define PF_DIRTY_MAX_SHIFT             3 /* writers are throttled above 12.5% dirty */
+#define PF_DIRTY_EXPIRE              256 /* flushd writes back a page this many dirtyings old */
+
+/*     block request queue configuration parameters */
+#define BLOCKQ_MAX_BLOCKS             32 /* most blocks in one merged request */
+#define BLOCKQ_READ_EXPIRE             8 /* a read waits for at most this many requests */
+#define BLOCKQ_WRITE_EXPIRE           32 /* ... and a write for this many */
+/*     page fault configuration parameters */
+#define FAULT_AROUND_PAGES            16 /* window of resident pages mapped on a fault (power of 2) */
+#define TLB_BATCH_MAX                 16 /* pages flushed one by one before flushing the whole TLB */
 
 
 /*
@@ -42,6 +58,14 @@
 #define NAME_LEN                28      /* maximum directory entry length */
 #define NFILES                  32      /* maximum number of open files */
 
+#define READAHEAD_MIN_PAGES     4       /* first sequential readahead window */
+#define READAHEAD_MAX_PAGES     32      /* largest readahead window */
+#define READAHEAD_QUEUE_SIZE    16      /* pending readahead requests */
+#define VNODE_HASH_SIZE         512     /* in-core vnode table buckets (power of 2) */
+#define VNODE_CACHE_MAX         512     /* unreferenced vnodes kept for reuse */
+#define DCACHE_HASH_SIZE        256     /* name lookup cache buckets (power of 2) */
+#define DCACHE_MAX_ENTRIES      1024    /* cached names, positive and negative */
+
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV  "disk0" /* device containing root filesystem */
 
@@ -0,0 +1,92 @@
+/*
+ *       FILE: blockq.h
+ *      DESCR: request queues in front of block devices
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "drivers/blockdev.h"
+#include "proc/sched.h"
+#include "util/list.h"
+
+/*
+ * A request to read or write a run of blocks. The caller owns the bio
+ * (it usually lives on the caller's stack) and must leave it alone from
+ * blockq_submit() until the request has completed.
+ */
+typedef struct bio {
+        blockdev_t     *bio_bdev;
+        int             bio_write;      /* 0 to read, 1 to write */
+        blocknum_t      bio_block;      /* first block */
+        size_t          bio_count;      /* number of blocks */
+        char           *bio_buf;        /* page-aligned */
+
+        /* Called in the context of the thread that completes the request,
+         * which must not block in it. May be NULL. */
+        void          (*bio_done)(struct bio *bio);
+        void           *bio_private;
+
+        /* Fields that should be ignored by callers: */
+        int             bio_status;     /* 0 or -errno once complete */
+        int             bio_complete;
+        ktqueue_t       bio_waitq;      /* waiters for completion */
+        uint32_t        bio_queued;     /* bq_seq when queued */
+        uint32_t        bio_deadline;   /* served by this bq_seq */
+        list_link_t     bio_link;       /* on bq_sorted, by block */
+        list_link_t     bio_flink;      /* on bq_fifo, by arrival */
+} bio_t;
+
+/**
+ * Set up a bio.
+ *
+ * @param bio the bio to initialize
+ * @param bdev the block device
+ * @param write 0 to read, 1 to write
+ * @param block the number of the first block
+ * @param count the number of blocks
+ * @param buf the memory to read into or write from (must be page-aligned)
+ */
+void bio_init(bio_t *bio, blockdev_t *bdev, int write, blocknum_t block,
+              size_t count, char *buf);
+
+/**
+ * Queue a request. Requests are carried out in the order that suits the
+ * device rather than the order they were submitted in, and adjacent ones
+ * may be carried out together. This blocks while the request overlaps
+ * one that is already queued, until that one completes. If the queue is
+ * not running (early at boot or after blockq_shutdown()) the request is
+ * carried out right away, and this blocks until it is done.
+ *
+ * @param bio the request
+ */
+void blockq_submit(bio_t *bio);
+
+/**
+ * Wait for a submitted request to complete.
+ *
+ * @param bio the request
+ * @return 0 on success, -errno on failure
+ */
+int blockq_wait(bio_t *bio);
+
+/**
+ * Read count blocks starting at block into buf through the queue, and
+ * wait for them. The same interface as the device's read_block.
+ */
+int blockq_read(blockdev_t *bdev, char *buf, blocknum_t block, size_t count);
+
+/**
+ * Write count blocks starting at block from buf through the queue, and
+ * wait for them. The same interface as the device's write_block.
+ */
+int blockq_write(blockdev_t *bdev, const char *buf, blocknum_t block, size_t count);
+
+/**
+ * Carry out whatever is still queued and stop the queue's thread.
+ * Requests submitted afterwards are carried out synchronously.
+ */
+void blockq_shutdown(void);
+
+size_t blockq_info(const void *data, char *buf, size_t size);
@@ -24,8 +24,12 @@
 #define S5_NDIRECT_BLOCKS       28
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
+/* Largest file before S5_INDIRECT_VERSION; see s5f_max_blocks for the
+ * limit on a mounted fs */
 #define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
 #define S5_MAX_FILE_SIZE S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
+/* Most pages s5_read_file() and s5_write_file() hold pinned at once */
+#define S5_RW_BATCH_PAGES       16
 
 #define S5_NAME_LEN             28
 #define S5_TYPE_FREE            0x0
@@ -35,10 +39,38 @@
 #define S5_TYPE_BLK             0x8
 
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      5
+#define S5_OLDEST_VERSION       3       /* oldest version we can still mount */
+#define S5_BITMAP_VERSION       4       /* first version with a block bitmap */
+#define S5_INDIRECT_VERSION     5       /* first version with double and
+                                         * triple indirect blocks */
+
+/*
+ * From S5_INDIRECT_VERSION on, the last two slots of s5_direct_blocks
+ * hold the double and triple indirect blocks instead of data blocks, so
+ * a file has S5_NDIRECT_BLOCKS - 2 direct blocks.
+ */
+#define S5_DINDIRECT_SLOT       (S5_NDIRECT_BLOCKS - 2)
+#define S5_TINDIRECT_SLOT       (S5_NDIRECT_BLOCKS - 1)
+#define S5_MAX_INDIRECT_LEVEL   3
+
+/* Blocks whose free/used state is kept in one block of the bitmap */
+#define S5_BITS_PER_BLOCK       (S5_BLOCK_SIZE * 8)
+
+/* When the block after a file's last block is taken, look for a free
+ * extent at least this long to continue the file in */
+#define S5_ALLOC_EXTENT         16
 
 /* Number of blocks stored in the indirect block */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
+#define S5_NIDIRECT_SHIFT       10      /* log2(S5_NIDIRECT_BLOCKS) */
+
+/* Data blocks reachable through an indirect block of the given level
+ * (1 for single, 2 for double, 3 for triple indirect) */
+#define S5_INDIRECT_SPAN(level) ((uint32_t)1 << ((level) * S5_NIDIRECT_SHIFT))
+
+/* Largest file block whose offset still fits in an off_t */
+#define S5_MAX_OFF_BLOCKS       ((uint32_t)0x7fffffff / S5_BLOCK_SIZE)
 
 /* Given a file offset, returns the block number that it is in */
 #define S5_DATA_BLOCK(seekptr)  ((seekptr) / S5_BLOCK_SIZE)
@@ -58,7 +90,8 @@
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs)  ( (s5fs_t *)((fs)->fs_i))
 
-/* each node of the free block list looks like this: */
+/* each node of the free block list (versions before S5_BITMAP_VERSION)
+ * looks like this: */
 /*
 typedef struct s5_fbl_node {
         int free_blocks[S5_NBLKS_PER_FNODE-1];
@@ -81,6 +114,16 @@ typedef struct s5_super {
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+
+        /* Version S5_BITMAP_VERSION and later: free blocks are tracked by a
+         * bitmap with one bit per block of the disk, set if the block is in
+         * use, in the s5s_bitmap_nblocks blocks starting at
+         * s5s_bitmap_block (which follow the inode blocks). Data blocks
+         * start after the bitmap. The free block list above is empty. */
+        uint32_t s5s_num_blocks;         /* blocks on the disk */
+        uint32_t s5s_bitmap_block;       /* first block of the bitmap */
+        uint32_t s5s_bitmap_nblocks;     /* blocks in the bitmap */
+        uint32_t s5s_nfree_blocks;       /* number of clear bits */
 } s5_super_t;
 
 /* The contents of an inode, as stored on disk. */
@@ -105,12 +148,59 @@ typedef struct s5_dirent {
 } s5_dirent_t;
 
 #ifndef __FSMAKER__
+/*
+ * Cache of the single indirect blocks found under double and triple
+ * indirect blocks: maps an inode and the file block number shifted right
+ * by S5_NIDIRECT_SHIFT to the indirect block holding that block's
+ * number, so a lookup costs one pframe_get however deep it is. An entry
+ * with sbc_block == 0 is empty.
+ */
+#define S5_BMAP_CACHE_SIZE      64      /* power of 2 */
+typedef struct s5_bmap_cache {
+        uint32_t                sbc_ino;
+        uint32_t                sbc_group;
+        uint32_t                sbc_block;
+} s5_bmap_cache_t;
+
+/*
+ * In-memory hash index of a large directory. Directories keep the linear
+ * on-disk format; once one holds at least S5_DIRHASH_MIN_ENTRIES entries
+ * the first lookup scans it once and records the position of every entry
+ * in a chained hash table keyed on the name, and s5_link() and
+ * s5_remove_dirent() keep the table up to date from then on. An index
+ * whose table fills up is thrown away and rebuilt twice the size by the
+ * next lookup. At most S5_DIRHASH_MAX directories per fs are indexed;
+ * the least recently used index goes first.
+ */
+#define S5_DIRHASH_MIN_ENTRIES  (2 * S5_DIRENTS_PER_BLOCK)
+#define S5_DIRHASH_MAX_ENTRIES  (1 << 15)       /* 256K of kmalloc */
+#define S5_DIRHASH_MAX          8
+typedef struct s5_dirhash {
+        uint32_t                sdh_ino;
+        uint32_t                sdh_size;       /* power of 2 */
+        int32_t                 *sdh_buckets;   /* first entry of each chain */
+        int32_t                 *sdh_next;      /* next entry in the chain,
+                                                 * indexed by entry */
+        int                     sdh_busy;       /* in use, don't evict */
+        list_link_t             sdh_link;       /* on s5f_dirhash_list */
+} s5_dirhash_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
         kmutex_t                s5f_mutex;
         fs_t                    *s5f_fs;
+        uint32_t                s5f_alloc_rotor; /* where to allocate when a
+                                                  * file gives no hint */
+        /* File layout, which depends on s5s_version */
+        uint32_t                s5f_ndirect;     /* direct blocks per inode */
+        uint32_t                s5f_nlevels;     /* deepest indirect block */
+        uint32_t                s5f_max_blocks;  /* blocks in the largest file */
+        s5_bmap_cache_t         s5f_bmap_cache[S5_BMAP_CACHE_SIZE];
+        list_t                  s5f_dirhash_list; /* most recently used
+                                                   * first */
+        uint32_t                s5f_ndirhash;
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
@@ -10,6 +10,7 @@
 
 struct fs;
 struct vnode;
+struct s5fs;
 
 int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
 void s5_free_inode(struct vnode *vnode);
@@ -18,6 +19,9 @@ void s5_free_inode(struct vnode *vnode);
 int s5_read_file(struct vnode *vn, off_t seek, char *dest, size_t len);
 int s5_write_file(struct vnode *vn, off_t seek, const char *bytes,
                   size_t len);
+int s5_read_pages(struct vnode *vn, uint32_t pagenum, uint32_t npages);
+int s5_write_pages(struct vnode *vn, uint32_t pagenum, void **pagebufs,
+                   uint32_t npages);
 
 /* TA BLANK {{{ */
 /* TODO: perhaps change the order of the arguments 'parent' and 'child' to
@@ -29,6 +33,7 @@ int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
 int s5_inode_blocks(struct vnode *vnode);
+void s5_dirhash_purge_all(struct s5fs *fs);
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
 #define VNODE_TO_S5INODE(vn)    ( (s5_inode_t *)(vn)->vn_i )
@@ -142,10 +142,28 @@ typedef struct vnode_ops {
          * containing 'offset'.
          */
         int (*cleanpage)(struct vnode *vnode, off_t offset, void *pagebuf);
+        /*
+         * Optional (may be NULL). Bring 'npages' pages of 'vnode'
+         * starting with the page containing 'offset' into the page
+         * cache ahead of use, with as few device requests as the
+         * underlying fs can manage. Pages that are already resident,
+         * sparse or cannot be allocated are skipped. Called from the
+         * readahead daemon, never from the reading thread.
+         */
+        int (*readpages)(struct vnode *vnode, off_t offset, uint32_t npages);
+        /*
+         * Optional (may be NULL). Write the 'npages' page-aligned,
+         * page-sized buffers in 'pagebufs' to consecutive pages of
+         * 'vnode', starting with the page containing 'offset'. Used to
+         * write back runs of dirty pages with multi-block requests.
+         */
+        int (*cleanpages)(struct vnode *vnode, off_t offset, void **pagebufs,
+                          uint32_t npages);
 } vnode_ops_t;
 
 
 #define VN_BUSY        0x1
+#define VN_FLUSHFAILED 0x2     /* vnode_flush_all could not clean it */
 
 typedef struct vnode {
         /*
@@ -249,9 +267,17 @@ typedef struct vnode {
 
         /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
         list_link_t        vn_link;        /* link on system vnode list */
-        int                vn_flags;       /* VN_BUSY */
+        list_link_t        vn_hlink;       /* link on vnode hash chain */
+        list_link_t        vn_lrulink;     /* link on list of unreferenced
+                                              vnodes, if refcount is 0 */
+        int                vn_flags;       /* VN_BUSY, VN_FLUSHFAILED */
         ktqueue_t          vn_waitq;       /* queue of threads waiting for vnode
                                               to become not busy */
+
+        /* Sequential readahead state, maintained by vnode_readahead(): */
+        uint32_t           vn_ra_prev;     /* last page read */
+        uint32_t           vn_ra_end;      /* first page not yet read ahead */
+        uint32_t           vn_ra_size;     /* next window, 0 if not sequential */
 } vnode_t;
 
 /* Core vnode management routines: */
@@ -285,6 +311,12 @@ typedef struct vnode {
  *                 - (1) actively-referenced: (vn_refcount > vn_nrespages > 0)
  *                 - (2) passively-referenced: (vn_refcount == vn_nrespages > 0)
  *
+ *             - A vnode whose last reference is dropped while the file is
+ *               still linked is not freed but kept with vn_refcount == 0
+ *               on a list of unreferenced vnodes (at most
+ *               VNODE_CACHE_MAX of them), so that the next vget of it
+ *               does not have to ask the fs for it again.
+ *
  */
 
 /*
@@ -311,7 +343,8 @@ void vref(vnode_t *vn);
  *
  *     If, as a result of this, vn_refcount reaches zero, the underlying
  *     fs's 'delete_vnode' entry point will be called and the vnode will be
- *     freed.
+ *     freed, unless the file is still linked and the vnode is kept for
+ *     reuse instead (see above).
  *
  *     If, as a result of this, vn_refcount reaches vn_respages and
  *     vn_nrespages is > 0 (meaning only passive references exist) and
@@ -344,9 +377,18 @@ int vfs_is_in_use(struct fs *fs);
 
 /*
  *         Clean and uncache all resident pages of all vnodes belonging to
- *         the specified fs.
+ *         the specified fs. Returns 0, or the error of a vnode whose pages
+ *         could not all be cleaned (for instance -EBUSY if one was pinned);
+ *         the other vnodes are still flushed.
+ */
+int vnode_flush_all(struct fs *fs);
+
+/*
+ *         Frees the vnodes of the specified fs that are unreferenced but
+ *         kept for reuse. Called before an fs is unmounted, since they
+ *         point at the fs's inodes; vnode_flush_all does it too.
  */
-void vnode_flush_all(struct fs *fs);
+void vnode_purge_lru(struct fs *fs);
 
 /*
  *         Returns the number of vnodes from this filesystem that are in
@@ -355,6 +397,67 @@ void vnode_flush_all(struct fs *fs);
 int vnode_inuse(struct fs *fs);
 
 
+/*
+ *         Frees up to 'n' of the unreferenced vnodes kept for reuse,
+ *         least recently used first. Returns the number freed. Called
+ *         by pageoutd when memory is short.
+ */
+int vnode_reclaim(int n);
+
+size_t vnode_info(const void *data, char *buf, size_t size);
+
+
+/* Readahead: */
+/*
+ *     Called by a filesystem's read path before it reads pages
+ *     [first, last] of 'vn'. If the reads look sequential, queues the
+ *     next readahead window for the readahead daemon, which calls the
+ *     vnode's 'readpages' entry point. The window starts at
+ *     READAHEAD_MIN_PAGES and doubles up to READAHEAD_MAX_PAGES while
+ *     the accesses stay sequential. Does not block.
+ */
+void vnode_readahead(vnode_t *vn, uint32_t first, uint32_t last);
+
+/*
+ *     Stops the readahead daemon and waits for it to exit. Called from
+ *     idleproc before the VFS is shut down.
+ */
+void readahead_shutdown(void);
+
+
+/* Name lookup cache: */
+/*
+ *     Looks up 'name' in directory 'dir' in the cache. Returns 1 if it
+ *     is cached, with *result set to the vnode (with its refcount
+ *     incremented) or to NULL if the name is known not to exist, and 0
+ *     if it is not cached.
+ */
+int dcache_lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result);
+
+/*
+ *     Caches the result of a lookup of 'name' in 'dir': 'vn' is the vnode
+ *     found, or NULL if there is no such name. 'gen' is the value of
+ *     dcache_generation() from before the lookup; the entry is not made
+ *     if the directory may have changed since.
+ */
+void dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *vn,
+                  uint32_t gen);
+uint32_t dcache_generation(void);
+
+/*
+ *     Forgets 'name' in 'dir'. Called after every operation that adds or
+ *     removes a directory entry.
+ */
+void dcache_remove(vnode_t *dir, const char *name, size_t len);
+
+/*
+ *     Forgets every name cached for 'fs'. Called before it is unmounted.
+ */
+void dcache_purge_fs(struct fs *fs);
+
+size_t dcache_info(const void *data, char *buf, size_t size);
+
+
 /* Diagnostic: */
 /*
  *     Prints the vnodes that are in use.  Specifying a fs_t will restrict
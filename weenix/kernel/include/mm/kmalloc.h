@@ -4,3 +4,5 @@
 
 void *kmalloc(size_t size);
 void  kfree(void *addr);
+
+size_t kmalloc_info(const void *data, char *buf, size_t size);
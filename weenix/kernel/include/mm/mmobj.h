@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util/list.h"
+#include "util/radix.h"
 
 struct pframe;
 typedef struct mmobj_ops mmobj_ops_t;
@@ -15,6 +16,11 @@ typedef struct mmobj {
          */
         int                 mmo_nrespages;
         list_t              mmo_respages;
+        radix_tree_t        mmo_pages;      /* resident pages by pagenum, tagged
+                                             * PF_TAG_DIRTY/PF_TAG_WRITEBACK */
+        uint32_t            mmo_nhits;      /* pframe_get found the page resident */
+        uint32_t            mmo_nmisses;    /* pframe_get had to fill the page */
+        uint32_t            mmo_nevicts;    /* pages reclaimed by pageoutd */
         /*
          * For shadow objects, the mmo_bottom_obj member of the union should point
          * to the bottommost object in the shadow chain. For non-shadow objects, the
@@ -33,6 +39,9 @@ typedef struct mmobj {
          */
         /* Members relevant only to shadow objects: */
         struct mmobj       *mmo_shadowed;   /* the object that we shadow */
+        uint32_t            mmo_emptybelow; /* shadow_generation at which no shadow
+                                             * object below this one had resident
+                                             * pages; see shadow.c */
 } mmobj_t;
 
 struct mmobj_ops {
@@ -86,6 +95,17 @@ struct mmobj_ops {
          * Return 0 on success and -errno otherwise.
          */
         int (*cleanpage)(mmobj_t *o, struct pframe *pf);
+
+        /*
+         * Optional (may be NULL). Write back the npages busy pages in
+         * pfs, which belong to 'o' and have consecutive page numbers,
+         * as cleanpage would but with as few device requests as the
+         * object can manage. Either every page was written or the
+         * whole call fails.
+         * This may block.
+         * Return 0 on success and -errno otherwise.
+         */
+        int (*cleanpages)(mmobj_t *o, struct pframe **pfs, uint32_t npages);
 };
 
 
@@ -99,8 +119,13 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops)
         (o)->mmo_refcount = 0;
         (o)->mmo_nrespages = 0;
         list_init(&(o)->mmo_respages);
+        radix_tree_init(&(o)->mmo_pages);
+        (o)->mmo_nhits = 0;
+        (o)->mmo_nmisses = 0;
+        (o)->mmo_nevicts = 0;
         list_init(&(o)->mmo_un.mmo_vmas);
         (o)->mmo_shadowed = NULL;
+        (o)->mmo_emptybelow = 0;
 }
 
 #define mmobj_bottom_obj(o) \
@@ -48,7 +48,28 @@ void  page_free(void *addr);
 void *page_alloc_n(uint32_t npages);
 void  page_free_n(void *start, uint32_t npages);
 
+/* Returns a page that is already filled with zeros,
+ * or NULL if none are ready; the caller then has to
+ * zero one itself. Such pages are zeroed by zerod
+ * when the system has nothing better to do. Free
+ * them with page_free. */
+void *page_take_zeroed(void);
+
+/* Stops zerod. */
+void  zerod_shutdown(void);
+
+/* Every page has one word for whoever allocated it to
+ * find its way back from an address, as the slab
+ * allocator does in kfree. page_set_owner sets it for
+ * each of the npages pages starting at addr, and
+ * page_owner returns it for the page containing addr.
+ * It is cleared when pages are freed. */
+void  page_set_owner(void *addr, uint32_t npages, void *owner);
+void *page_owner(const void *addr);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
 uint32_t page_free_count();
+
+size_t page_info(const void *data, char *buf, size_t size);
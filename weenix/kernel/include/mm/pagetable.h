@@ -46,16 +46,30 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
  * given page directory. Creates a new page table if necessary and
  * places an entry in it in the page directory. vaddr must be in the
  * user address space. Both vaddr and paddr must be page aligned.
- * Note that the TLB is not flushed by this function. */
+ * paddr must be the memory of a page frame, since every user entry is
+ * kept in the reverse map of the page it maps (see pframe_rmap_add).
+ * Returns 0, or -ENOMEM if a page table or reverse map entry could not
+ * be allocated. Note that the TLB is not flushed by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags);
 
+/* Maps npages pages starting at the virtual page vaddr to the
+ * physical pages in paddrs, looking each page table up once rather
+ * than once per page. Entries that are already present are left
+ * alone, as are those whose paddrs entry is 0. Returns the number
+ * of entries filled in, or -ENOMEM if a page table could not be
+ * allocated (some entries may have been filled in). As with pt_map
+ * the TLB is not flushed. */
+int pt_map_range(pagedir_t *pd, uintptr_t vaddr, const uintptr_t *paddrs, uint32_t npages,
+                 uint32_t pdflags, uint32_t ptflags);
+
 /* Unmaps the page for the given virtual page from the given page
  * directory. vaddr must be in the user address space. vaddr must
  * be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
- * the addresses must be page aligned in the user address space */
+ * the addresses must be page aligned in the user address space. Page
+ * tables the range covers completely are freed. */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
 /* Creates a new page directory which is initialized to contain
@@ -8,9 +8,18 @@
 #include "util/init.h"
 
 struct mmobj;
+struct tlb_batch;
+struct pagedir;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_REFERENCED           0x04
+#define PF_ACTIVE               0x08
+#define PF_READAHEAD            0x10
+
+/* Tags on an mmobj's mmo_pages radix tree */
+#define PF_TAG_DIRTY            0   /* page is dirty */
+#define PF_TAG_WRITEBACK        1   /* page is being cleaned */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -20,6 +29,21 @@ struct mmobj;
 #define pframe_set_dirty(pf)        do { (pf)->pf_flags |= PF_DIRTY; } while (0)
 #define pframe_clear_dirty(pf)      do { (pf)->pf_flags &= ~PF_DIRTY; } while (0)
 
+#define pframe_is_referenced(pf)    ((pf)->pf_flags & PF_REFERENCED)
+#define pframe_set_referenced(pf)   do { (pf)->pf_flags |= PF_REFERENCED; } while (0)
+#define pframe_clear_referenced(pf) do { (pf)->pf_flags &= ~PF_REFERENCED; } while (0)
+
+#define pframe_is_active(pf)        ((pf)->pf_flags & PF_ACTIVE)
+#define pframe_set_active(pf)       do { (pf)->pf_flags |= PF_ACTIVE; } while (0)
+#define pframe_clear_active(pf)     do { (pf)->pf_flags &= ~PF_ACTIVE; } while (0)
+
+#define pframe_is_readahead(pf)     ((pf)->pf_flags & PF_READAHEAD)
+#define pframe_set_readahead(pf)    do { (pf)->pf_flags |= PF_READAHEAD; } while (0)
+#define pframe_clear_readahead(pf)  do { (pf)->pf_flags &= ~PF_READAHEAD; } while (0)
+
+/* True if some user page table maps the page */
+#define pframe_is_mapped(pf)        (!list_empty(&(pf)->pf_rmap))
+
 #define pframe_is_pinned(pf)        ((pf)->pf_pincount)
 #define pframe_is_free(pf)          (!(pf)->pf_obj)
 
@@ -38,12 +62,18 @@ typedef struct pframe {
         void               *pf_addr;
 
         /* Private: */
-        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY */
+        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY, PF_REFERENCED, PF_ACTIVE,
+                                          * PF_READAHEAD */
         ktqueue_t           pf_waitq;    /* wait on this if page is busy */
         int                 pf_pincount;
-        list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
+        list_link_t         pf_link;     /* link on {inactive,active,pinned}_list */
         list_link_t         pf_hlink;    /* link on hash chain of resident page hash */
-        list_link_t         pf_olink;    /* link on object's list of resident pages */
+        list_link_t         pf_olink;    /* link on object's list of resident pages
+                                          * (the object's mmo_pages also indexes it) */
+        list_link_t         pf_dlink;    /* link on dirty_list if dirty and unpinned */
+        uint32_t            pf_dirtied;  /* dirty_seq when put on dirty_list */
+        list_t              pf_rmap;     /* the page table entries that map the page,
+                                          * see pframe_rmap_add */
 } pframe_t;
 
 void pframe_init(void);
@@ -51,10 +81,18 @@ void pframe_add_range(uint32_t startpfn, uint32_t endpfn);
 void pframe_pageoutd_init(void);
 
 void pframe_shutdown(void);
+void flushd_shutdown(void);
 
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int pframe_get_range(struct mmobj *o, uint32_t pagenum, uint32_t n, int overwrite,
+                     pframe_t **pfs);
+void pframe_overwritten(pframe_t *pf);
+int pframe_dirty_overwritten(pframe_t *pf);
+void pframe_zero(pframe_t *pf);
+int pframe_readahead_alloc(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+void pframe_readahead_done(pframe_t *pf, int err);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
 void pframe_migrate(pframe_t *pf, mmobj_t *dest);
 
@@ -66,5 +104,17 @@ int  pframe_clean(pframe_t *pf);
 void pframe_free(pframe_t *pf);
 
 void pframe_clean_all(void);
+int  pframe_clean_range(struct mmobj *o, uint32_t start, uint32_t end);
+void pframe_invalidate_range(struct mmobj *o, uint32_t start, uint32_t end);
+
+void pframe_remove_from_pts(pframe_t *pf, struct tlb_batch *tb);
+
+/* Called by the page table code whenever it enters the page at the
+ * kernel address addr in, or takes it out of, the user page table entry
+ * for vaddr in pd. User page tables only ever map page frames.
+ * pframe_rmap_add returns 0 or -ENOMEM. */
+int  pframe_rmap_add(void *addr, struct pagedir *pd, uintptr_t vaddr);
+void pframe_rmap_remove(void *addr, struct pagedir *pd, uintptr_t vaddr);
 
-void pframe_remove_from_pts(pframe_t *pf);
+size_t pframe_info(const void *data, char *buf, size_t osize);
+size_t pframe_mmobj_info(const void *obj, char *buf, size_t osize);
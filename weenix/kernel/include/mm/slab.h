@@ -24,3 +24,5 @@ int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
+
+size_t slab_info(const void *data, char *buf, size_t size);
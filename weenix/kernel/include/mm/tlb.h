@@ -2,6 +2,7 @@
 
 #include "kernel.h"
 #include "types.h"
+#include "config.h"
 
 #include "mm/page.h"
 
@@ -24,10 +25,47 @@ static inline void tlb_flush_range(uintptr_t vaddr, uint32_t count)
         }
 }
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB, apart from the kernel's mappings of
+ * physical memory when they are global (see pt_init); those never
+ * change once set up. */
 static inline void tlb_flush_all()
 {
         uintptr_t pdir;
         __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
         __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
 }
+
+/* Invalidations gathered while a set of pages is unmapped, so they can
+ * be carried out together once the page tables are up to date. Past
+ * TLB_BATCH_MAX pages the whole TLB is flushed instead. Only mappings in
+ * the current page directory need to go in: the others are not in the
+ * TLB, since loading cr3 flushes every user mapping. */
+typedef struct tlb_batch {
+        uint32_t        tb_count;
+        uintptr_t       tb_vaddrs[TLB_BATCH_MAX];
+} tlb_batch_t;
+
+static inline void tlb_batch_init(tlb_batch_t *tb)
+{
+        tb->tb_count = 0;
+}
+
+static inline void tlb_batch_add(tlb_batch_t *tb, uintptr_t vaddr)
+{
+        if (tb->tb_count < TLB_BATCH_MAX)
+                tb->tb_vaddrs[tb->tb_count] = vaddr;
+        tb->tb_count++;
+}
+
+/* Carries out the gathered invalidations and empties the batch. */
+static inline void tlb_batch_flush(tlb_batch_t *tb)
+{
+        uint32_t i;
+        if (tb->tb_count > TLB_BATCH_MAX) {
+                tlb_flush_all();
+        } else {
+                for (i = 0; i < tb->tb_count; ++i)
+                        tlb_flush(tb->tb_vaddrs[i]);
+        }
+        tb->tb_count = 0;
+}
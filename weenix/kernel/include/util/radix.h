@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A radix tree mapping 32-bit indices to non-NULL pointers, with
+ * RADIX_NTAGS independent tag bits per entry. Each interior node also
+ * records which of its slots lead to tagged entries, so walking the
+ * tagged entries of a tree costs time proportional to the number found
+ * rather than to the number of entries. Entries are always returned in
+ * increasing index order. Nothing in here blocks.
+ */
+
+#define RADIX_SHIFT             5
+#define RADIX_SLOTS             (1 << RADIX_SHIFT)
+#define RADIX_MASK              (RADIX_SLOTS - 1)
+#define RADIX_MAXHEIGHT         ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+#define RADIX_NTAGS             2
+
+typedef struct radix_node {
+        uint32_t            rn_count;               /* non-NULL slots */
+        uint32_t            rn_tags[RADIX_NTAGS];   /* per-slot tag bitmaps */
+        void               *rn_slots[RADIX_SLOTS];
+} radix_node_t;
+
+typedef struct radix_tree {
+        uint32_t            rt_height;  /* levels of nodes, 0 when empty */
+        radix_node_t       *rt_root;
+} radix_tree_t;
+
+/* Creates the node allocator. Called from pframe_init. */
+void radix_init(void);
+
+void radix_tree_init(radix_tree_t *t);
+
+/* Stores item (which must not be NULL) at index, which must be unused.
+ * Returns 0 on success, -ENOMEM if a node could not be allocated. */
+int radix_insert(radix_tree_t *t, uint32_t index, void *item);
+
+/* Returns the item at index, or NULL */
+void *radix_lookup(radix_tree_t *t, uint32_t index);
+
+/* Removes and returns the item at index (NULL if there was none),
+ * clearing all of its tags */
+void *radix_remove(radix_tree_t *t, uint32_t index);
+
+/* Tag operations; index must hold an item for radix_tag_set */
+void radix_tag_set(radix_tree_t *t, uint32_t index, int tag);
+void radix_tag_clear(radix_tree_t *t, uint32_t index, int tag);
+int  radix_tag_get(radix_tree_t *t, uint32_t index, int tag);
+
+/* Returns non-zero if any item in the tree has the given tag */
+int  radix_tagged(radix_tree_t *t, int tag);
+
+/* Fill items with up to max items whose index is >= first, in index
+ * order; the _tag variant only returns items with the given tag.
+ * Returns the number of items found. */
+uint32_t radix_gang_lookup(radix_tree_t *t, void **items,
+                           uint32_t first, uint32_t max);
+uint32_t radix_gang_lookup_tag(radix_tree_t *t, void **items,
+                               uint32_t first, uint32_t max, int tag);
@@ -9,3 +9,5 @@
 #define FAULT_EXEC     0x10
 
 void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+
+size_t pagefault_info(const void *data, char *buf, size_t size);
@@ -1,9 +1,14 @@
 #pragma once
 
+#include "types.h"
+
 struct mmobj;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
 
 extern int shadow_count;
+extern uint32_t shadow_generation;
+
+size_t shadow_info(const void *data, char *buf, size_t size);
 
@@ -11,9 +11,13 @@ struct mmobj;
 struct proc;
 struct vnode;
 
+struct vmarea;
+
 typedef struct vmmap {
-        list_t       vmm_list;
-        struct proc *vmm_proc;
+        list_t         vmm_list;     /* vmareas in order of address */
+        struct vmarea *vmm_root;     /* the same vmareas in a tree, see vmmap.c */
+        struct vmarea *vmm_cache;    /* the vmarea vmmap_lookup() last found */
+        struct proc   *vmm_proc;
 } vmmap_t;
 
 /* make sure you understand why mapping boundaries are in terms of frame
@@ -32,6 +36,13 @@ typedef struct vmarea {
         list_link_t    vma_olink;    /* link on the list of all vm_areas
                                       * having the same vm_object at the
                                       * bottom of their chain */
+
+        /* Fields that only vmmap.c should touch: */
+        struct vmarea *vma_left;     /* vmm_root tree, by vma_start */
+        struct vmarea *vma_right;
+        int            vma_height;
+        uint32_t       vma_gap;      /* unmapped pages just below this area */
+        uint32_t       vma_maxgap;   /* largest vma_gap in this subtree */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -42,6 +53,8 @@ void vmmap_destroy(vmmap_t *map);
 vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn);
 int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage, uint32_t npages, int prot, int flags, off_t off, int dir, vmarea_t **new);
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
+void vmmap_insert(vmmap_t *map, vmarea_t *newvma);
+void vmmap_unlink(vmmap_t *map, vmarea_t *vma);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
 
@@ -29,6 +29,7 @@
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
+#include "drivers/blockq.h"
 #include "drivers/tty/virtterm.h"
 
 #include "api/exec.h"
@@ -263,14 +264,19 @@ idleproc_run(int arg1, void *arg2)
 #ifdef __VFS__
         /* Shutdown the vfs: */
         dbg_print("weenix: vfs shutdown...\n");
+        readahead_shutdown();
+        flushd_shutdown();
         vput(curproc->p_cwd);
         if (vfs_shutdown())
                 panic("vfs shutdown FAILED!!\n");
 
 #endif
 
+        zerod_shutdown();
+
         /* Shutdown the pframe system */
 #ifdef __S5FS__
+        blockq_shutdown();
         pframe_shutdown();
 #endif
 
@@ -1,29 +1,49 @@
 #include "types.h"
 #include "kernel.h"
+#include "globals.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
 #include "mm/slab.h"
 
 #include "util/gdb.h"
-#include "util/bits.h"
 #include "util/list.h"
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "vm/shadowd.h"
 
+#include "proc/proc.h"
+#include "proc/kthread.h"
 #include "proc/sched.h"
 
+#include "util/init.h"
+
 GDB_DEFINE_HOOK(page_alloc, void *addr, int npages)
 GDB_DEFINE_HOOK(page_free, void *addr, int npages)
 
 static list_t pagegroup_list;
 static uintptr_t page_freecount;
 
+/*
+ * One of these for every page a page group manages, found from the
+ * address in constant time. p_order is the order of the free block the
+ * page starts if there is one, which is what buddies are joined by; a
+ * free page kept in page_hot or page_zeroed is PAGE_CACHED instead.
+ * Both fields are reset when the page is freed.
+ */
+struct page {
+        void        *p_owner;           /* see page_set_owner() */
+        int          p_order;           /* or PAGE_NOT_FREE, PAGE_CACHED */
+};
+#define PAGE_NOT_FREE   (-1)
+#define PAGE_CACHED     (-2)
+
 struct pagegroup {
         list_t       pg_freelist[PAGE_NSIZES];
-        void        *pg_map[PAGE_NSIZES];
+        uint32_t     pg_nfree[PAGE_NSIZES];     /* blocks on each free list */
+        struct page *pg_pages;
         uintptr_t    pg_baseaddr;
         uintptr_t    pg_endaddr;
         list_link_t  pg_link;
@@ -33,6 +53,65 @@ struct freepage {
         list_link_t fp_link;
 };
 
+/*
+ * The group every 4MB of the address space belongs to, so groups can be
+ * found without walking pagegroup_list. Where two groups share 4MB the
+ * entry is PAGEGROUP_SHARED, and the list is walked after all.
+ */
+#define PAGEGROUP_DIR_SHIFT     22
+#define PAGEGROUP_SHARED        ((struct pagegroup *)1)
+static struct pagegroup *pagegroup_dir[1 << (32 - PAGEGROUP_DIR_SHIFT)];
+
+/*
+ * Recently freed single pages, handed out again before anything goes
+ * to the buddy lists (and likely still in the cache). They count as
+ * free in page_freecount.
+ */
+#define PAGE_HOT_MAX    32
+static void *page_hot[PAGE_HOT_MAX];
+static int page_nhot;
+
+static uint32_t page_nallocs;           /* single page allocations */
+static uint32_t page_nhothits;          /* ...served from page_hot */
+
+/*
+ * Free pages that zerod has already filled with zeros, for
+ * page_take_zeroed(). They count as free in page_freecount, and are
+ * given back to the free lists when memory runs short. zerod tops the
+ * pool up when it falls to half of PAGE_ZEROED_MAX, and gives the CPU
+ * up after every page it zeroes.
+ */
+#define PAGE_ZEROED_MAX 64
+static void *page_zeroed[PAGE_ZEROED_MAX];
+static int page_nzeroed;
+
+static uint32_t page_nzerohits;         /* page_take_zeroed() calls served */
+static uint32_t page_nzeromisses;       /* ...and not served */
+
+static proc_t *zerod = NULL;
+static kthread_t *zerod_thr = NULL;
+static ktqueue_t zerod_waitq;
+
+#define _page_desc(group, addr) \
+        (&(group)->pg_pages[ADDR_TO_PN((uintptr_t)(addr) - (group)->pg_baseaddr)])
+
+static void
+_freelist_insert(struct pagegroup *group, int order, uintptr_t addr)
+{
+        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        group->pg_nfree[order]++;
+        _page_desc(group, addr)->p_order = order;
+}
+
+static void
+_freelist_remove(struct pagegroup *group, int order, uintptr_t addr)
+{
+        KASSERT(order == _page_desc(group, addr)->p_order);
+        list_remove(&((struct freepage *)addr)->fp_link);
+        group->pg_nfree[order]--;
+        _page_desc(group, addr)->p_order = PAGE_NOT_FREE;
+}
+
 static struct pagegroup *
 _pagegroup_create(uintptr_t start, uintptr_t end)
 {
@@ -41,25 +120,23 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
 
         uintptr_t npages = (end - start) >> PAGE_SHIFT;
         struct pagegroup *group;
+        uintptr_t pn;
 
         end -= sizeof(*group);
         group = (struct pagegroup *)end;
 
         group->pg_baseaddr = start;
-        group->pg_map[0] = NULL;
 
-        /* allocate some of the space for the buddy bit maps,
-         * we allocate enough bits to track all pages even
-         * though some pages will be unavailable since they
-         * are being used as bitmaps */
-        int order;
-        for (order = 1; order < PAGE_NSIZES; ++order) {
-                uintptr_t count = npages >> order;
-                count = ((count - 1) & ~((uintptr_t)0x7)) + 8;
-                count = count >> 3;
-                end -= count;
-                group->pg_map[order] = (void *)end;
-                memset(group->pg_map[order], 0, count);
+        /* allocate some of the space for the page descriptors,
+         * we allocate enough to track all pages even though
+         * some pages will be unavailable since they are being
+         * used for the descriptors */
+        end -= npages * sizeof(struct page);
+        end &= ~(uintptr_t)(sizeof(void *) - 1);
+        group->pg_pages = (struct page *)end;
+        for (pn = 0; pn < npages; ++pn) {
+                group->pg_pages[pn].p_owner = NULL;
+                group->pg_pages[pn].p_order = PAGE_NOT_FREE;
         }
 
         /* discard the remainder of the page being used for
@@ -70,20 +147,23 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
 
         /* put pages which do not fit nicely into the largest
          * order and add them to smaller buckets */
+        int order;
         for (order = 0; order < PAGE_NSIZES - 1; ++order) {
                 list_init(&group->pg_freelist[order]);
+                group->pg_nfree[order] = 0;
                 if (npages & (1 << order)) {
                         end -= (1 << order) << PAGE_SHIFT;
-                        list_insert_head(&group->pg_freelist[order], &((struct freepage *)end)->fp_link);
+                        _freelist_insert(group, order, end);
                 }
         }
 
         /* put the remaining pages into the largest bucket */
         KASSERT(0 == (end - start) % (1 << order));
         list_init(&group->pg_freelist[order]);
+        group->pg_nfree[order] = 0;
         uintptr_t current = start;
         while (current < end) {
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)current)->fp_link);
+                _freelist_insert(group, order, current);
                 current += (1 << order) << PAGE_SHIFT;
         }
 
@@ -93,7 +173,14 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
 static struct pagegroup *
 _pagegroup_from_address(uintptr_t addr)
 {
-        struct pagegroup *group;
+        struct pagegroup *group = pagegroup_dir[addr >> PAGEGROUP_DIR_SHIFT];
+
+        if (PAGEGROUP_SHARED != group) {
+                if (NULL != group && addr >= group->pg_baseaddr && addr < group->pg_endaddr)
+                        return group;
+                return NULL;
+        }
+
         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
                 if (addr >= group->pg_baseaddr && addr < group->pg_endaddr)
                         return group;
@@ -106,11 +193,15 @@ page_init()
 {
         list_init(&pagegroup_list);
         page_freecount = 0;
+        page_nhot = 0;
+        page_nzeroed = 0;
 }
 
 void
 page_add_range(uintptr_t start, uintptr_t end)
 {
+        uintptr_t dir;
+
         dbgq(DBG_MM, "Page System adding range: 0x%08x to 0x%08x\n", start, end);
 
         /* page align the start and end */
@@ -121,32 +212,12 @@ page_add_range(uintptr_t start, uintptr_t end)
         if (group->pg_baseaddr < group->pg_endaddr) {
                 list_insert_tail(&pagegroup_list, &group->pg_link);
                 page_freecount += ADDR_TO_PN(group->pg_endaddr - group->pg_baseaddr);
-        }
-}
-
-/**
- * Calculates the address's index in to the buddy bitmap for the
- * specified order. The address must be within the range of addresses
- * managed by the given group and should be either the exact address
- * of one of the pages of the given order or the address of one of
- * the pages resulting from splitting a page of the given order
- * exactly once.
- *
- * @param group the page group the address falls in
- * @param order the order within the page group which we are interested in
- * @param addr the address whose index is being calculated
- * @return the index of the given address
- */
-static inline uintptr_t
-_pagegroup_calculate_index(struct pagegroup *group, uint32_t order, uintptr_t addr)
-{
-        KASSERT(PAGE_ALIGNED(addr));
-        KASSERT(PAGE_NSIZES > order);
-        KASSERT(addr >= group->pg_baseaddr && addr < group->pg_endaddr);
 
-        uintptr_t offset = addr - group->pg_baseaddr;
-        KASSERT(0 == (offset & ((1 << order) - 1)));
-        return (offset >> order) >> PAGE_SHIFT;
+                for (dir = group->pg_baseaddr >> PAGEGROUP_DIR_SHIFT;
+                     dir <= (group->pg_endaddr - 1) >> PAGEGROUP_DIR_SHIFT; ++dir) {
+                        pagegroup_dir[dir] = (NULL == pagegroup_dir[dir]) ? group : PAGEGROUP_SHARED;
+                }
+        }
 }
 
 static void
@@ -158,30 +229,88 @@ __page_split(struct pagegroup *group, uint32_t order)
         KASSERT(PAGE_SIZE >= sizeof(uintptr_t));
 
         uintptr_t target = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
+        _freelist_remove(group, order, target);
+
+        uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
+        _freelist_insert(group, order - 1, target);
+        _freelist_insert(group, order - 1, buddy);
+        dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target, order, target, buddy);
+}
 
-        /* splitting the page requires marking it as allocated */
-        if (likely(order < PAGE_NSIZES - 1)) {
-                uintptr_t index = _pagegroup_calculate_index(group, order + 1, target);
-                bit_flip(group->pg_map[order + 1], index);
+static void _page_free_order(void *addr, int order);
+
+/* Move a free page into (cached != 0) or out of page_hot or page_zeroed */
+static void
+_page_set_cached(void *addr, int cached)
+{
+        struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+        struct page *page;
+
+        KASSERT(NULL != group);
+        page = _page_desc(group, addr);
+        if (cached) {
+                KASSERT(PAGE_NOT_FREE == page->p_order && "double free");
+                page->p_owner = NULL;
+                page->p_order = PAGE_CACHED;
+        } else {
+                KASSERT(PAGE_CACHED == page->p_order);
+                page->p_order = PAGE_NOT_FREE;
         }
+}
 
-        KASSERT(!bit_check(group->pg_map[order], _pagegroup_calculate_index(group, order, target)));
+/* Give the hot and zeroed pages back to the buddy lists, so they can be
+ * joined */
+static void
+_page_hot_drain(void)
+{
+        while (page_nhot > 0) {
+                page_freecount--;
+                _page_set_cached(page_hot[--page_nhot], 0);
+                _page_free_order(page_hot[page_nhot], 0);
+        }
+        while (page_nzeroed > 0) {
+                page_freecount--;
+                _page_set_cached(page_zeroed[--page_nzeroed], 0);
+                _page_free_order(page_zeroed[page_nzeroed], 0);
+        }
+}
 
-        uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)target)->fp_link);
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)buddy)->fp_link);
-        dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target, order, target, buddy);
+/**
+ * Finds a free block of at least the given order and, if it is bigger,
+ * splits it into blocks of the given order.
+ *
+ * @param order the order of the block to split into.
+ * @return the group with a free block of that order, NULL if there is none
+ */
+static struct pagegroup *
+_page_find(int order)
+{
+        struct pagegroup *group;
+        int norder;
+
+        for (norder = order; norder < PAGE_NSIZES; norder++) {
+                list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                        if (0 != group->pg_nfree[norder]) {
+                                while (norder > order) {
+                                        __page_split(group, norder);
+                                        --norder;
+                                }
+                                KASSERT(!list_empty(&group->pg_freelist[order]));
+                                return group;
+                        }
+                } list_iterate_end();
+        }
+        return NULL;
 }
 
 /**
- * Finds a block of pages strictly bigger than a block of the given order and
- * splits it into blocks of the given order. Used, for example, when the user
- * requests a 4k block and there are no free 4k blocks, but there is an 8k or
- * 16k block.
+ * Finds a free block of the given order, splitting a bigger one if there
+ * is none (for example, when the user requests a 4k block and there are
+ * no free 4k blocks, but there is an 8k or 16k block), and trying to free
+ * some memory if there is nothing big enough either.
  *
  * @param order the order of the block to split into.
- * @return the group where the split took place on success, NULL otherwise
+ * @return the group with a free block of that order on success, NULL otherwise
  */
 static struct pagegroup *
 _page_split(int order)
@@ -191,22 +320,17 @@ _page_split(int order)
 #else
         uint32_t num_retrys = 0;
 #endif
-        int norder;
+        struct pagegroup *group;
 
         do {
-                /* Find the first free block of greater size than requested. */
-                for (norder = order + 1; norder < PAGE_NSIZES; norder++) {
-                        struct pagegroup *group;
-                        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                                if (!list_empty(&group->pg_freelist[norder])) {
-                                        while (norder > order) {
-                                                __page_split(group, norder);
-                                                --norder;
-                                        }
-                                        KASSERT(!list_empty(&group->pg_freelist[order]));
-                                        return group;
-                                }
-                        } list_iterate_end();
+                if (NULL != (group = _page_find(order)))
+                        return group;
+
+                /* The hot pages may be what keeps blocks from joining */
+                if (0 < page_nhot || 0 < page_nzeroed) {
+                        _page_hot_drain();
+                        if (NULL != (group = _page_find(order)))
+                                return group;
                 }
 
                 dbg(DBG_PAGEALLOC, "WARNING, cannot allocate order=%u\n", order);
@@ -238,22 +362,12 @@ _page_alloc_order(uint32_t order)
         uintptr_t addr;
         struct pagegroup *group;
 
-        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                if (!list_empty(&group->pg_freelist[order]))
-                        goto found;
-        } list_iterate_end();
+        if (NULL == (group = _page_split(order)))
+                return NULL;
 
-        if (NULL != (group = _page_split(order))) {
-                KASSERT(!list_empty(&group->pg_freelist[order]));
-                goto found;
-        }
-        return NULL;
-
-found:
+        KASSERT(!list_empty(&group->pg_freelist[order]));
         addr = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
-        if (PAGE_NSIZES - 1 > order)
-                bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, addr));
+        _freelist_remove(group, order, addr);
 
         dbg(DBG_MM, "allocating %d pages (addr 0x%x)\n", (1 << order), addr);
 
@@ -269,28 +383,28 @@ found:
         return (void *) addr;
 }
 
+/* Joins the free block of the given order at addr with its buddy for as
+ * long as the buddy is free too, and puts the result on its free list */
 static void
 __page_join(struct pagegroup *group, int order, uintptr_t addr)
 {
-        uintptr_t index;
-        while (PAGE_NSIZES - 1 > order && !bit_check(group->pg_map[order + 1],
-                        index = _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr))) {
+        while (PAGE_NSIZES - 1 > order) {
                 uintptr_t offset = addr - group->pg_baseaddr;
                 uintptr_t buddy = addr + ((1 << order) << PAGE_SHIFT) * ((((offset >> PAGE_SHIFT) >> order) & 0x1) ? -1 : 1);
 
-                KASSERT(0 == (offset & ((1 << order) - 1)));
+                KASSERT(0 == ((offset >> PAGE_SHIFT) & ((1 << order) - 1)));
 
-                dbg(DBG_PAGEALLOC, "joining 0x%.8x and 0x%.8x (%u) into 0x%.8x\n", addr, buddy, order, MIN(offset, buddy));
+                if (buddy < group->pg_baseaddr || buddy >= group->pg_endaddr
+                    || order != _page_desc(group, buddy)->p_order)
+                        break;
 
-                list_remove(&((struct freepage *)addr)->fp_link);
-                list_remove(&((struct freepage *)buddy)->fp_link);
+                dbg(DBG_PAGEALLOC, "joining 0x%.8x and 0x%.8x (%u) into 0x%.8x\n", addr, buddy, order, MIN(addr, buddy));
+
+                _freelist_remove(group, order, buddy);
                 addr = MIN(addr, buddy);
                 ++order;
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
-
-                if (PAGE_NSIZES - 1 > order)
-                        bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr));
         }
+        _freelist_insert(group, order, addr);
 }
 
 /**
@@ -312,22 +426,60 @@ _page_free_order(void *addr, int order)
 #endif /* MM_POISON */
 
         struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+        struct page *page;
+        int i;
+
         if (NULL == group)
                 return;
 
-        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        page = _page_desc(group, addr);
+        KASSERT(PAGE_NOT_FREE == page->p_order && "double free");
+        for (i = 0; i < (1 << order); ++i)
+                page[i].p_owner = NULL;
         page_freecount += (1 << order);
-
-        if (PAGE_NSIZES - 1 > order) {
-                uintptr_t index = _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr);
-                bit_flip(group->pg_map[order + 1], index);
-                __page_join(group, order, (uintptr_t)addr);
-        }
+        __page_join(group, order, (uintptr_t)addr);
 
         dbg(DBG_MM, "page_free: freed %d pages (addr 0x%p); %u pages currently free\n",
             (1 << order), addr, page_freecount);
 }
 
+/* A single page, from the hot pages if there are any */
+static void *
+_page_alloc_one(void)
+{
+        void *addr;
+
+        page_nallocs++;
+        if (0 == page_nhot)
+                return _page_alloc_order(0);
+
+        page_nhothits++;
+        addr = page_hot[--page_nhot];
+        _page_set_cached(addr, 0);
+        page_freecount--;
+#ifdef MM_POISON
+        memset(addr, MM_POISON_ALLOC, PAGE_SIZE);
+#endif /* MM_POISON */
+        return addr;
+}
+
+static void
+_page_free_one(void *addr)
+{
+        if (PAGE_HOT_MAX == page_nhot || NULL == _pagegroup_from_address((uintptr_t)addr)) {
+                _page_free_order(addr, 0);
+                return;
+        }
+
+#ifdef MM_POISON
+        memset(addr, MM_POISON_FREE, PAGE_SIZE);
+#endif /* MM_POISON */
+        KASSERT(PAGE_ALIGNED(addr));
+        _page_set_cached(addr, 1);
+        page_hot[page_nhot++] = addr;
+        page_freecount++;
+}
+
 /*
  * Allocate one page of memory (which is, of course page-aligned).
  * @return the address of the page
@@ -335,7 +487,7 @@ _page_free_order(void *addr, int order)
 void *
 page_alloc(void)
 {
-        void *addr =  _page_alloc_order(0);
+        void *addr = _page_alloc_one();
         GDB_CALL_HOOK(page_alloc, addr, 1);
         return addr;
 }
@@ -348,7 +500,7 @@ void
 page_free(void *addr)
 {
         GDB_CALL_HOOK(page_free, addr, 1);
-        _page_free_order(addr, 0);
+        _page_free_one(addr);
 }
 
 /*
@@ -367,7 +519,7 @@ page_alloc_n(uint32_t npages)
         if (order == PAGE_NSIZES)
                 panic("Implementation does not permit allocating %u pages!\n", npages);
 
-        void *addr = _page_alloc_order(order);
+        void *addr = (0 == order) ? _page_alloc_one() : _page_alloc_order(order);
         GDB_CALL_HOOK(page_alloc, addr, npages);
         return addr;
 }
@@ -388,7 +540,164 @@ page_free_n(void *start, uint32_t npages)
                 panic("Implementation does not permit allocating %u pages!\n", npages);
 
         GDB_CALL_HOOK(page_free, start, npages);
-        _page_free_order(start, order);
+        if (0 == order)
+                _page_free_one(start);
+        else
+                _page_free_order(start, order);
+}
+
+void
+page_set_owner(void *addr, uint32_t npages, void *owner)
+{
+        struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+        struct page *page;
+
+        KASSERT(PAGE_ALIGNED(addr));
+        KASSERT(NULL != group);
+        KASSERT((uintptr_t)addr + (npages << PAGE_SHIFT) <= group->pg_endaddr);
+
+        for (page = _page_desc(group, addr); npages-- > 0; ++page)
+                page->p_owner = owner;
+}
+
+void *
+page_owner(const void *addr)
+{
+        struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+
+        KASSERT(NULL != group);
+        return _page_desc(group, addr)->p_owner;
+}
+
+void *
+page_take_zeroed(void)
+{
+        void *addr;
+
+        if (0 == page_nzeroed) {
+                page_nzeromisses++;
+                addr = NULL;
+        } else {
+                page_nzerohits++;
+                addr = page_zeroed[--page_nzeroed];
+                _page_set_cached(addr, 0);
+                page_freecount--;
+                GDB_CALL_HOOK(page_alloc, addr, 1);
+        }
+        if ((NULL != zerod_thr) && (page_nzeroed <= PAGE_ZEROED_MAX / 2))
+                sched_broadcast_on(&zerod_waitq);
+        return addr;
+}
+
+/*
+ * Zero one page from the free lists into page_zeroed. Only takes a page
+ * if one can be had without splitting a bigger block or reclaiming
+ * anything.
+ *
+ * @return 1 if a page was zeroed, 0 otherwise
+ */
+static int
+_page_zero_one(void)
+{
+        struct pagegroup *group;
+        uintptr_t addr;
+
+        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                if (0 != group->pg_nfree[0]) {
+                        addr = (uintptr_t)list_head(&group->pg_freelist[0], struct freepage, fp_link);
+                        _freelist_remove(group, 0, addr);
+                        memset((void *)addr, 0, PAGE_SIZE);
+                        _page_set_cached((void *)addr, 1);
+                        page_zeroed[page_nzeroed++] = (void *)addr;
+                        return 1;
+                }
+        } list_iterate_end();
+        return 0;
+}
+
+/*
+ * The zeroing daemon. Keeps page_zeroed topped up, yielding to every
+ * other runnable thread after each page, and sleeps once it is full or
+ * there are no free single pages to zero.
+ */
+static void *
+zerod_run(int arg1, void *arg2)
+{
+        for (;;) {
+                while ((PAGE_ZEROED_MAX > page_nzeroed) && _page_zero_one()) {
+                        sched_make_runnable(curthr);
+                        sched_switch();
+                        if (curthr->kt_cancelled)
+                                kthread_exit((void *)0);
+                }
+                if (sched_cancellable_sleep_on(&zerod_waitq))
+                        kthread_exit((void *)0);
+        }
+        return NULL;
+}
+
+/*
+ * Start the zeroing daemon. Like pageoutd it is a child of idleproc.
+ */
+static __attribute__((unused)) void
+zerod_init(void)
+{
+        sched_queue_init(&zerod_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        zerod = proc_create("zerod");
+        KASSERT(NULL != zerod);
+        zerod_thr = kthread_create(zerod, zerod_run, 0, NULL);
+        KASSERT(NULL != zerod_thr);
+
+        sched_make_runnable(zerod_thr);
+}
+init_func(zerod_init);
+init_depends(sched_init);
+
+void
+zerod_shutdown(void)
+{
+        pid_t pid, child;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        KASSERT(NULL != zerod_thr);
+
+        kthread_cancel(zerod_thr, (void *) 0);
+        zerod_thr = NULL;
+
+        pid = zerod->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than zerod");
+}
+
+size_t
+page_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct pagegroup *group;
+        uint32_t nfree;
+        int order;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "free pages: %u (%d hot)\n", page_freecount, page_nhot);
+        iprintf(&buf, &size, "free blocks:");
+        for (order = 0; order < PAGE_NSIZES; ++order) {
+                nfree = 0;
+                list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                        nfree += group->pg_nfree[order];
+                } list_iterate_end();
+                iprintf(&buf, &size, " %u", nfree);
+        }
+        iprintf(&buf, &size, " (by order)\n");
+        iprintf(&buf, &size, "single page allocations: %u, hot hits: %u\n",
+                page_nallocs, page_nhothits);
+        iprintf(&buf, &size, "zeroed pages: %d, taken: %u, wanted but none: %u\n",
+                page_nzeroed, page_nzerohits, page_nzeromisses);
+
+        return osize - size;
 }
 
 /*
@@ -6,6 +6,7 @@
 #include "globals.h"
 
 #include "main/interrupt.h"
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -25,6 +26,8 @@
 #define PT_ENTRY_COUNT    (PAGE_SIZE / sizeof (uint32_t))
 #define PT_VADDR_SIZE     (PAGE_SIZE * PT_ENTRY_COUNT)
 
+#define CR4_PGE           0x080
+
 struct pagedir {
         pde_t      pd_physical[PT_ENTRY_COUNT];
         uintptr_t *pd_virtual[PT_ENTRY_COUNT];
@@ -41,10 +44,20 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* the kernel's address for a physical address, through the mapping of
+ * physical memory set up by pt_init */
+#define phys_to_kaddr(paddr) \
+        ((void *)((paddr) + (uintptr_t)&kernel_start - KERNEL_PHYS_BASE))
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
 
+/* PT_GLOBAL if the processor supports global pages, otherwise 0. Added to
+ * the kernel's own mappings so they are not thrown out of the TLB every
+ * time cr3 is loaded, which happens on each switch between processes. */
+static pte_t kernel_global = 0;
+
 static uint32_t phys_map_count = 1;
 static pte_t *final_page;
 
@@ -131,11 +144,79 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
         index = vaddr_to_ptindex(vaddr);
 
         KASSERT((ptflags & ~PAGE_MASK) == ptflags);
+        if (!(PT_PRESENT & pt[index]) || paddr != (pt[index] & PAGE_MASK)) {
+                if (0 > pframe_rmap_add(phys_to_kaddr(paddr), pd, vaddr))
+                        return -ENOMEM;
+                if (PT_PRESENT & pt[index])
+                        pframe_rmap_remove(phys_to_kaddr(pt[index] & PAGE_MASK), pd, vaddr);
+        }
         pt[index] = paddr | ptflags;
 
         return 0;
 }
 
+int
+pt_map_range(pagedir_t *pd, uintptr_t vaddr, const uintptr_t *paddrs, uint32_t npages,
+             uint32_t pdflags, uint32_t ptflags)
+{
+        uint32_t i;
+        int index, pdindex = -1, nmapped = 0;
+        pte_t *pt = NULL;
+
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH >= vaddr + npages * PAGE_SIZE);
+        KASSERT((pdflags & ~PAGE_MASK) == pdflags);
+        KASSERT((ptflags & ~PAGE_MASK) == ptflags);
+
+        for (i = 0; i < npages; ++i, vaddr += PAGE_SIZE) {
+                if (0 == paddrs[i])
+                        continue;
+                KASSERT(PAGE_ALIGNED(paddrs[i]));
+
+                /* look the page table up only when we move into another */
+                if (pdindex != (int)vaddr_to_pdindex(vaddr)) {
+                        index = pdindex = vaddr_to_pdindex(vaddr);
+                        if (!(PT_PRESENT & pd->pd_physical[index])) {
+                                if (NULL == (pt = page_alloc()))
+                                        return -ENOMEM;
+                                memset(pt, 0, PAGE_SIZE);
+                                pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt) | pdflags;
+                                pd->pd_virtual[index] = pt;
+                        } else {
+                                pd->pd_physical[index] = pd->pd_physical[index] | pdflags;
+                                pt = (pte_t *)pd->pd_virtual[index];
+                        }
+                }
+
+                index = vaddr_to_ptindex(vaddr);
+                if (!(PT_PRESENT & pt[index])) {
+                        if (0 > pframe_rmap_add(phys_to_kaddr(paddrs[i]), pd, vaddr))
+                                return -ENOMEM;
+                        pt[index] = paddrs[i] | ptflags;
+                        ++nmapped;
+                }
+        }
+        return nmapped;
+}
+
+/* Clears the entries of pt for [vlow, vhigh), which must lie within the
+ * 4mb that pt maps, and drops them from the reverse maps of the pages */
+static void
+_pt_unmap_entries(pagedir_t *pd, pte_t *pt, uintptr_t vlow, uintptr_t vhigh)
+{
+        uint32_t index = vaddr_to_ptindex(vlow);
+
+        KASSERT(vlow < vhigh && vhigh - vlow <= PT_VADDR_SIZE);
+        KASSERT(vaddr_to_pdindex(vlow) == vaddr_to_pdindex(vhigh - 1));
+
+        for (; vlow < vhigh; vlow += PAGE_SIZE, ++index) {
+                if (PT_PRESENT & pt[index]) {
+                        pframe_rmap_remove(phys_to_kaddr(pt[index] & PAGE_MASK), pd, vlow);
+                        pt[index] = 0;
+                }
+        }
+}
+
 void
 pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 {
@@ -144,50 +225,36 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 
         int index = vaddr_to_pdindex(vaddr);
 
-        if (PT_PRESENT & pd->pd_physical[index]) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[index];
-
-                index = vaddr_to_ptindex(vaddr);
-                pt[index] = 0;
-        }
+        if (PT_PRESENT & pd->pd_physical[index])
+                _pt_unmap_entries(pd, (pte_t *)pd->pd_virtual[index], vaddr, vaddr + PAGE_SIZE);
 }
 
 void
 pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
 {
+        uintptr_t next;
         uint32_t index;
 
         KASSERT(vlow < vhigh);
         KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
 
-        index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-                size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
-                memset(&pt[index], 0, size);
-        }
-        vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
-
-        index = vaddr_to_ptindex(vhigh);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
-                size_t size = index * sizeof(*pt);
-                memset(&pt[0], 0, size);
-        }
-        vhigh -= PAGE_SIZE * index;
-
-        uint32_t i;
-        for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
-                if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
-                        pd->pd_virtual[i] = NULL;
-                        pd->pd_physical[i] = 0;
+        for (; vlow < vhigh; vlow = next) {
+                index = vaddr_to_pdindex(vlow);
+                next = MIN((index + 1) * PT_VADDR_SIZE, vhigh);
+                if (!(PT_PRESENT & pd->pd_physical[index]))
+                        continue;
+
+                _pt_unmap_entries(pd, (pte_t *)pd->pd_virtual[index], vlow, next);
+                /* page tables that are left empty are freed */
+                if (PT_VADDR_SIZE == next - vlow) {
+                        page_free(pd->pd_virtual[index]);
+                        pd->pd_virtual[index] = NULL;
+                        pd->pd_physical[index] = 0;
                 }
         }
 }
 
-
 pagedir_t *
 pt_create_pagedir()
 {
@@ -214,6 +281,8 @@ pt_destroy_pagedir(pagedir_t *pdir)
         uint32_t i;
         for (i = begin; i <= end; ++i) {
                 if (PT_PRESENT & pdir->pd_physical[i]) {
+                        _pt_unmap_entries(pdir, (pte_t *)pdir->pd_virtual[i],
+                                          i * PT_VADDR_SIZE, (i + 1) * PT_VADDR_SIZE);
                         page_free(pdir->pd_virtual[i]);
                 }
         }
@@ -275,6 +344,11 @@ pt_init(void)
         pde_t *temppdir;
         __asm__ volatile("movl %%cr3, %0" : "=r"(temppdir));
 
+        uint32_t features, unused;
+        cpuid(CPUID_GETFEATURES, &unused, &features);
+        if (CPUID_FEAT_EDX_PGE & features)
+                kernel_global = PT_GLOBAL;
+
         pagedir_t *pagedir = (pagedir_t *)&kernel_end;
         /* The kernel ending address should be page aligned by the linker script */
         KASSERT(PAGE_ALIGNED(pagedir));
@@ -297,7 +371,8 @@ pt_init(void)
          * this will make our new page table identical to the temporary
          * page table the boot loader created. */
         pagetable += PT_ENTRY_COUNT;
-        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE,
+        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE,
+                      PT_PRESENT | PT_WRITE | kernel_global,
                       (uintptr_t)&kernel_start, KERNEL_PHYS_BASE);
 
         current_pagedir = pagedir;
@@ -305,6 +380,16 @@ pt_init(void)
          * permanant page table */
         pt_set(pagedir);
 
+        /* the identity mapping above is left out, since it is removed by
+         * pt_template_init and a reload of cr3 would not flush it; turning
+         * global pages on flushes everything the boot loader's tables left
+         * in the TLB */
+        if (kernel_global) {
+                uint32_t cr4;
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_PGE) : "memory");
+        }
+
         uintptr_t physmax = phys_detect_highmem();
         dbgq(DBG_MM, "Highest usable physical memory: 0x%08x\n", physmax);
         dbgq(DBG_MM, "Available memory: 0x%08x\n", physmax - KERNEL_PHYS_BASE);
@@ -315,8 +400,11 @@ pt_init(void)
                 pagetable += PT_ENTRY_COUNT;
                 vaddr += PT_VADDR_SIZE;
                 paddr += PT_VADDR_SIZE;
-                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
+                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE,
+                              PT_PRESENT | PT_WRITE | kernel_global, vaddr, paddr);
         } while (paddr < physmax);
+        dbgq(DBG_MM, "Kernel page tables: %u pages, %sglobal\n",
+             (uint32_t)(pagetable - final_page) / PT_ENTRY_COUNT, kernel_global ? "" : "not ");
 
         page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
 }
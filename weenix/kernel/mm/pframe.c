@@ -5,6 +5,8 @@
 #include "proc/proc.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/radix.h"
 #include "util/string.h"
 
 #include "mm/mmobj.h"
@@ -17,6 +19,10 @@
 
 #include "vm/vmmap.h"
 
+#ifdef __VFS__
+#include "fs/vnode.h"
+#endif
+
 /*
  * In this file, physical pages (as represented by pframes) will be
  * referred to as "pages"
@@ -29,10 +35,9 @@
  *     - (3) pinned
  *
  * (1) Free pages do not contain identifiable data and are readily
- *     available for use. They are not pre-zeroed (at the moment, at least
- *     (but often times, OSs will have their equivalent of Weenix's
- *     idleproc (or another thread/process dedicated to this purpose) zero
- *     unzeroed pages on the free list when the system is otherwise idle)).
+ *     available for use. Some of them are pre-zeroed by zerod (see
+ *     mm/page.c) when the system is otherwise idle, and pframe_zero()
+ *     uses those to fill a new page with zeros.
  *
  * (2) Allocated pages contain identifiable data.
  *
@@ -50,17 +55,27 @@
  *
  *
  * When a page is allocated or pinned:
- *     - pf_link links the page into allocated_list or pinned_list,
- *       respectively
+ *     - pf_link links the page into inactive_list/active_list or
+ *       pinned_list, respectively
  *     - pf_hlink links the page into the appropriate hash chain of the
  *       resident page hashtable
  *     - pf_olink links the page into the appropriate mmobj's list of
- *       resident pages
+ *       resident pages, and the page is indexed by pagenum in that
+ *       mmobj's mmo_pages radix tree
  *
  * When a page is free:
  *     - pf_link links the page into free_list
  *     - pf_hlink does not link the page into any list
  *     - pf_olink does not link the page into any list
+ *
+ * The radix tree keeps a PF_TAG_DIRTY tag in step with PF_DIRTY, and a
+ * PF_TAG_WRITEBACK tag while a page is being written back, so range
+ * operations can visit just the dirty pages of an object in page order.
+ * The tree also lets pframe_clean find the dirty neighbours of a page and
+ * write them back together.
+ *
+ * A page that is dirty and not pinned is also linked through pf_dlink on
+ * dirty_list, oldest first, which is what the flusher daemon works from.
  */
 
 /* Page management structures:
@@ -74,22 +89,76 @@
 static int npinned;
 static list_t pinned_list;
 
-/*     The ALLOCATED list: */
-/*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+/*     The ALLOCATED lists: */
+/*       Pages on these lists contain useful/actual/real data. Replacement
+ *       is a 2Q-style policy driven by a CLOCK referenced bit:
+ *
+ *       - New pages go to the tail of the INACTIVE list. A lookup that
+ *         finds a resident page only sets PF_REFERENCED; the lists are
+ *         never touched on a hit.
+ *       - pageoutd reclaims from the head of the INACTIVE list. A page
+ *         referenced since it was queued is promoted to the ACTIVE list
+ *         instead of being reclaimed.
+ *       - When the INACTIVE list falls below 1/2^PF_INACTIVE_MIN_SHIFT of
+ *         the allocated pages, pageoutd sweeps the head of the ACTIVE list
+ *         like a clock hand. Referenced pages get a second chance and
+ *         unreferenced ones are demoted to the INACTIVE tail.
+ *
+ *       A page touched only once (e.g. by a large sequential read) never
+ *       reaches the ACTIVE list, so streaming I/O cannot flush the hot
+ *       working set. nallocated == ninactive + nactive.
  */
 static int nallocated;
-static list_t alloc_list;
+static int ninactive;
+static list_t inactive_list;
+static int nactive;
+static list_t active_list;
+
+/* Global page cache statistics; per-object counts live in the mmobj */
+static uint32_t pf_nhits;
+static uint32_t pf_nmisses;
+static uint32_t pf_nevicts;
+static uint32_t pf_npromotes;
+static uint32_t pf_ndemotes;
+static uint32_t pf_nreadahead;
+static uint32_t pf_nunfilled;    /* misses that skipped the fill */
+static uint32_t pf_nwritebacks;  /* cleanpage/cleanpages requests */
+static uint32_t pf_nwritten;     /* pages they wrote back */
+static uint32_t pf_nthrottled;   /* writers made to wait for flushd */
+static uint32_t pf_nrmap;        /* page table entries mapping page frames */
+static uint32_t pf_nunmaps;      /* page table entries cleared */
+static uint32_t pf_nunmapskips;  /* removals of pages that were not mapped */
 
 static slab_allocator_t *pframe_allocator;
 
+/* One page table entry that maps a page frame, on the frame's pf_rmap */
+typedef struct pframe_rmap {
+        pagedir_t      *pr_pagedir;
+        uintptr_t       pr_vaddr;
+        list_link_t     pr_link;
+} pframe_rmap_t;
+
+static slab_allocator_t *pframe_rmap_allocator;
+
 /* Used to quickly look up pframes. ALL pages "owned by" some
  * mmobj should be in this hash
- * (object, pagenum) --> list of pframes */
-#define hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
-                                  % PF_HASH_SIZE)
-static list_t pframe_hash[PF_HASH_SIZE];
+ * (object, pagenum) --> list of pframes
+ *
+ * The table always has a power-of-two number of buckets. It starts out as
+ * the static PF_HASH_SIZE array and doubles (into page_alloc_n memory)
+ * whenever the average chain length would exceed PF_HASH_MAX_LOAD, up to
+ * 2^PF_HASH_MAX_SHIFT buckets. Both the object address and the page number
+ * go through a multiplicative (Fibonacci) hash, so neighbouring pages and
+ * neighbouring objects spread over the whole table. */
+#define PF_HASH_GOLDEN           0x61c88647
+#define hash_page(obj, pagenum)  ((((((uint32_t)(obj)) * PF_HASH_GOLDEN) \
+                                    ^ (pagenum)) * PF_HASH_GOLDEN)        \
+                                  >> (32 - pframe_hash_shift))
+#define pframe_hash_size()       (1U << pframe_hash_shift)
+static list_t pframe_hash_initial[PF_HASH_SIZE];
+static list_t *pframe_hash;
+static uint32_t pframe_hash_shift;
+static uint32_t pframe_hash_count;
 
 /* Related to the Pageout daemon: */
 
@@ -104,15 +173,118 @@ static ktqueue_t pageoutd_waitq;
 /* threads waiting for pageoutd to run sleep on this queue */
 static ktqueue_t alloc_waitq;
 
+/*     The DIRTY list:
+ *       Every dirty, unpinned page, in the order it was dirtied (or
+ *       unpinned while dirty). Each page records the value of dirty_seq
+ *       when it was queued, so the age of the oldest dirty page can be
+ *       measured in dirtyings since; there is no clock to measure it by.
+ */
+static uint32_t ndirty;
+static list_t dirty_list;
+static uint32_t dirty_seq;
+
+/* Related to the flush daemon: */
+
+/*   flushd sleeps on this queue */
+static proc_t *flushd = NULL;
+static kthread_t *flushd_thr = NULL;
+static ktqueue_t flushd_waitq;
+
+/* throttled writers wait for a round of writeback on this queue */
+static ktqueue_t flushd_throttleq;
+
+/* Flush daemon functions */
+static void *flushd_run(int arg1, void *arg2);
+static void flushd_balance(void);
+#define flushd_wakeup()          (sched_broadcast_on(&flushd_waitq))
+#define flushd_cache_pages()     \
+        ((uint32_t)(nallocated + npinned) + page_free_count())
+#define flushd_expired()         \
+        ((0 < ndirty) && (dirty_seq - (list_head(&dirty_list, pframe_t, \
+                                                 pf_dlink))->pf_dirtied  \
+                          >= PF_DIRTY_EXPIRE))
+#define flushd_needed()          \
+        ((ndirty > (flushd_cache_pages() >> PF_DIRTY_BG_SHIFT)) \
+         || flushd_expired())
+#define flushd_over_limit()      \
+        (ndirty > (flushd_cache_pages() >> PF_DIRTY_MAX_SHIFT))
+
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
 #define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()        \
-	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
+	((page_free_count() <= nfreepages_min) && (0 < nallocated))
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
 
 
+/*
+ * Link an unpinned page onto the tail of the allocated list selected by
+ * its PF_ACTIVE flag.
+ */
+static void
+pframe_enqueue(pframe_t *pf)
+{
+        if (pframe_is_active(pf)) {
+                nactive++;
+                list_insert_tail(&active_list, &pf->pf_link);
+        } else {
+                ninactive++;
+                list_insert_tail(&inactive_list, &pf->pf_link);
+        }
+}
+
+/*
+ * Unlink an unpinned page from whichever allocated list it is on.
+ */
+static void
+pframe_dequeue(pframe_t *pf)
+{
+        if (pframe_is_active(pf)) {
+                nactive--;
+        } else {
+                ninactive--;
+        }
+        list_remove(&pf->pf_link);
+}
+
+/* Put a dirty page that is not pinned at the tail of the dirty list */
+static void
+pframe_dirty_enqueue(pframe_t *pf)
+{
+        pf->pf_dirtied = dirty_seq++;
+        list_insert_tail(&dirty_list, &pf->pf_dlink);
+        ndirty++;
+}
+
+static void
+pframe_dirty_dequeue(pframe_t *pf)
+{
+        list_remove(&pf->pf_dlink);
+        ndirty--;
+}
+
+/* Set or clear PF_DIRTY, keeping the radix tag and dirty list in step */
+static void
+pframe_mark_dirty(pframe_t *pf)
+{
+        KASSERT(!pframe_is_dirty(pf));
+        pframe_set_dirty(pf);
+        radix_tag_set(&pf->pf_obj->mmo_pages, pf->pf_pagenum, PF_TAG_DIRTY);
+        if (!pframe_is_pinned(pf))
+                pframe_dirty_enqueue(pf);
+}
+
+static void
+pframe_mark_clean(pframe_t *pf)
+{
+        KASSERT(pframe_is_dirty(pf));
+        pframe_clear_dirty(pf);
+        radix_tag_clear(&pf->pf_obj->mmo_pages, pf->pf_pagenum, PF_TAG_DIRTY);
+        if (!pframe_is_pinned(pf))
+                pframe_dirty_dequeue(pf);
+}
+
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
@@ -126,14 +298,28 @@ pframe_init(void)
         npinned = 0;
         list_init(&pinned_list);
         nallocated = 0;
-        list_init(&alloc_list);
+        ninactive = 0;
+        list_init(&inactive_list);
+        nactive = 0;
+        list_init(&active_list);
+        ndirty = 0;
+        list_init(&dirty_list);
+        dirty_seq = 0;
 
         pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
         KASSERT(NULL != pframe_allocator);
+        pframe_rmap_allocator = slab_allocator_create("pframe_rmap", sizeof(pframe_rmap_t));
+        KASSERT(NULL != pframe_rmap_allocator);
+        radix_init();
 
         /* initialize pframe_hash: */
-        int i;
-        for (i = 0; i < PF_HASH_SIZE; ++i)
+        KASSERT(0 == (PF_HASH_SIZE & (PF_HASH_SIZE - 1)));
+        uint32_t i;
+        pframe_hash = pframe_hash_initial;
+        pframe_hash_count = 0;
+        for (pframe_hash_shift = 0; pframe_hash_size() < PF_HASH_SIZE; ++pframe_hash_shift)
+                ;
+        for (i = 0; i < pframe_hash_size(); ++i)
                 list_init(&pframe_hash[i]);
 
         /* initialize pageout parameters: */
@@ -163,7 +349,13 @@ pframe_shutdown()
 
         /* Free all pages */
         pframe_t *pf;
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
+        list_iterate_begin(&inactive_list, pf, pframe_t, pf_link) {
+                KASSERT(!pframe_is_dirty(pf));
+                KASSERT(!pframe_is_busy(pf));
+                KASSERT(!pframe_is_pinned(pf));
+                pframe_free(pf);
+        } list_iterate_end();
+        list_iterate_begin(&active_list, pf, pframe_t, pf_link) {
                 KASSERT(!pframe_is_dirty(pf));
                 KASSERT(!pframe_is_busy(pf));
                 KASSERT(!pframe_is_pinned(pf));
@@ -171,6 +363,45 @@ pframe_shutdown()
         } list_iterate_end();
 }
 
+/*
+ * Find the page identified by 'o' and 'pagenum' in the resident page hash,
+ * without counting it as a use.
+ */
+static pframe_t *
+pframe_hash_lookup(struct mmobj *o, uint32_t pagenum)
+{
+        list_t *hashchain;
+        pframe_t *pf;
+
+        hashchain = &pframe_hash[hash_page(o, pagenum)];
+        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
+                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
+                        /* found a page with the specified identity. It is
+                         * up to the caller to recognize/care if the page
+                         * is busy. */
+                        return pf;
+                }
+        } list_iterate_end();
+
+        return NULL;
+}
+
+/*
+ * Record a use of a resident page; pageoutd looks at the referenced bit
+ * when it next scans the page. The first use of a page brought in by
+ * readahead only clears PF_READAHEAD, so a file that is streamed through
+ * once looks the same whether or not it was read ahead.
+ */
+static void
+pframe_touch(pframe_t *pf)
+{
+        if (pframe_is_readahead(pf)) {
+                pframe_clear_readahead(pf);
+        } else {
+                pframe_set_referenced(pf);
+        }
+}
+
 /*
  * Obtain the (unique) page identified by 'o' and 'pagenum' only if this page is
  * already resident; if this page is not already resident, NULL is
@@ -189,25 +420,52 @@ pframe_shutdown()
 pframe_t *
 pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 {
-        list_t *hashchain;
         pframe_t *pf;
 
-        hashchain = &pframe_hash[hash_page(o, pagenum)];
-        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-                        /* found a page with the specified identity. It is
-                         * up to the caller to recognize/care if the page
-                         * is busy. */
-                        if (!pframe_is_pinned(pf)) {
-                                /* send to back of alloc_list */
-                                list_remove(&pf->pf_link);
-                                list_insert_tail(&alloc_list, &pf->pf_link);
-                        }
-                        return pf;
-                }
-        } list_iterate_end();
+        if (NULL != (pf = pframe_hash_lookup(o, pagenum)))
+                pframe_touch(pf);
+        return pf;
+}
 
-        return NULL;
+/*
+ * Double the number of buckets in the resident page hash and rehash every
+ * page into the new table. If there is no memory for a bigger table we
+ * just keep using the current one; lookups stay correct, only slower.
+ * This does not block.
+ */
+static void
+pframe_hash_grow(void)
+{
+        uint32_t oldsize = pframe_hash_size();
+        uint32_t npages = (2 * oldsize * sizeof(list_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+        list_t *oldhash = pframe_hash;
+        list_t *newhash;
+        pframe_t *pf;
+        uint32_t i;
+
+        if (NULL == (newhash = page_alloc_n(npages))) {
+                dbg(DBG_PFRAME, "not enough memory to grow pframe hash\n");
+                return;
+        }
+
+        pframe_hash = newhash;
+        pframe_hash_shift++;
+        for (i = 0; i < pframe_hash_size(); ++i)
+                list_init(&pframe_hash[i]);
+
+        for (i = 0; i < oldsize; ++i) {
+                list_iterate_begin(&oldhash[i], pf, pframe_t, pf_hlink) {
+                        list_remove(&pf->pf_hlink);
+                        list_insert_head(&pframe_hash[hash_page(pf->pf_obj, pf->pf_pagenum)],
+                                         &pf->pf_hlink);
+                } list_iterate_end();
+        }
+
+        if (oldhash != pframe_hash_initial)
+                page_free_n(oldhash, (oldsize * sizeof(list_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+
+        dbg(DBG_PFRAME, "pframe hash grown to %u buckets for %u pages\n",
+            pframe_hash_size(), pframe_hash_count);
 }
 
 /*
@@ -236,17 +494,29 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
                 slab_obj_free(pframe_allocator, pf);
                 return NULL;
         }
-
-        nallocated++;
-        list_insert_tail(&alloc_list, &pf->pf_link);
+        if (0 > radix_insert(&o->mmo_pages, pagenum, pf)) {
+                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                page_free(pf->pf_addr);
+                slab_obj_free(pframe_allocator, pf);
+                return NULL;
+        }
 
         pf->pf_obj = o;
         pf->pf_pagenum = pagenum;
         pf->pf_flags = 0;
+        list_init(&pf->pf_rmap);
+        page_set_owner(pf->pf_addr, 1, pf);
+
+        nallocated++;
+        pframe_enqueue(pf);
+
         sched_queue_init(&pf->pf_waitq);
         pf->pf_pincount = 0;
 
         list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
+        if ((++pframe_hash_count > PF_HASH_MAX_LOAD * pframe_hash_size())
+            && (pframe_hash_shift < PF_HASH_MAX_SHIFT))
+                pframe_hash_grow();
 
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
@@ -297,25 +567,28 @@ int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
 
+        int filled = 0;
+
         KASSERT(NULL != o);
         KASSERT(NULL != result);
 
 start:
         /* check if resident */
-        *result = pframe_get_resident(o, pagenum);
+        *result = pframe_hash_lookup(o, pagenum);
         if(*result == NULL){
             /*not resident, allocate new*/
+            filled = 1;
             *result = pframe_alloc(o, pagenum);
             if(*result == NULL){
                 pageoutd_wakeup();
                 goto start;
             }
-            int res = (pframe_fill(*result) < 0);
-            
+            int res = pframe_fill(*result);
             if(res < 0){
+                /* the page never held valid contents; drop it */
                 pframe_free( *result );
-                pageoutd_wakeup();
-                goto start;
+                *result = NULL;
+                return res;
             }
             
         }
@@ -331,9 +604,221 @@ start:
 
         KASSERT( !pframe_is_busy(*result) );
         KASSERT( *result != NULL);
+
+        if (filled) {
+                pf_nmisses++;
+                o->mmo_nmisses++;
+        } else {
+                pframe_touch(*result);
+                pf_nhits++;
+                o->mmo_nhits++;
+        }
+        return 0;
+}
+
+/*
+ * Get and pin the n consecutive pages of o starting at pagenum, for
+ * callers that copy a whole range in or out at once. The pages that are
+ * already resident are found and pinned in a single pass, which never
+ * blocks; the rest are then brought in one at a time with pframe_get.
+ * Pinning each page as soon as we have it keeps it resident while we
+ * block on the others.
+ *
+ * If overwrite is set the caller is going to overwrite every page in the
+ * range completely, so pages that are not resident are allocated without
+ * being filled. Such a page is returned busy as well as pinned, so nobody
+ * else can look at it; the caller must fill it and hand it over with
+ * pframe_overwritten() or pframe_dirty_overwritten() before it unpins
+ * the page.
+ *
+ * On success pfs[0..n) hold the pinned pages and the caller unpins each
+ * of them when done. On failure nothing is left pinned.
+ *
+ * This routine may block at the mmobj operation level.
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int
+pframe_get_range(struct mmobj *o, uint32_t pagenum, uint32_t n, int overwrite,
+                 pframe_t **pfs)
+{
+        pframe_t *pf;
+        uint32_t i, unfilled = 0;       /* bit i: pfs[i] was not filled */
+        int ret;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != pfs);
+        KASSERT(n <= 32);
+
+        for (i = 0; i < n; ++i) {
+                pf = pframe_hash_lookup(o, pagenum + i);
+                if ((NULL != pf) && !pframe_is_busy(pf)) {
+                        pframe_touch(pf);
+                        pf_nhits++;
+                        o->mmo_nhits++;
+                        pframe_pin(pf);
+                        pfs[i] = pf;
+                } else {
+                        pfs[i] = NULL;
+                }
+        }
+
+        for (i = 0; i < n; ++i) {
+                if (NULL != pfs[i])
+                        continue;
+                if (overwrite && (NULL == pframe_hash_lookup(o, pagenum + i))
+                    && (NULL != (pf = pframe_alloc(o, pagenum + i)))) {
+                        pf_nmisses++;
+                        pf_nunfilled++;
+                        o->mmo_nmisses++;
+                        pframe_pin(pf);
+                        pframe_set_busy(pf);
+                        pfs[i] = pf;
+                        unfilled |= 1U << i;
+                        continue;
+                }
+                /* resident but busy, or no page to be had right now */
+                if (0 > (ret = pframe_get(o, pagenum + i, &pfs[i]))) {
+                        pfs[i] = NULL;
+                        for (i = 0; i < n; ++i) {
+                                if (NULL == pfs[i])
+                                        continue;
+                                if (unfilled & (1U << i)) {
+                                        /* nobody has seen it; just drop it */
+                                        pframe_overwritten(pfs[i]);
+                                        pframe_unpin(pfs[i]);
+                                        pframe_free(pfs[i]);
+                                } else {
+                                        pframe_unpin(pfs[i]);
+                                }
+                        }
+                        return ret;
+                }
+                pframe_pin(pfs[i]);
+        }
+        return 0;
+}
+
+/*
+ * Hand over a page that pframe_get_range() allocated without filling, now
+ * that the caller has written all of it. The page stays pinned.
+ */
+void
+pframe_overwritten(pframe_t *pf)
+{
+        KASSERT(pframe_is_busy(pf));
+        KASSERT(pframe_is_pinned(pf));
+
+        pframe_clear_busy(pf);
+        sched_broadcast_on(&pf->pf_waitq);
+}
+
+/*
+ * Like pframe_overwritten(), for a caller that is going to dirty the page
+ * anyway: the page is dirtied while it is still busy, so its new contents
+ * are never visible to anyone unless they are also going to reach the
+ * disk. On success the page stays pinned. If the dirtypage operation
+ * fails the page is unpinned and dropped, so whoever was waiting for it
+ * reads it in again, and the error is returned.
+ *
+ * This routine can block at the mmobj operation level.
+ */
+int
+pframe_dirty_overwritten(pframe_t *pf)
+{
+        int ret;
+
+        KASSERT(pframe_is_busy(pf));
+        KASSERT(pframe_is_pinned(pf));
+        KASSERT(!pframe_is_dirty(pf));
+
+        if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf)))
+                pframe_mark_dirty(pf);
+        pframe_clear_busy(pf);
+        sched_broadcast_on(&pf->pf_waitq);
+
+        if (ret) {
+                /* nobody can have pinned it while it was busy */
+                pframe_unpin(pf);
+                pframe_free(pf);
+                return ret;
+        }
+        flushd_balance();
+        return 0;
+}
+
+/*
+ * Fill a page nobody else can see yet (it is busy, and being filled or
+ * overwritten) with zeros. If zerod has a zeroed page ready it takes the
+ * place of the page's memory rather than clearing it here.
+ */
+void
+pframe_zero(pframe_t *pf)
+{
+        void *addr;
+
+        KASSERT(pframe_is_busy(pf));
+
+        if (NULL != (addr = page_take_zeroed())) {
+                KASSERT(!pframe_is_mapped(pf));
+                page_free(pf->pf_addr);
+                pf->pf_addr = addr;
+                page_set_owner(pf->pf_addr, 1, pf);
+        } else {
+                memset(pf->pf_addr, 0, PAGE_SIZE);
+        }
+}
+
+/*
+ * Allocate the page identified by the object and page number on behalf of
+ * readahead, without filling it. The new page is busy; the caller fills it
+ * (usually together with its neighbours) and then hands it over with
+ * pframe_readahead_done(). Anyone who looks the page up in the meantime
+ * waits for it like any other busy page.
+ *
+ * Readahead is only a hint, so unlike pframe_get this never waits for
+ * memory and does not eat into pageoutd's reserve.
+ *
+ * @return 0 on success, -EEXIST if the page is already resident, -ENOMEM
+ *         if there is no page to spare
+ */
+int
+pframe_readahead_alloc(struct mmobj *o, uint32_t pagenum, pframe_t **result)
+{
+        KASSERT(NULL != o);
+        KASSERT(NULL != result);
+
+        if (NULL != pframe_hash_lookup(o, pagenum))
+                return -EEXIST;
+        if (pageoutd_needed() || (NULL == (*result = pframe_alloc(o, pagenum))))
+                return -ENOMEM;
+
+        pframe_set_busy(*result);
+        pframe_set_readahead(*result);
         return 0;
 }
 
+/*
+ * Finish a page allocated with pframe_readahead_alloc(). If err is
+ * negative the page could not be filled and is thrown away; whoever needs
+ * it will fill it through pframe_get.
+ *
+ * This routine may block in the mmobj put operation.
+ */
+void
+pframe_readahead_done(pframe_t *pf, int err)
+{
+        KASSERT(pframe_is_busy(pf));
+
+        pframe_clear_busy(pf);
+        sched_broadcast_on(&pf->pf_waitq);
+        if (0 > err) {
+                pframe_free(pf);
+        } else {
+                pf_nreadahead++;
+        }
+}
+
 int
 pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result)
 {
@@ -362,6 +847,11 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
+                if (0 > radix_insert(&dest->mmo_pages, pf->pf_pagenum, pf))
+                        panic("not enough kernel memory to migrate page\n");
+                if (pframe_is_dirty(pf))
+                        radix_tag_set(&dest->mmo_pages, pf->pf_pagenum, PF_TAG_DIRTY);
+                radix_remove(&src->mmo_pages, pf->pf_pagenum);
                 pf->pf_obj = dest;
                 list_remove(&pf->pf_hlink);
                 list_remove(&pf->pf_olink);
@@ -393,10 +883,12 @@ pframe_pin(pframe_t *pf)
     pframe_set_busy(pf);
     if(!pframe_is_pinned(pf)){
         /* pin for the first time */
-        list_remove(&pf->pf_link);
+        pframe_dequeue(pf);
         list_insert_tail(&pinned_list, &pf->pf_link);
         nallocated --;
         npinned ++;
+        if (pframe_is_dirty(pf))
+            pframe_dirty_dequeue(pf);
 
     }
     pf->pf_pincount ++ ;
@@ -423,9 +915,11 @@ pframe_unpin(pframe_t *pf)
     if(!pframe_is_pinned(pf)){
         /*  pin count reaches zero */
         list_remove(&pf->pf_link);
-        list_insert_tail(&alloc_list, &pf->pf_link);
+        pframe_enqueue(pf);
         nallocated ++;
         npinned --;
+        if (pframe_is_dirty(pf))
+            pframe_dirty_enqueue(pf);
         pframe_clear_busy(pf);
 
     }
@@ -438,8 +932,10 @@ pframe_unpin(pframe_t *pf)
 /*
  * Indicates that a page is about to be modified. This should be called on a
  * page before any attempt to modify its contents. This marks the page dirty
- * (so that pageoutd knows to clean it before reclaiming the page frame)
- * and calls the dirtypage mmobj entry point.
+ * (so that flushd writes it back, and pageoutd knows to clean it before
+ * reclaiming the page frame) and calls the dirtypage mmobj entry point.
+ * If too much of the page cache is now dirty, waits for the flusher to
+ * write some of it back before returning.
  * The given page must not be busy.
  *
  * This routine can block at the mmobj operation level.
@@ -456,21 +952,65 @@ pframe_dirty(pframe_t *pf)
 
         pframe_set_busy(pf);
 
-        if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
-                pframe_set_dirty(pf);
-        }
+        if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))
+            && !pframe_is_dirty(pf))
+                pframe_mark_dirty(pf);
         pframe_clear_busy(pf);
         sched_broadcast_on(&pf->pf_waitq);
 
-        pageoutd_wakeup();
+        if (!ret)
+                flushd_balance();
         return ret;
 }
 
+/* A neighbour of a page being cleaned that can be written back with it */
+#define pframe_cleanable(pf) \
+        ((NULL != (pf)) && pframe_is_dirty(pf) && !pframe_is_busy(pf) \
+         && !pframe_is_pinned(pf))
+
+/*
+ * Collect the run of pages to write back along with pf into cluster, in
+ * page order: pf and the pages around it in the same object that are
+ * resident, dirty, unpinned and not busy, up to PF_CLEAN_CLUSTER_PAGES in
+ * all. Objects without a cleanpages entry point only ever get pf itself.
+ * Never blocks.
+ * @return the number of pages in the cluster
+ */
+static uint32_t
+pframe_gather_cluster(pframe_t *pf, pframe_t **cluster)
+{
+        mmobj_t *o = pf->pf_obj;
+        uint32_t first = pf->pf_pagenum, n = 1, i;
+
+        if (NULL != o->mmo_ops->cleanpages) {
+                while ((0 < first) && (n < PF_CLEAN_CLUSTER_PAGES)
+                       && pframe_cleanable((pframe_t *)
+                                           radix_lookup(&o->mmo_pages, first - 1))) {
+                        --first;
+                        ++n;
+                }
+                while ((n < PF_CLEAN_CLUSTER_PAGES) && (0 != first + n)
+                       && pframe_cleanable((pframe_t *)
+                                           radix_lookup(&o->mmo_pages, first + n))) {
+                        ++n;
+                }
+        }
+
+        for (i = 0; i < n; ++i)
+                cluster[i] = radix_lookup(&o->mmo_pages, first + i);
+        return n;
+}
+
 /*
  * Clean a dirty page by writing it back to disk. Removes the dirty
  * bit of the page and updates the MMU entry.
  * The page must be dirty but unpinned.
  *
+ * If the object has a cleanpages entry point, the dirty neighbours of the
+ * page (see pframe_gather_cluster) are written back in the same request,
+ * and every page of the cluster is busy until the request completes. If
+ * it fails, they are all dirty again.
+ *
  * This routine can block at the mmobj operation level.
  * @param pf the page to clean
  * @return 0 on success, -errno on failure
@@ -478,31 +1018,57 @@ pframe_dirty(pframe_t *pf)
 int
 pframe_clean(pframe_t *pf)
 {
+        pframe_t *cluster[PF_CLEAN_CLUSTER_PAGES];
+        mmobj_t *o = pf->pf_obj;
+        tlb_batch_t tb;
+        uint32_t i, n;
         int ret;
-        
+
         KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
         KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
 
-        dbg(DBG_PFRAME, "cleaning page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
+        n = pframe_gather_cluster(pf, cluster);
 
-        /*
-         * Clear the dirty bit *before* we potentially (depending on this
-         * particular object type's 'dirtypage' implementation) block so
-         * that if the page is dirtied again while we're writing it out,
-         * we won't (incorrectly) think the page has been fully cleaned.
-         */
-        pframe_clear_dirty(pf);
+        dbg(DBG_PFRAME, "cleaning pages %d-%d of obj %p\n", cluster[0]->pf_pagenum,
+            cluster[n - 1]->pf_pagenum, o);
 
-        /* Make sure a future write to the page will fault (and hence dirty it) */
-        tlb_flush((uintptr_t) pf->pf_addr);
-        pframe_remove_from_pts(pf);
+        tlb_batch_init(&tb);
+        for (i = 0; i < n; ++i) {
+                pframe_t *p = cluster[i];
 
-        pframe_set_busy(pf);
-        if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
-                pframe_set_dirty(pf);
+                /*
+                 * Clear the dirty bit *before* we potentially (depending on this
+                 * particular object type's 'dirtypage' implementation) block so
+                 * that if the page is dirtied again while we're writing it out,
+                 * we won't (incorrectly) think the page has been fully cleaned.
+                 */
+                pframe_mark_clean(p);
+
+                /* Make sure a future write to the page will fault (and hence dirty it) */
+                pframe_remove_from_pts(p, &tb);
+
+                pframe_set_busy(p);
+                radix_tag_set(&o->mmo_pages, p->pf_pagenum, PF_TAG_WRITEBACK);
+        }
+        tlb_batch_flush(&tb);
+
+        if (1 == n)
+                ret = o->mmo_ops->cleanpage(o, pf);
+        else
+                ret = o->mmo_ops->cleanpages(o, cluster, n);
+        pf_nwritebacks++;
+        if (0 <= ret)
+                pf_nwritten += n;
+
+        for (i = 0; i < n; ++i) {
+                pframe_t *p = cluster[i];
+
+                if ((ret < 0) && !pframe_is_dirty(p))
+                        pframe_mark_dirty(p);
+                radix_tag_clear(&o->mmo_pages, p->pf_pagenum, PF_TAG_WRITEBACK);
+                pframe_clear_busy(p);
+                sched_broadcast_on(&p->pf_waitq);
         }
-        pframe_clear_busy(pf);
-        sched_broadcast_on(&pf->pf_waitq);
 
         return ret;
 }
@@ -526,23 +1092,27 @@ pframe_free(pframe_t *pf)
 
         mmobj_t *o = pf->pf_obj;
 
+        if (pframe_is_dirty(pf))
+                pframe_mark_clean(pf);
+
 
-        /* Flush the TLB */
-        tlb_flush((uintptr_t) pf->pf_addr);
         /* Remove from all pagetables that map it */
-        pframe_remove_from_pts(pf);
+        pframe_remove_from_pts(pf, NULL);
+        KASSERT(!pframe_is_mapped(pf));
 
         list_remove(&pf->pf_hlink);
+        pframe_hash_count--;
 
         pf->pf_obj = NULL;
         nallocated--;
-        list_remove(&pf->pf_link);
+        pframe_dequeue(pf);
 
         page_free(pf->pf_addr);
         slab_obj_free(pframe_allocator, pf);
 
         o->mmo_nrespages--;
         list_remove(&pf->pf_olink);
+        radix_remove(&o->mmo_pages, pf->pf_pagenum);
 
         /* Now that pf has effectively been freed, dereference the corresponding
          * object. We don't do this earlier as we are modifying the object's counts
@@ -551,62 +1121,200 @@ pframe_free(pframe_t *pf)
 }
 
 /*
- * Clean all allocated pages (that is, all pages that are not pinned and
- * not free). This is called by sync(2).
+ * Clean the first dirty page found on the given allocated list, waiting
+ * for it first if it is busy. Returns 1 if we blocked (the list may have
+ * changed under us), 0 if the whole list is clean.
  */
-void
-pframe_clean_all()
+static int
+pframe_clean_list(list_t *list)
 {
         pframe_t *pf;
-        dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
 
-        /*
-         * Iterate from head of alloc_list to tail; This is a rough attempt to
-         * sync from least active to most active. Note that every time we block we
-         * need to start the loop over as the "current element" pf may have been
-         * moved or removed in the meantime (our list has no multithreaded
-         * integrity)
-         */
-list_start:
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
+        list_iterate_begin(list, pf, pframe_t, pf_link) {
                 KASSERT(!pframe_is_pinned(pf));
                 KASSERT(!pframe_is_free(pf));
                 if (pframe_is_busy(pf)) {
                         sched_sleep_on(&pf->pf_waitq);
-                        goto list_start;
+                        return 1;
                 }
                 if (pframe_is_dirty(pf)) {
                         pframe_clean(pf);
-                        goto list_start;
+                        return 1;
                 }
         } list_iterate_end();
 
+        return 0;
+}
+
+/*
+ * Clean all allocated pages (that is, all pages that are not pinned and
+ * not free). This is called by sync(2).
+ */
+void
+pframe_clean_all()
+{
+        dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
+
+        /*
+         * Sweep the inactive list and then the active list; This is a rough
+         * attempt to sync from least active to most active. Note that every
+         * time we block we need to start over as the "current element" may
+         * have been moved or removed in the meantime (our lists have no
+         * multithreaded integrity)
+         */
+        while (pframe_clean_list(&inactive_list) || pframe_clean_list(&active_list))
+                ;
+
         /* In theory, this function might never terminate (if new pages are
          * constantly being added at the same time). That's why the user shouldn't
          * call sync(2) very much... */
         dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
 }
 
-/* Remove a page frame from the page tables of all processes that map it
- * To do that, traverse all processes that map the given page frame into
- * their address space, and zero the corresponding address entry.
+/*
+ * Write back the dirty pages of o with page numbers in [start, end), in
+ * page order. Only dirty pages are visited, so this is cheap for an
+ * object with many resident but few dirty pages. Pinned pages cannot be
+ * cleaned and are skipped.
+ *
+ * This routine can block at the mmobj operation level.
+ * @return 0 on success, -EBUSY if a dirty page was pinned, or the error of
+ *         the last page that failed to clean
+ */
+int
+pframe_clean_range(mmobj_t *o, uint32_t start, uint32_t end)
+{
+        pframe_t *pf;
+        uint32_t next = start;
+        int ret = 0, err;
+
+        /* Look the next page up afresh every time, since anything we
+         * looked at before blocking may have been freed. */
+        while ((next < end)
+               && (1 == radix_gang_lookup_tag(&o->mmo_pages, (void **)&pf,
+                                              next, 1, PF_TAG_DIRTY))
+               && (pf->pf_pagenum < end)) {
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                        continue;
+                }
+                next = pf->pf_pagenum + 1;
+                if (pframe_is_pinned(pf)) {
+                        ret = -EBUSY;
+                } else if (0 > (err = pframe_clean(pf))) {
+                        ret = err;
+                }
+                if (0 == next)
+                        break;
+        }
+
+        return ret;
+}
+
+/*
+ * Uncache every unpinned page of o with a page number in [start, end),
+ * waiting for busy pages first. Dirty pages are dropped without being
+ * written back; call pframe_clean_range first if their contents matter.
+ * The caller must hold a reference to o.
+ *
+ * This routine may block in the mmobj put operation.
  */
 void
-pframe_remove_from_pts(pframe_t *pf)
-{
-        vmarea_t *vma;
-        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
-                /* Get the virtual address in the area corresponding to this pf */
-                if ((pf->pf_pagenum >= vma->vma_off)
-                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
-                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
-                        /* And unmap it from that area's proc */
-                        if (NULL != vma->vma_vmmap->vmm_proc) {
-                                pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
-                        }
+pframe_invalidate_range(mmobj_t *o, uint32_t start, uint32_t end)
+{
+        pframe_t *pf;
+        uint32_t next = start;
+
+        while ((next < end)
+               && (1 == radix_gang_lookup(&o->mmo_pages, (void **)&pf, next, 1))
+               && (pf->pf_pagenum < end)) {
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                        continue;
                 }
+                next = pf->pf_pagenum + 1;
+                if (!pframe_is_pinned(pf))
+                        pframe_free(pf);
+                if (0 == next)
+                        break;
+        }
+}
+
+/* Remove a page frame from the page tables of all processes that map it.
+ * The page's reverse map lists exactly the entries to clear, whichever
+ * objects and areas they were mapped through; pt_unmap drops each one
+ * from the list as it clears it.
+ *
+ * Only the entries in the current page directory can be in the TLB;
+ * their invalidations are added to tb, or done right away if tb is NULL.
+ * The caller must flush tb before it blocks.
+ */
+void
+pframe_remove_from_pts(pframe_t *pf, tlb_batch_t *tb)
+{
+        pframe_rmap_t *r;
+        pagedir_t *pd;
+        uintptr_t vaddr;
+        tlb_batch_t one;
+
+        if (!pframe_is_mapped(pf)) {
+                pf_nunmapskips++;
+                return;
+        }
+        if (NULL == tb) {
+                tlb_batch_init(&one);
+                tb = &one;
+        }
+
+        while (pframe_is_mapped(pf)) {
+                r = list_head(&pf->pf_rmap, pframe_rmap_t, pr_link);
+                pd = r->pr_pagedir;
+                vaddr = r->pr_vaddr;
+
+                pt_unmap(pd, vaddr);
+                KASSERT(!pframe_is_mapped(pf)
+                        || r != list_head(&pf->pf_rmap, pframe_rmap_t, pr_link));
+                pf_nunmaps++;
+                if (pt_get() == pd)
+                        tlb_batch_add(tb, vaddr);
+        }
 
+        if (&one == tb)
+                tlb_batch_flush(tb);
+}
+
+int
+pframe_rmap_add(void *addr, pagedir_t *pd, uintptr_t vaddr)
+{
+        pframe_t *pf = page_owner(addr);
+        pframe_rmap_t *r;
+
+        KASSERT(NULL != pf && addr == pf->pf_addr && "page table maps a page that is not a page frame");
+        if (NULL == (r = slab_obj_alloc(pframe_rmap_allocator)))
+                return -ENOMEM;
+        r->pr_pagedir = pd;
+        r->pr_vaddr = vaddr;
+        list_insert_head(&pf->pf_rmap, &r->pr_link);
+        pf_nrmap++;
+        return 0;
+}
+
+void
+pframe_rmap_remove(void *addr, pagedir_t *pd, uintptr_t vaddr)
+{
+        pframe_t *pf = page_owner(addr);
+        pframe_rmap_t *r;
+
+        KASSERT(NULL != pf && addr == pf->pf_addr && "page table maps a page that is not a page frame");
+        list_iterate_begin(&pf->pf_rmap, r, pframe_rmap_t, pr_link) {
+                if ((pd == r->pr_pagedir) && (vaddr == r->pr_vaddr)) {
+                        list_remove(&r->pr_link);
+                        slab_obj_free(pframe_rmap_allocator, r);
+                        pf_nrmap--;
+                        return;
+                }
         } list_iterate_end();
+        panic("page table entry missing from the reverse map of page %p\n", addr);
 }
 
 /* ------------------------------------------------------------------ */
@@ -649,32 +1357,88 @@ pageoutd_exit()
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
+ * Move pages from the head of the active list to the inactive list until
+ * the inactive list holds its share of the allocated pages. This is the
+ * clock hand over the active list: a referenced page has its bit cleared
+ * and goes around again, an unreferenced one is demoted. Every page is
+ * demoted after at most two passes, so this terminates. Never blocks.
+ */
+static void
+pageoutd_refill_inactive(void)
+{
+        pframe_t *pf;
+
+        while ((0 < nactive)
+               && ((0 == ninactive)
+                   || (ninactive < (nallocated >> PF_INACTIVE_MIN_SHIFT)))) {
+                pf = list_head(&active_list, pframe_t, pf_link);
+                pframe_dequeue(pf);
+                if (pframe_is_referenced(pf)) {
+                        pframe_clear_referenced(pf);
+                } else {
+                        pframe_clear_active(pf);
+                        pf_ndemotes++;
+                }
+                pframe_enqueue(pf);
+        }
+}
+
+/*
+ * The pageout daemon, when run, takes the page at the head of the inactive
+ * list. Make sure to check if the page is busy before yanking it. If it has
+ * been referenced since it was queued, promote it to the active list instead.
+ * A dirty page is left to flushd: it goes to the back of the inactive list
+ * and is looked at again once flushd has had a chance to clean it. Only if
+ * every inactive page has been passed over like this do we clean one
+ * ourselves, so that reclaim always makes progress.
+ * Finally, go back to sleep after having paged out the appropriate page.
  * Both arguments unused.
  */
 static void *
 pageoutd_run(int arg1, void *arg2)
 {
         while (1) {
+                int nskipped = 0;
+
                 KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+#ifdef __VFS__
+                /* vnodes kept for reuse pin the pages holding their
+                 * inodes; give some of them up first */
+                if (!pageoutd_target_met())
+                        vnode_reclaim(VNODE_CACHE_MAX / 4);
+#endif
+                while ((!pageoutd_target_met()) && (0 < nallocated)) {
                         pframe_t *pf;
 
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
+                        pageoutd_refill_inactive();
+
+                        /* obtain the oldest inactive page: */
+                        pf = list_head(&inactive_list, pframe_t, pf_link);
 
                         if (pframe_is_busy(pf)) {
                                 sched_sleep_on(&pf->pf_waitq);
+                        } else if (pframe_is_referenced(pf)) {
+                                /* used again while on probation */
+                                pframe_dequeue(pf);
+                                pframe_clear_referenced(pf);
+                                pframe_set_active(pf);
+                                pframe_enqueue(pf);
+                                pf_npromotes++;
+                        } else if (pframe_is_dirty(pf) && (nskipped < ninactive)) {
+                                pframe_dequeue(pf);
+                                pframe_enqueue(pf);
+                                nskipped++;
+                                flushd_wakeup();
                         } else if (pframe_is_dirty(pf)) {
                                 pframe_clean(pf);
                         } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
+                                /* it's not busy, it's clean, and it
+                                 * hasn't been used since it was queued;
+                                 * reclaim it: */
+                                pf_nevicts++;
+                                pf->pf_obj->mmo_nevicts++;
                                 pframe_free(pf);
+                                nskipped = 0;
                         }
                 }
 
@@ -696,3 +1460,173 @@ pageoutd_run(int arg1, void *arg2)
         }
         return NULL;
 }
+
+/* ------------------------------------------------------------------ */
+/* -------------------------- FLUSH DAEMON -------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Start the flush daemon. Like pageoutd it is a child of idleproc.
+ */
+static __attribute__((unused)) void
+flushd_init(void)
+{
+        sched_queue_init(&flushd_waitq);
+        sched_queue_init(&flushd_throttleq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        flushd = proc_create("flushd");
+        KASSERT(NULL != flushd);
+        flushd_thr = kthread_create(flushd, flushd_run, 0, NULL);
+        KASSERT(NULL != flushd_thr);
+
+        sched_make_runnable(flushd_thr);
+}
+init_func(flushd_init);
+init_depends(sched_init);
+
+/*
+ * Stop flushd and wait for it. Whatever is still dirty is written back by
+ * the filesystems as they are unmounted and by pframe_shutdown.
+ */
+void
+flushd_shutdown(void)
+{
+        pid_t pid, child;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        KASSERT(NULL != flushd_thr);
+
+        kthread_cancel(flushd_thr, (void *) 0);
+        flushd_thr = NULL;
+        /* nobody is left to wake throttled writers */
+        sched_broadcast_on(&flushd_throttleq);
+
+        pid = flushd->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than flushd");
+}
+
+/*
+ * Called after a page has been dirtied. Wakes flushd if there is
+ * writeback to do and, if more than 1/2^PF_DIRTY_MAX_SHIFT of the cache
+ * is dirty, makes the caller wait for a round of writeback. flushd and
+ * pageoutd themselves are never throttled, since they do the cleaning.
+ */
+static void
+flushd_balance(void)
+{
+        if ((NULL == flushd_thr) || !flushd_needed())
+                return;
+
+        flushd_wakeup();
+        if (flushd_over_limit() && (curthr != flushd_thr)
+            && (curthr != pageoutd_thr)) {
+                pf_nthrottled++;
+                sched_sleep_on(&flushd_throttleq);
+        }
+}
+
+/*
+ * The flush daemon writes back the oldest dirty pages (pframe_clean takes
+ * their dirty neighbours along) while more than 1/2^PF_DIRTY_BG_SHIFT of
+ * the cache is dirty or the oldest dirty page has expired. Each pass
+ * looks at no more pages than were dirty when it started, so pages that
+ * keep failing to write cannot keep it awake. Throttled writers are
+ * released after every page. Both arguments unused.
+ */
+static void *
+flushd_run(int arg1, void *arg2)
+{
+        while (1) {
+                uint32_t budget = ndirty;
+
+                while ((0 < budget) && flushd_needed()) {
+                        pframe_t *pf = list_head(&dirty_list, pframe_t, pf_dlink);
+
+                        KASSERT(pframe_is_dirty(pf) && !pframe_is_pinned(pf));
+                        budget--;
+                        if (pframe_is_busy(pf))
+                                sched_sleep_on(&pf->pf_waitq);
+                        else
+                                pframe_clean(pf);
+                        sched_broadcast_on(&flushd_throttleq);
+                }
+                sched_broadcast_on(&flushd_throttleq);
+
+                if (sched_cancellable_sleep_on(&flushd_waitq))
+                        kthread_exit((void *)0);
+        }
+        return NULL;
+}
+
+/* Debugging information about the state of the page cache */
+#define PF_HASH_HIST_SIZE 6
+size_t
+pframe_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "pinned:   %d\n", npinned);
+        iprintf(&buf, &size, "active:   %d\n", nactive);
+        iprintf(&buf, &size, "inactive: %d\n", ninactive);
+        iprintf(&buf, &size, "free:     %d\n", page_free_count());
+        iprintf(&buf, &size, "hits:     %u\n", pf_nhits);
+        iprintf(&buf, &size, "misses:   %u\n", pf_nmisses);
+        iprintf(&buf, &size, "evicts:   %u\n", pf_nevicts);
+        iprintf(&buf, &size, "promotes: %u\n", pf_npromotes);
+        iprintf(&buf, &size, "demotes:  %u\n", pf_ndemotes);
+        iprintf(&buf, &size, "readahead: %u\n", pf_nreadahead);
+        iprintf(&buf, &size, "unfilled: %u\n", pf_nunfilled);
+        iprintf(&buf, &size, "dirty:    %u (writeback above %u, throttle above %u)\n",
+                ndirty, flushd_cache_pages() >> PF_DIRTY_BG_SHIFT,
+                flushd_cache_pages() >> PF_DIRTY_MAX_SHIFT);
+        iprintf(&buf, &size, "written:  %u pages in %u requests\n",
+                pf_nwritten, pf_nwritebacks);
+        iprintf(&buf, &size, "throttled: %u\n", pf_nthrottled);
+        iprintf(&buf, &size, "mapped:   %u entries\n", pf_nrmap);
+        iprintf(&buf, &size, "unmapped: %u entries, %u pages not mapped\n",
+                pf_nunmaps, pf_nunmapskips);
+
+        /* resident page hash chain lengths */
+        uint32_t hist[PF_HASH_HIST_SIZE];
+        uint32_t i, maxlen = 0;
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < pframe_hash_size(); ++i) {
+                uint32_t len = 0;
+                list_link_t *link;
+                for (link = pframe_hash[i].l_next; link != &pframe_hash[i]; link = link->l_next)
+                        ++len;
+                maxlen = MAX(maxlen, len);
+                ++hist[MIN(len, PF_HASH_HIST_SIZE - 1)];
+        }
+        iprintf(&buf, &size, "hash:     %u pages in %u buckets, longest chain %u\n",
+                pframe_hash_count, pframe_hash_size(), maxlen);
+        for (i = 0; i < PF_HASH_HIST_SIZE; ++i) {
+                iprintf(&buf, &size, "  chains of length %u%s: %u\n", i,
+                        (PF_HASH_HIST_SIZE - 1 == i) ? "+" : "", hist[i]);
+        }
+
+        return osize - size;
+}
+
+/* Debugging information about one mmobj's use of the page cache */
+size_t
+pframe_mmobj_info(const void *obj, char *buf, size_t osize)
+{
+        size_t size = osize;
+        const mmobj_t *o = obj;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "resident: %d\n", o->mmo_nrespages);
+        iprintf(&buf, &size, "hits:     %u\n", o->mmo_nhits);
+        iprintf(&buf, &size, "misses:   %u\n", o->mmo_nmisses);
+        iprintf(&buf, &size, "evicts:   %u\n", o->mmo_nevicts);
+
+        return osize - size;
+}
@@ -18,6 +18,8 @@
 #include "mm/page.h"
 
 #include "util/gdb.h"
+#include "util/list.h"
+#include "util/printf.h"
 #include "util/string.h"
 #include "util/debug.h"
 
@@ -38,19 +40,59 @@
 #endif
 
 struct slab {
-        struct slab             *s_next;       /* link on list of slabs */
+        list_link_t              s_link;       /* on one of the allocator's slab lists */
+        struct slab_allocator   *s_allocator;
         int                      s_inuse;      /* number of allocated objs */
         void                    *s_free;       /* head of obj free list */
         void                    *s_addr;       /* start address */
 };
 
+/*
+ * Magazines hold objects that have been freed but not yet given back to
+ * their slabs, so that the next allocation can have one without touching
+ * the slab layer at all (see Bonwick and Adams, "Magazines and Vmem").
+ * Each allocator that uses them has a loaded and a previous magazine; it
+ * allocates from the loaded one and frees into it, and swaps the two when
+ * the loaded one runs out (or fills up). Beyond that, full and empty
+ * magazines are kept in the allocator's depot. Weenix has a single CPU,
+ * so there is a single pair per allocator.
+ */
+#define SLAB_MAGAZINE_SIZE              15
+struct slab_magazine {
+        list_link_t              m_link;        /* on a depot list */
+        int                      m_rounds;      /* objects held */
+        void                    *m_objs[SLAB_MAGAZINE_SIZE];
+};
+
+/* Only allocators with at least this many objects per slab use magazines,
+ * so that large objects are not held on to */
+#define SLAB_MAGAZINE_MIN_OBJS          8
+
+/* Most full magazines kept in an allocator's depot */
+#define SLAB_DEPOT_MAX                  4
+
 struct slab_allocator {
         struct slab_allocator   *sa_next;       /* link on list of slab allocators */
         const char              *sa_name;       /* user-provided name */
         size_t                   sa_objsize;    /* object size */
-        struct slab             *sa_slabs;      /* head of slab list */
+        list_t                   sa_partial;    /* slabs with free and allocated objs */
+        list_t                   sa_full;       /* slabs with no free objs */
+        list_t                   sa_free;       /* slabs with no allocated objs */
         int                      sa_order;      /* npages = (1 << order) */
         int                      sa_slab_nobjs; /* number of objs per slab */
+        int                      sa_nslabs;
+        int                      sa_inuse;      /* objs out of the slabs, some
+                                                 * of them in magazines */
+
+        int                      sa_usemags;
+        struct slab_magazine    *sa_loaded;
+        struct slab_magazine    *sa_previous;
+        list_t                   sa_depot_full;
+        list_t                   sa_depot_empty;
+        int                      sa_ndepot_full;
+
+        uint32_t                 sa_nallocs;
+        uint32_t                 sa_nmaghits;   /* allocations from a magazine */
 };
 
 struct slab_bufctl {
@@ -82,6 +124,9 @@ static struct slab_allocator *slab_allocators = NULL;
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
+/* Allocator for magazines, which of course does not use them itself. */
+static struct slab_allocator slab_magazine_allocator;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -158,7 +203,8 @@ _calc_slab_size(struct slab_allocator *allocator)
 }
 
 static void
-_allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
+_allocator_init(struct slab_allocator *allocator, const char *name, size_t size,
+                int usemags)
 {
 #ifdef SLAB_REDZONE
         /*
@@ -172,9 +218,23 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
 
         allocator->sa_name = name;
         allocator->sa_objsize = size;
-        allocator->sa_slabs = NULL;
+        list_init(&allocator->sa_partial);
+        list_init(&allocator->sa_full);
+        list_init(&allocator->sa_free);
+        allocator->sa_nslabs = 0;
+        allocator->sa_inuse = 0;
         _calc_slab_size(allocator);
 
+        allocator->sa_usemags = usemags
+                                && (allocator->sa_slab_nobjs >= SLAB_MAGAZINE_MIN_OBJS);
+        allocator->sa_loaded = NULL;
+        allocator->sa_previous = NULL;
+        list_init(&allocator->sa_depot_full);
+        list_init(&allocator->sa_depot_empty);
+        allocator->sa_ndepot_full = 0;
+        allocator->sa_nallocs = 0;
+        allocator->sa_nmaghits = 0;
+
         /* Add cache to global cache list. */
         allocator->sa_next = slab_allocators;
         slab_allocators = allocator;
@@ -184,6 +244,7 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         dbgq(DBG_MM, "  Object Size:   %d\n", allocator->sa_objsize);
         dbgq(DBG_MM, "  Order:         %d\n", allocator->sa_order);
         dbgq(DBG_MM, "  Slab Capacity: %d\n", allocator->sa_slab_nobjs);
+        dbgq(DBG_MM, "  Magazines:     %s\n", allocator->sa_usemags ? "yes" : "no");
 }
 
 struct slab_allocator *
@@ -194,7 +255,7 @@ slab_allocator_create(const char *name, size_t size) {
         if (!allocator)
                 return NULL;
 
-        _allocator_init(allocator, name, size);
+        _allocator_init(allocator, name, size, 1);
         return allocator;
 }
 
@@ -237,6 +298,8 @@ _slab_allocator_grow(struct slab_allocator *allocator)
         slab->s_free = addr;
         slab->s_addr = addr;
         slab->s_inuse = 0;
+        slab->s_allocator = allocator;
+        page_set_owner(addr, npages, slab);
 
         /* Initialize objects. */
         obj = addr;
@@ -253,25 +316,36 @@ _slab_allocator_grow(struct slab_allocator *allocator)
             1 << allocator->sa_order);
 
         /* Place this slab into the cache. */
-        slab->s_next = allocator->sa_slabs;
-        allocator->sa_slabs = slab;
+        list_insert_head(&allocator->sa_free, &slab->s_link);
+        allocator->sa_nslabs++;
 
         return 1;
 }
 
-void *
-slab_obj_alloc(struct slab_allocator *allocator)
+/*
+ * Take an object out of a slab, preferring partly used slabs to free
+ * ones so that free slabs stay free and can be reclaimed. Returns NULL if
+ * there is no memory for a new slab.
+ */
+static void *
+_slab_obj_take(struct slab_allocator *allocator)
 {
         struct slab *slab;
         void *obj;
 
         /* Find a slab with a free object. */
         for (;;) {
-                slab = allocator->sa_slabs;
-                while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-                        slab = slab->s_next;
-                if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
+                if (!list_empty(&allocator->sa_partial)) {
+                        slab = list_head(&allocator->sa_partial, struct slab, s_link);
                         break;
+                }
+                if (!list_empty(&allocator->sa_free)) {
+                        slab = list_head(&allocator->sa_free, struct slab, s_link);
+                        list_remove(&slab->s_link);
+                        list_insert_head(&allocator->sa_partial, &slab->s_link);
+                        break;
+                }
+                /* this may reclaim, which can change the lists */
                 if (!_slab_allocator_grow(allocator))
                         return NULL;
         }
@@ -284,15 +358,193 @@ slab_obj_alloc(struct slab_allocator *allocator)
         obj = slab->s_free;
         slab->s_free = obj_bufctl(allocator, obj)->sb_next;
         obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-        obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
 
-        slab->s_inuse++;
+        if (++slab->s_inuse == allocator->sa_slab_nobjs) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_full, &slab->s_link);
+        }
+        allocator->sa_inuse++;
 
         dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
             "slab 0x%p, inuse %d\n", obj, allocator->sa_name,
             allocator, allocator, slab->s_inuse);
+        return obj;
+}
+
+/* Give a free object back to its slab */
+static void
+_slab_obj_release(struct slab_allocator *allocator, void *obj)
+{
+        struct slab *slab = obj_bufctl(allocator, obj)->sb_slab;
+
+        if (slab->s_inuse-- == allocator->sa_slab_nobjs) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_partial, &slab->s_link);
+        }
+        if (0 == slab->s_inuse) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_free, &slab->s_link);
+        }
+        allocator->sa_inuse--;
+
+        /* Place this object back on the slab's free list. */
+        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
+        slab->s_free = obj;
+
+        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
+            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+/* Give every object in mag back to its slab */
+static void
+_magazine_empty(struct slab_allocator *allocator, struct slab_magazine *mag)
+{
+        while (0 < mag->m_rounds)
+                _slab_obj_release(allocator, mag->m_objs[--mag->m_rounds]);
+}
+
+/* An empty magazine from the depot or a new one; NULL if out of memory.
+ * Getting a new one may reclaim, which empties the allocator's
+ * magazines. */
+static struct slab_magazine *
+_magazine_get_empty(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if (!list_empty(&allocator->sa_depot_empty)) {
+                mag = list_head(&allocator->sa_depot_empty, struct slab_magazine, m_link);
+                list_remove(&mag->m_link);
+        } else if (NULL != (mag = _slab_obj_take(&slab_magazine_allocator))) {
+                mag->m_rounds = 0;
+        }
+        return mag;
+}
+
+/* Allocate an object from the allocator's magazines, or return NULL */
+static void *
+_magazine_alloc(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if ((NULL == allocator->sa_loaded) || (0 == allocator->sa_loaded->m_rounds)) {
+                if ((NULL != allocator->sa_previous) && (0 < allocator->sa_previous->m_rounds)) {
+                        mag = allocator->sa_loaded;
+                        allocator->sa_loaded = allocator->sa_previous;
+                        allocator->sa_previous = mag;
+                } else if (!list_empty(&allocator->sa_depot_full)) {
+                        mag = list_head(&allocator->sa_depot_full, struct slab_magazine, m_link);
+                        list_remove(&mag->m_link);
+                        allocator->sa_ndepot_full--;
+                        if (0 == mag->m_rounds) {
+                                list_insert_head(&allocator->sa_depot_empty, &mag->m_link);
+                                return NULL;
+                        }
+                        if (NULL != allocator->sa_previous)
+                                list_insert_head(&allocator->sa_depot_empty,
+                                                 &allocator->sa_previous->m_link);
+                        allocator->sa_previous = allocator->sa_loaded;
+                        allocator->sa_loaded = mag;
+                } else {
+                        return NULL;
+                }
+        }
+
+        KASSERT(0 < allocator->sa_loaded->m_rounds);
+        allocator->sa_nmaghits++;
+        return allocator->sa_loaded->m_objs[--allocator->sa_loaded->m_rounds];
+}
+
+/* Free an object into the allocator's magazines; returns 0 if there is no
+ * room for it and no memory for another magazine */
+static int
+_magazine_free(struct slab_allocator *allocator, void *obj)
+{
+        struct slab_magazine *mag;
+
+        for (;;) {
+                if ((NULL != allocator->sa_loaded)
+                    && (allocator->sa_loaded->m_rounds < SLAB_MAGAZINE_SIZE)) {
+                        allocator->sa_loaded->m_objs[allocator->sa_loaded->m_rounds++] = obj;
+                        return 1;
+                }
+                if ((NULL != allocator->sa_previous) && (NULL != allocator->sa_loaded)
+                    && (0 == allocator->sa_previous->m_rounds)) {
+                        mag = allocator->sa_loaded;
+                        allocator->sa_loaded = allocator->sa_previous;
+                        allocator->sa_previous = mag;
+                        continue;
+                }
+
+                if (NULL == (mag = _magazine_get_empty(allocator)))
+                        return 0;
+                /* getting mag may have reclaimed and emptied the loaded
+                 * and previous magazines; look at them again */
+                if ((NULL != allocator->sa_loaded) && (NULL != allocator->sa_previous)
+                    && ((allocator->sa_loaded->m_rounds < SLAB_MAGAZINE_SIZE)
+                        || (allocator->sa_previous->m_rounds < SLAB_MAGAZINE_SIZE))) {
+                        list_insert_head(&allocator->sa_depot_empty, &mag->m_link);
+                        continue;
+                }
+                if (NULL == allocator->sa_loaded) {
+                        allocator->sa_loaded = mag;
+                } else if (NULL == allocator->sa_previous) {
+                        allocator->sa_previous = mag;
+                } else {
+                        /* both full: the previous one goes to the depot */
+                        KASSERT(SLAB_MAGAZINE_SIZE == allocator->sa_previous->m_rounds);
+                        if (SLAB_DEPOT_MAX <= allocator->sa_ndepot_full) {
+                                _magazine_empty(allocator, allocator->sa_previous);
+                                list_insert_head(&allocator->sa_depot_empty,
+                                                 &allocator->sa_previous->m_link);
+                        } else {
+                                list_insert_head(&allocator->sa_depot_full,
+                                                 &allocator->sa_previous->m_link);
+                                allocator->sa_ndepot_full++;
+                        }
+                        allocator->sa_previous = allocator->sa_loaded;
+                        allocator->sa_loaded = mag;
+                }
+        }
+}
+
+/* Give every object held in the allocator's magazines back to the slabs,
+ * and free the magazines in the depot */
+static void
+_magazines_flush(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if (NULL != allocator->sa_loaded)
+                _magazine_empty(allocator, allocator->sa_loaded);
+        if (NULL != allocator->sa_previous)
+                _magazine_empty(allocator, allocator->sa_previous);
+        list_iterate_begin(&allocator->sa_depot_full, mag, struct slab_magazine, m_link) {
+                _magazine_empty(allocator, mag);
+                list_remove(&mag->m_link);
+                _slab_obj_release(&slab_magazine_allocator, mag);
+        } list_iterate_end();
+        allocator->sa_ndepot_full = 0;
+        list_iterate_begin(&allocator->sa_depot_empty, mag, struct slab_magazine, m_link) {
+                list_remove(&mag->m_link);
+                _slab_obj_release(&slab_magazine_allocator, mag);
+        } list_iterate_end();
+}
+
+void *
+slab_obj_alloc(struct slab_allocator *allocator)
+{
+        void *obj = NULL;
+
+        if (allocator->sa_usemags)
+                obj = _magazine_alloc(allocator);
+        if ((NULL == obj) && (NULL == (obj = _slab_obj_take(allocator))))
+                return NULL;
+        allocator->sa_nallocs++;
+
+#ifdef SLAB_CHECK_FREE
+        KASSERT(obj_bufctl(allocator, obj)->sb_free);
+        obj_bufctl(allocator, obj)->sb_free = 0;
+#endif
 
 #ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
@@ -310,7 +562,6 @@ slab_obj_alloc(struct slab_allocator *allocator)
 void
 slab_obj_free(struct slab_allocator *allocator, void *obj)
 {
-        struct slab *slab;
         GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
 #ifdef SLAB_REDZONE
@@ -325,21 +576,16 @@ slab_obj_free(struct slab_allocator *allocator, void *obj)
         obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
-        slab = obj_bufctl(allocator, obj)->sb_slab;
-
-        /* Place this object back on the slab's free list. */
-        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-        slab->s_free = obj;
-
-        slab->s_inuse--;
-
-        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
-            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+        /* An object in a magazine stays allocated as far as its slab is
+         * concerned (and keeps its pointer to the slab). */
+        if (!allocator->sa_usemags || !_magazine_free(allocator, obj))
+                _slab_obj_release(allocator, obj);
 }
 
 /*
  * Reclaims as much memory (up to a target) from
- * unused slabs as possible
+ * unused slabs as possible. Objects held in magazines are given back to
+ * their slabs first, so that slabs they kept in use can be freed.
  * @param target - target number of pages to reclaim. If negative,
  * try to reclaim as many pages as possible
  * @return number of pages freed
@@ -350,89 +596,198 @@ slab_allocators_reclaim(int target)
         int npages_freed = 0, npages;
 
         struct slab_allocator *a;
-        struct slab *s, **prev;
+        struct slab *s;
+
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                if (a->sa_usemags)
+                        _magazines_flush(a);
+        }
 
         /* Go through all caches */
         for (a = slab_allocators; NULL != a; a = a->sa_next) {
-                prev = &(a->sa_slabs);
-                s = a->sa_slabs;
-                while (NULL != s) {
-                        struct slab *next = s->s_next;
-                        if (0 == s->s_inuse) {
-                                /* Free Slab */
-                                (*prev) = next;
-                                npages = 1 << a->sa_order;
-
-                                page_free_n(s->s_addr, npages);
-                                npages_freed += npages;
-                        } else {
-                                prev = &(s->s_next);
-                        }
+                npages = 1 << a->sa_order;
+                while (!list_empty(&a->sa_free)) {
+                        s = list_head(&a->sa_free, struct slab, s_link);
+                        KASSERT(0 == s->s_inuse);
+                        list_remove(&s->s_link);
+                        a->sa_nslabs--;
+
+                        /* Free Slab */
+                        page_free_n(s->s_addr, npages);
+                        npages_freed += npages;
+
                         /* Check if target was met */
                         if ((target > 0) && (npages_freed >= target)) {
                                 return npages_freed;
                         }
-                        s = next;
                 }
         }
         return npages_freed;
 }
 
-#define KMALLOC_SIZE_MIN_ORDER  (6)
-#define KMALLOC_SIZE_MAX_ORDER  (18)
+static int
+_slab_list_count(list_t *list)
+{
+        list_link_t *link;
+        int n = 0;
 
-static struct slab_allocator *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
+        for (link = list->l_next; link != list; link = link->l_next)
+                ++n;
+        return n;
+}
 
-/* Note that kmem_cache_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+/*
+ * Per-allocator statistics: objects in use (not counting those held in
+ * magazines), objects held in magazines, total objects, slabs
+ * (partial/full/free), and bytes of slab memory not holding objects in
+ * use.
  */
-static const char *kmalloc_allocator_names[] = {
-        "size-64",
-        "size-128",
-        "size-256",
-        "size-512",
-        "size-1024",
-        "size-2048",
-        "size-4096",
-        "size-8192",
-        "size-16384",
-        "size-32768",
-        "size-65536",
-        "size-131072",
-        "size-262144"
-};
+size_t
+slab_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct slab_allocator *a;
+        struct slab_magazine *mag;
+        int maged, total, partial, full, free, waste;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%-16s %6s %7s %5s %7s %14s %7s\n", "name", "size",
+                "active", "mag", "total", "slabs p/f/e", "waste");
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                maged = 0;
+                if (NULL != a->sa_loaded)
+                        maged += a->sa_loaded->m_rounds;
+                if (NULL != a->sa_previous)
+                        maged += a->sa_previous->m_rounds;
+                list_iterate_begin(&a->sa_depot_full, mag, struct slab_magazine, m_link) {
+                        maged += mag->m_rounds;
+                } list_iterate_end();
+
+                partial = _slab_list_count(&a->sa_partial);
+                full = _slab_list_count(&a->sa_full);
+                free = _slab_list_count(&a->sa_free);
+                KASSERT(partial + full + free == a->sa_nslabs);
+
+                total = a->sa_nslabs * a->sa_slab_nobjs;
+                waste = a->sa_nslabs * (PAGE_SIZE << a->sa_order)
+                        - (a->sa_inuse - maged) * a->sa_objsize;
+                iprintf(&buf, &size, "%-16s %6d %7d %5d %7d %4d/%4d/%4d %7d\n",
+                        a->sa_name, a->sa_objsize, a->sa_inuse - maged, maged, total,
+                        partial, full, free, waste);
+        }
+
+        return osize - size;
+}
+
+/*
+ * kmalloc size classes: multiples of KMALLOC_SIZE_MIN up to
+ * KMALLOC_SIZE_MIN << 2, and then four classes for each power of two
+ * (a quarter of it apart) up to KMALLOC_SLAB_MAX. So no object is more
+ * than a quarter bigger than the request it serves (past the smallest
+ * classes). Requests bigger than KMALLOC_SLAB_MAX get pages of their own.
+ */
+#define KMALLOC_SIZE_MIN        16
+#define KMALLOC_SLAB_MAX        (32 * 1024)
+#define KMALLOC_NCLASSES        40
+
+/* Largest allocation at all, the largest block page_alloc_n can give */
+#define KMALLOC_LARGE_MAX       (PAGE_SIZE << (PAGE_NSIZES - 1))
+
+/* kfree tells slabs from large allocations by the page owner (see
+ * page_set_owner()): for a slab it is the struct slab, and for a large
+ * allocation it is the number of pages with the low bit set. */
+#define KMALLOC_LARGE_OWNER(npages)     ((void *)(((uintptr_t)(npages) << 1) | 1))
+#define KMALLOC_IS_LARGE(owner)         ((uintptr_t)(owner) & 1)
+#define KMALLOC_LARGE_NPAGES(owner)     ((uint32_t)((uintptr_t)(owner) >> 1))
+
+static struct slab_allocator *kmalloc_allocators[KMALLOC_NCLASSES];
+static char kmalloc_allocator_names[KMALLOC_NCLASSES][16];
+
+/* Bytes asked for and bytes handed out, over all time, for the
+ * internal fragmentation of kmalloc */
+static uint64_t kmalloc_requested;
+static uint64_t kmalloc_granted;
+static uint32_t kmalloc_nlarge;         /* large allocations now */
+static uint32_t kmalloc_large_pages;    /* and their pages */
+
+/* The index of the smallest class holding size bytes, 0 < size <= KMALLOC_SLAB_MAX */
+static int
+_kmalloc_class(size_t size)
+{
+        int order;
+
+        if (size <= KMALLOC_SIZE_MIN << 2)
+                return (size - 1) / KMALLOC_SIZE_MIN;
+
+        /* 2^order < size <= 2^(order + 1) */
+        for (order = 0; (size - 1) >> (order + 1); ++order)
+                ;
+        return 4 + (order - 6) * 4 + ((size - 1 - (1 << order)) >> (order - 2));
+}
+
+static size_t
+_kmalloc_class_size(int cls)
+{
+        int order;
+
+        if (cls < 4)
+                return (cls + 1) * KMALLOC_SIZE_MIN;
+
+        order = 6 + (cls - 4) / 4;
+        return (1 << order) + ((cls - 4) % 4 + 1) * (1 << (order - 2));
+}
+
+static void *
+_kmalloc_large(size_t size)
+{
+        uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+        void *addr;
+
+        if (NULL == (addr = page_alloc_n(npages)))
+                return NULL;
+        /* page_alloc_n hands out a power of two */
+        while (npages & (npages - 1))
+                npages += npages & -npages;
+        page_set_owner(addr, 1, KMALLOC_LARGE_OWNER(npages));
+
+        kmalloc_nlarge++;
+        kmalloc_large_pages += npages;
+        kmalloc_granted += npages << PAGE_SHIFT;
+        return addr;
+}
 
 void *
 kmalloc(size_t size)
 {
-        int order;
-        struct slab_allocator **cs;
+        int cls;
         void *addr;
 
-        size += sizeof(struct slab_allocator *);
+        if (0 == size)
+                size = 1;
+        if (size > KMALLOC_LARGE_MAX) {
+                dbg(DBG_MM, "WARNING: kmalloc of %u bytes is too large\n", size);
+                return NULL;
+        }
 
-        /*
-         * Find the first power of two bucket bigger than the
-         * requested size, and allocate from it.
-         */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if ((size_t)(1 << order) >= size) {
-                        addr = slab_obj_alloc(*cs);
-                        if (!addr) {
-                                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                                return NULL;
-                        }
+        kmalloc_requested += size;
+        if (size > KMALLOC_SLAB_MAX) {
+                addr = _kmalloc_large(size);
+        } else {
+                cls = _kmalloc_class(size);
+                KASSERT(_kmalloc_class_size(cls) >= size);
+                KASSERT(0 == cls || _kmalloc_class_size(cls - 1) < size);
+                if (NULL != (addr = slab_obj_alloc(kmalloc_allocators[cls])))
+                        kmalloc_granted += _kmalloc_class_size(cls);
+        }
+        if (!addr) {
+                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+                return NULL;
+        }
 #ifdef MM_POISON
-                        memset(addr, MM_POISON_ALLOC, size);
+        memset(addr, MM_POISON_ALLOC, size);
 #endif /* MM_POISON */
-                        *((struct slab_allocator **)addr) = *cs;
-                        return (void *)(((struct slab_allocator **)addr) + 1);
-                }
-        }
-
-        panic("size bigger than maxorder %ld\n", (unsigned long) size);
-        return NULL;
+        return addr;
 }
 
 __attribute__((used)) static void *
@@ -447,8 +802,20 @@ malloc(size_t size)
 void
 kfree(void *addr)
 {
-        addr = (void *)(((struct slab_allocator **)addr) - 1);
-        struct slab_allocator *sa = *(struct slab_allocator **)addr;
+        void *owner = page_owner(addr);
+        uint32_t npages;
+
+        KASSERT(NULL != owner && "kfree of memory not from kmalloc");
+        if (KMALLOC_IS_LARGE(owner)) {
+                KASSERT(PAGE_ALIGNED(addr));
+                npages = KMALLOC_LARGE_NPAGES(owner);
+                kmalloc_nlarge--;
+                kmalloc_large_pages -= npages;
+                page_free_n(addr, npages);
+                return;
+        }
+
+        struct slab_allocator *sa = ((struct slab *)owner)->s_allocator;
 
 #ifdef MM_POISON
         /* If poisoning is enabled, wipe the memory given in
@@ -465,6 +832,34 @@ kfree(void *addr)
         slab_obj_free(sa, addr);
 }
 
+size_t
+kmalloc_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+        uint32_t heap = kmalloc_large_pages, pct = 0;
+        uint64_t req = kmalloc_requested, gr = kmalloc_granted;
+        int cls;
+
+        KASSERT(NULL != buf);
+
+        for (cls = 0; cls < KMALLOC_NCLASSES; ++cls)
+                heap += kmalloc_allocators[cls]->sa_nslabs << kmalloc_allocators[cls]->sa_order;
+        /* no 64-bit division in the kernel */
+        while (gr > 0xffffffff / 100) {
+                req >>= 1;
+                gr >>= 1;
+        }
+        if (0 != gr)
+                pct = 100 - (uint32_t)req * 100 / (uint32_t)gr;
+
+        iprintf(&buf, &size, "kmalloc: requested %u KiB, granted %u KiB (%u%% internal fragmentation)\n",
+                (uint32_t)(kmalloc_requested >> 10), (uint32_t)(kmalloc_granted >> 10), pct);
+        iprintf(&buf, &size, "kmalloc: %u pages in slabs and large allocations, %u large allocations in %u pages\n",
+                heap, kmalloc_nlarge, kmalloc_large_pages);
+
+        return osize - size;
+}
+
 __attribute__((used)) static void
 free(void *addr)
 {
@@ -476,20 +871,22 @@ free(void *addr)
 void
 slab_init()
 {
-        int order;
-        struct slab_allocator **cs;
+        int cls;
 
         /* Special case initialization of the kmem_cache_t cache. */
-        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator));
+        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator), 0);
+        _allocator_init(&slab_magazine_allocator, "slab_magazines", sizeof(struct slab_magazine), 0);
 
         /*
-         * Allocate the power of two buckets for generic
-         * kmalloc/kfree.
+         * Allocate the size classes for generic kmalloc/kfree.
          */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if (NULL == (*cs = slab_allocator_create(kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER], (1 << order)))) {
+        for (cls = 0; cls < KMALLOC_NCLASSES; ++cls) {
+                snprintf(kmalloc_allocator_names[cls], sizeof(kmalloc_allocator_names[cls]),
+                         "size-%u", _kmalloc_class_size(cls));
+                if (NULL == (kmalloc_allocators[cls] = slab_allocator_create(kmalloc_allocator_names[cls],
+                                                                             _kmalloc_class_size(cls)))) {
                         panic("Couldn't create kmalloc allocators!\n");
                 }
         }
+        KASSERT(KMALLOC_SLAB_MAX == _kmalloc_class_size(KMALLOC_NCLASSES - 1));
 }
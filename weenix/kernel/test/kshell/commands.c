@@ -11,6 +11,16 @@
 #include "fs/vnode.h"
 #endif
 
+#include "mm/pframe.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/kmalloc.h"
+
+#include "drivers/blockq.h"
+
+#include "vm/pagefault.h"
+#include "vm/shadow.h"
+
 #include "test/kshell/io.h"
 
 #include "util/debug.h"
@@ -60,6 +70,111 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv)
         return 0;
 }
 
+int kshell_pframe(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc == 1) {
+                len = pframe_info(NULL, buf, sizeof(buf));
+                kshell_write_all(ksh, buf, len);
+                return 0;
+        }
+
+#ifdef __VFS__
+        int i;
+        for (i = 1; i < argc; ++i) {
+                int fd;
+                file_t *f;
+
+                if ((fd = do_open(argv[i], O_RDONLY)) < 0) {
+                        kprintf(ksh, "Error opening file: %s\n", argv[i]);
+                        continue;
+                }
+                f = fget(fd);
+                KASSERT(NULL != f);
+                len = pframe_mmobj_info(&f->f_vnode->vn_mmobj, buf, sizeof(buf));
+                fput(f);
+
+                kprintf(ksh, "%s:\n", argv[i]);
+                kshell_write_all(ksh, buf, len);
+
+                if (do_close(fd) < 0) {
+                        panic("kshell: Error closing file: %s\n", argv[i]);
+                }
+        }
+        return 0;
+#else
+        kprintf(ksh, "Usage: pframe\n");
+        return 1;
+#endif
+}
+
+int kshell_blockq(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: blockq\n");
+                return 1;
+        }
+        len = blockq_info(NULL, buf, sizeof(buf));
+        kshell_write_all(ksh, buf, len);
+        return 0;
+}
+
+int kshell_slab(kshell_t *ksh, int argc, char **argv)
+{
+        char *buf;
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: slab\n");
+                return 1;
+        }
+        /* one line per allocator does not fit in KSH_BUF_SIZE */
+        if (NULL == (buf = page_alloc())) {
+                kprintf(ksh, "slab: out of memory\n");
+                return 1;
+        }
+        len = slab_info(NULL, buf, PAGE_SIZE);
+        kshell_write_all(ksh, buf, len);
+        len = kmalloc_info(NULL, buf, PAGE_SIZE);
+        kshell_write_all(ksh, buf, len);
+        page_free(buf);
+        return 0;
+}
+
+int kshell_page(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: page\n");
+                return 1;
+        }
+        len = page_info(NULL, buf, sizeof(buf));
+        kshell_write_all(ksh, buf, len);
+        return 0;
+}
+
+int kshell_fault(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: fault\n");
+                return 1;
+        }
+        len = pagefault_info(NULL, buf, sizeof(buf));
+        len += shadow_info(NULL, buf + len, sizeof(buf) - len);
+        kshell_write_all(ksh, buf, len);
+        return 0;
+}
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv)
 {
@@ -320,4 +435,32 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv)
 
         return exit_val;
 }
+
+int kshell_vnode(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: vnode\n");
+                return 1;
+        }
+        len = vnode_info(NULL, buf, sizeof(buf));
+        kshell_write_all(ksh, buf, len);
+        return 0;
+}
+
+int kshell_dcache(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[KSH_BUF_SIZE];
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: dcache\n");
+                return 1;
+        }
+        len = dcache_info(NULL, buf, sizeof(buf));
+        kshell_write_all(ksh, buf, len);
+        return 0;
+}
 #endif
@@ -8,6 +8,11 @@
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(pframe);
+KSHELL_CMD(blockq);
+KSHELL_CMD(slab);
+KSHELL_CMD(page);
+KSHELL_CMD(fault);
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -17,4 +22,6 @@ KSHELL_CMD(link);
 KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
+KSHELL_CMD(vnode);
+KSHELL_CMD(dcache);
 #endif
@@ -34,6 +34,16 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("help", kshell_help,
                            "prints a list of available commands");
         kshell_add_command("echo", kshell_echo, "display a line of text");
+        kshell_add_command("pframe", kshell_pframe,
+                           "display page cache statistics [for files]");
+        kshell_add_command("blockq", kshell_blockq,
+                           "display block request queue statistics");
+        kshell_add_command("slab", kshell_slab,
+                           "display slab allocator statistics");
+        kshell_add_command("page", kshell_page,
+                           "display page allocator statistics");
+        kshell_add_command("fault", kshell_fault,
+                           "display page fault statistics");
 #ifdef __VFS__
         kshell_add_command("cat", kshell_cat,
                            "concatenate files and print on the standard output");
@@ -46,6 +56,10 @@ static __attribute__((unused)) void kshell_init()
                            "remove empty directories");
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
+        kshell_add_command("vnode", kshell_vnode,
+                           "display vnode table statistics");
+        kshell_add_command("dcache", kshell_dcache,
+                           "display name lookup cache statistics");
 #endif
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
@@ -0,0 +1,289 @@
+#include "types.h"
+#include "kernel.h"
+#include "errno.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+
+static slab_allocator_t *radix_node_allocator = NULL;
+
+/* Largest index a tree of the given height can hold */
+#define radix_maxindex(height) \
+        (((height) >= RADIX_MAXHEIGHT) ? 0xffffffff \
+         : ((uint32_t)1 << ((height) * RADIX_SHIFT)) - 1)
+
+/* Slot in a node at the given height (leaves are height 1) for index */
+#define radix_slot(index, height) \
+        (((index) >> (((height) - 1) * RADIX_SHIFT)) & RADIX_MASK)
+
+void
+radix_init(void)
+{
+        radix_node_allocator = slab_allocator_create("radix_node",
+                               sizeof(radix_node_t));
+        KASSERT(NULL != radix_node_allocator);
+}
+
+void
+radix_tree_init(radix_tree_t *t)
+{
+        t->rt_height = 0;
+        t->rt_root = NULL;
+}
+
+static radix_node_t *
+radix_node_alloc(void)
+{
+        radix_node_t *node;
+
+        if (NULL == (node = slab_obj_alloc(radix_node_allocator)))
+                return NULL;
+        memset(node, 0, sizeof(*node));
+        return node;
+}
+
+int
+radix_insert(radix_tree_t *t, uint32_t index, void *item)
+{
+        radix_node_t *node;
+        uint32_t h, slot;
+        int tag;
+
+        KASSERT(NULL != item);
+
+        if (NULL == t->rt_root) {
+                if (NULL == (t->rt_root = radix_node_alloc()))
+                        return -ENOMEM;
+                t->rt_height = 1;
+        }
+
+        /* Add levels on top until the root covers index. The old root
+         * becomes slot 0 of the new one and passes its tags up; an empty
+         * root can simply be reused at the new height. */
+        while (index > radix_maxindex(t->rt_height)) {
+                if (0 == t->rt_root->rn_count) {
+                        t->rt_height++;
+                        continue;
+                }
+                if (NULL == (node = radix_node_alloc()))
+                        return -ENOMEM;
+                node->rn_slots[0] = t->rt_root;
+                node->rn_count = 1;
+                for (tag = 0; tag < RADIX_NTAGS; ++tag) {
+                        if (t->rt_root->rn_tags[tag])
+                                node->rn_tags[tag] = 1;
+                }
+                t->rt_root = node;
+                t->rt_height++;
+        }
+
+        /* Walk down, creating interior nodes as needed. If we run out of
+         * memory part way, the nodes made so far stay in the tree (empty)
+         * and are reused by the next insert in that range. */
+        node = t->rt_root;
+        for (h = t->rt_height; h > 1; --h) {
+                slot = radix_slot(index, h);
+                if (NULL == node->rn_slots[slot]) {
+                        if (NULL == (node->rn_slots[slot] = radix_node_alloc()))
+                                return -ENOMEM;
+                        node->rn_count++;
+                }
+                node = node->rn_slots[slot];
+        }
+
+        slot = radix_slot(index, 1);
+        KASSERT(NULL == node->rn_slots[slot] && "index already in use");
+        node->rn_slots[slot] = item;
+        node->rn_count++;
+        return 0;
+}
+
+/*
+ * Walks down to the leaf node for index, recording the node visited at
+ * each height in path[height]. Returns the leaf, or NULL if the path to
+ * index does not exist.
+ */
+static radix_node_t *
+radix_walk(radix_tree_t *t, uint32_t index, radix_node_t **path)
+{
+        radix_node_t *node = t->rt_root;
+        uint32_t h;
+
+        if ((NULL == node) || (index > radix_maxindex(t->rt_height)))
+                return NULL;
+
+        for (h = t->rt_height; h > 1; --h) {
+                if (NULL != path)
+                        path[h] = node;
+                if (NULL == (node = node->rn_slots[radix_slot(index, h)]))
+                        return NULL;
+        }
+        if (NULL != path)
+                path[1] = node;
+        return node;
+}
+
+void *
+radix_lookup(radix_tree_t *t, uint32_t index)
+{
+        radix_node_t *leaf;
+
+        if (NULL == (leaf = radix_walk(t, index, NULL)))
+                return NULL;
+        return leaf->rn_slots[radix_slot(index, 1)];
+}
+
+void *
+radix_remove(radix_tree_t *t, uint32_t index)
+{
+        radix_node_t *path[RADIX_MAXHEIGHT + 1];
+        radix_node_t *node;
+        void *item;
+        uint32_t h, slot;
+        int tag;
+
+        if (NULL == (node = radix_walk(t, index, path)))
+                return NULL;
+        slot = radix_slot(index, 1);
+        if (NULL == (item = node->rn_slots[slot]))
+                return NULL;
+
+        node->rn_slots[slot] = NULL;
+        node->rn_count--;
+        for (tag = 0; tag < RADIX_NTAGS; ++tag)
+                node->rn_tags[tag] &= ~(1U << slot);
+
+        /* Free nodes that became empty and drop tags that no longer
+         * have anything tagged below them. */
+        for (h = 1; h < t->rt_height; ++h) {
+                radix_node_t *parent = path[h + 1];
+                node = path[h];
+                slot = radix_slot(index, h + 1);
+                if (0 == node->rn_count) {
+                        slab_obj_free(radix_node_allocator, node);
+                        parent->rn_slots[slot] = NULL;
+                        parent->rn_count--;
+                        for (tag = 0; tag < RADIX_NTAGS; ++tag)
+                                parent->rn_tags[tag] &= ~(1U << slot);
+                } else {
+                        for (tag = 0; tag < RADIX_NTAGS; ++tag) {
+                                if (0 == node->rn_tags[tag])
+                                        parent->rn_tags[tag] &= ~(1U << slot);
+                        }
+                }
+        }
+
+        if (0 == t->rt_root->rn_count) {
+                slab_obj_free(radix_node_allocator, t->rt_root);
+                radix_tree_init(t);
+        }
+
+        return item;
+}
+
+void
+radix_tag_set(radix_tree_t *t, uint32_t index, int tag)
+{
+        radix_node_t *node = t->rt_root;
+        uint32_t h, slot;
+
+        KASSERT((0 <= tag) && (tag < RADIX_NTAGS));
+        KASSERT(NULL != radix_lookup(t, index));
+
+        for (h = t->rt_height; h > 0; --h) {
+                slot = radix_slot(index, h);
+                node->rn_tags[tag] |= 1U << slot;
+                node = node->rn_slots[slot];
+        }
+}
+
+void
+radix_tag_clear(radix_tree_t *t, uint32_t index, int tag)
+{
+        radix_node_t *path[RADIX_MAXHEIGHT + 1];
+        uint32_t h;
+
+        KASSERT((0 <= tag) && (tag < RADIX_NTAGS));
+
+        if (NULL == radix_walk(t, index, path))
+                return;
+
+        /* clear upwards until we reach a node that still has some other
+         * tagged slot */
+        for (h = 1; h <= t->rt_height; ++h) {
+                path[h]->rn_tags[tag] &= ~(1U << radix_slot(index, h));
+                if (0 != path[h]->rn_tags[tag])
+                        break;
+        }
+}
+
+int
+radix_tag_get(radix_tree_t *t, uint32_t index, int tag)
+{
+        radix_node_t *leaf;
+
+        KASSERT((0 <= tag) && (tag < RADIX_NTAGS));
+
+        if (NULL == (leaf = radix_walk(t, index, NULL)))
+                return 0;
+        return !!(leaf->rn_tags[tag] & (1U << radix_slot(index, 1)));
+}
+
+int
+radix_tagged(radix_tree_t *t, int tag)
+{
+        KASSERT((0 <= tag) && (tag < RADIX_NTAGS));
+
+        return (NULL != t->rt_root) && (0 != t->rt_root->rn_tags[tag]);
+}
+
+/*
+ * Collects up to max items at or after first from the subtree rooted at
+ * node, whose first index is base. If tag is negative every item is
+ * collected, otherwise only those with that tag.
+ */
+static uint32_t
+radix_gang_node(radix_node_t *node, uint32_t height, uint32_t base,
+                uint32_t first, void **items, uint32_t max, int tag)
+{
+        uint32_t shift = (height - 1) * RADIX_SHIFT;
+        uint32_t slot, n = 0;
+
+        slot = (first > base) ? ((first - base) >> shift) : 0;
+        for (; (slot < RADIX_SLOTS) && (n < max); ++slot) {
+                if (NULL == node->rn_slots[slot])
+                        continue;
+                if ((0 <= tag) && !(node->rn_tags[tag] & (1U << slot)))
+                        continue;
+                if (1 == height) {
+                        items[n++] = node->rn_slots[slot];
+                } else {
+                        n += radix_gang_node(node->rn_slots[slot], height - 1,
+                                             base + (slot << shift), first,
+                                             items + n, max - n, tag);
+                }
+        }
+        return n;
+}
+
+uint32_t
+radix_gang_lookup(radix_tree_t *t, void **items, uint32_t first, uint32_t max)
+{
+        if ((NULL == t->rt_root) || (first > radix_maxindex(t->rt_height)))
+                return 0;
+        return radix_gang_node(t->rt_root, t->rt_height, 0, first, items, max, -1);
+}
+
+uint32_t
+radix_gang_lookup_tag(radix_tree_t *t, void **items, uint32_t first,
+                      uint32_t max, int tag)
+{
+        KASSERT((0 <= tag) && (tag < RADIX_NTAGS));
+
+        if ((NULL == t->rt_root) || (first > radix_maxindex(t->rt_height)))
+                return 0;
+        return radix_gang_node(t->rt_root, t->rt_height, 0, first, items, max, tag);
+}
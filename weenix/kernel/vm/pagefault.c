@@ -3,7 +3,10 @@
 #include "kernel.h"
 #include "errno.h"
 
+#include "config.h"
+
 #include "util/debug.h"
+#include "util/printf.h"
 
 #include "proc/proc.h"
 
@@ -13,34 +16,68 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
 
+static uint32_t pf_nfaults;     /* faults handled */
+static uint32_t pf_naround;     /* pages mapped around a fault */
+
+/*
+ * Map whatever is already resident in the FAULT_AROUND_PAGES-aligned
+ * window around a fault, so a process going through a file or its text
+ * sequentially takes one fault per window rather than one per page.
+ * Only pages resident in the area's own mmobj are mapped: for a private
+ * mapping a page further down the shadow chain may be hidden by a copy
+ * that is not resident, so it is left to the fault path. The pages are
+ * mapped read-only whatever the area allows, so a write still faults
+ * and dirties (or copies) the page. Nothing here blocks or allocates
+ * pages other than page tables, and failing to map is harmless.
+ */
+static void
+pagefault_around(vmarea_t *vma, uint32_t vfn)
+{
+        uintptr_t paddrs[FAULT_AROUND_PAGES];
+        uint32_t start, end, i, n = 0;
+        pframe_t *pf;
+        int ret;
+
+        start = MAX(vfn & ~(FAULT_AROUND_PAGES - 1), vma->vma_start);
+        end = MIN((vfn & ~(FAULT_AROUND_PAGES - 1)) + FAULT_AROUND_PAGES, vma->vma_end);
+
+        for (i = start; i < end; ++i) {
+                paddrs[i - start] = 0;
+                if (i == vfn)
+                        continue;
+                pf = pframe_get_resident(vma->vma_obj, i - vma->vma_start + vma->vma_off);
+                if ((NULL == pf) || pframe_is_busy(pf))
+                        continue;
+                paddrs[i - start] = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+                ++n;
+        }
+        if (0 == n)
+                return;
+
+        ret = pt_map_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(start), paddrs, end - start,
+                           PD_PRESENT | PD_WRITE | PD_USER, PT_PRESENT | PT_USER);
+        if (0 < ret)
+                pf_naround += ret;
+}
+
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
  * calling function has already done a lot of error checking for
  * us. In particular it has checked that we are not page faulting
- * while in kernel mode. Make sure you understand why an
- * unexpected page fault in kernel mode is bad in Weenix. You
- * should probably read the _pt_fault_handler function to get a
- * sense of what it is doing.
- *
- * Before you can do anything you need to find the vmarea that
- * contains the address that was faulted on. Make sure to check
- * the permissions on the area to see if the process has
- * permission to do [cause]. If either of these checks does not
- * pass kill the offending process, setting its exit status to
- * EFAULT (normally we would send the SIGSEGV signal, however
- * Weenix does not support signals).
- *
- * Now it is time to find the correct page (don't forget
- * about shadow objects, especially copy-on-write magic!). Make
- * sure that if the user writes to the page it will be handled
- * correctly.
+ * while in kernel mode.
  *
- * Finally call pt_map to have the new mapping placed into the
- * appropriate page table.
+ * The vmarea containing the address must exist and allow the access,
+ * otherwise the process is killed with EFAULT (normally we would send
+ * the SIGSEGV signal, however Weenix does not support signals). The
+ * page is looked up through the area's mmobj (which takes care of
+ * shadow objects and copy-on-write), dirtied if this is a write, and
+ * mapped writable only then, so that the first write to a page always
+ * faults. Resident neighbours are mapped too, see pagefault_around().
  *
  * @param vaddr the address that was accessed to cause the fault
  *
@@ -51,5 +88,63 @@
 void
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
-        NOT_YET_IMPLEMENTED("VM: handle_pagefault");
+        uint32_t vfn = ADDR_TO_PN(vaddr);
+        int forwrite = (cause & FAULT_WRITE) ? 1 : 0;
+        vmarea_t *vma;
+        pframe_t *pf;
+        int ret;
+
+        pf_nfaults++;
+
+        if (NULL == (vma = vmmap_lookup(curproc->p_vmmap, vfn))) {
+                dbg(DBG_VM, "no mapping for 0x%08x\n", vaddr);
+                do_exit(EFAULT);
+        }
+        if ((forwrite && !(vma->vma_prot & PROT_WRITE))
+            || ((cause & FAULT_EXEC) && !(vma->vma_prot & PROT_EXEC))
+            || (!forwrite && !(cause & FAULT_EXEC) && !(vma->vma_prot & PROT_READ))) {
+                dbg(DBG_VM, "access 0x%x to 0x%08x not allowed\n", cause, vaddr);
+                do_exit(EFAULT);
+        }
+
+        if (0 > (ret = pframe_lookup(vma->vma_obj, vfn - vma->vma_start + vma->vma_off,
+                                     forwrite, &pf))) {
+                dbg(DBG_VM, "could not get page for 0x%08x: %d\n", vaddr, ret);
+                do_exit(EFAULT);
+        }
+        KASSERT(NULL != pf);
+
+        if (forwrite) {
+                pframe_pin(pf);
+                ret = pframe_dirty(pf);
+                pframe_unpin(pf);
+                if (0 > ret) {
+                        dbg(DBG_VM, "could not dirty page for 0x%08x: %d\n", vaddr, ret);
+                        do_exit(EFAULT);
+                }
+        }
+
+        if (0 > pt_map(curproc->p_pagedir, (uintptr_t)PAGE_ALIGN_DOWN(vaddr),
+                       pt_virt_to_phys((uintptr_t)pf->pf_addr),
+                       PD_PRESENT | PD_WRITE | PD_USER,
+                       PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0))) {
+                do_exit(ENOMEM);
+        }
+        tlb_flush((uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+
+        /* the neighbours were not in the TLB, there is nothing to flush */
+        pagefault_around(vma, vfn);
+}
+
+size_t
+pagefault_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "page faults: %u\n", pf_nfaults);
+        iprintf(&buf, &size, "pages mapped around faults: %u\n", pf_naround);
+
+        return osize - size;
 }
@@ -3,6 +3,7 @@
 
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/printf.h"
 
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
@@ -11,6 +12,8 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "proc/sched.h"
+
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
@@ -26,6 +29,16 @@ int shadow_count = 0; /* for debugging/verification purposes */
 static int shadow_singleton_count = 0;
 #endif
 
+/*
+ * Bumped whenever pages move into a shadow object that is not at the top
+ * of its chain (which only happens when a chain is collapsed), so that
+ * every cached mmo_emptybelow goes stale at once.
+ */
+uint32_t shadow_generation = 1;
+
+static uint32_t shadow_ncollapsed = 0;  /* objects merged into their parent */
+static uint32_t shadow_nshortcuts = 0;  /* walks that went straight to the bottom */
+
 static slab_allocator_t *shadow_allocator;
 
 static void shadow_ref(mmobj_t *o);
@@ -52,7 +65,8 @@ static mmobj_ops_t shadow_mmobj_ops = {
 void
 shadow_init()
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_init");
+        shadow_allocator = slab_allocator_create("shadow", sizeof(mmobj_t));
+        KASSERT(NULL != shadow_allocator);
 }
 
 /*
@@ -64,8 +78,95 @@ shadow_init()
 mmobj_t *
 shadow_create()
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_create");
-        return NULL;
+        mmobj_t *o;
+
+        if (NULL == (o = slab_obj_alloc(shadow_allocator)))
+                return NULL;
+        mmobj_init(o, &shadow_mmobj_ops);
+        o->mmo_refcount = 1;
+        shadow_count++;
+        return o;
+}
+
+/*
+ * If the object o shadows is itself a shadow object with no parent
+ * other than o, nothing can reach it except through o. Move its pages up
+ * into o (where o already has a newer copy the old one is dropped) and
+ * take it out of the chain. Repeats until o shadows an object that is
+ * still shared, or the bottom object. This does the same work as
+ * shadowd, but only for the chain a fault is already walking.
+ *
+ * o must not have a busy page, since pframe_migrate() would mistake it
+ * for a newer copy of the page being moved.
+ */
+static void
+shadow_collapse(mmobj_t *o)
+{
+        mmobj_t *s;
+        pframe_t *pf;
+
+        while (NULL != (s = o->mmo_shadowed) && NULL != s->mmo_shadowed
+               && 1 == s->mmo_refcount - s->mmo_nrespages) {
+                list_iterate_begin(&s->mmo_respages, pf, pframe_t, pf_olink) {
+                        /* See shadowd; pages of an intermediate object are
+                         * never left busy */
+                        KASSERT(!pframe_is_busy(pf));
+                        /* s has refcount 1+nrespages, so this won't free it yet */
+                        pframe_migrate(pf, o);
+                } list_iterate_end();
+                o->mmo_shadowed = s->mmo_shadowed;
+                o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
+                KASSERT(1 == s->mmo_refcount && 0 == s->mmo_nrespages);
+                s->mmo_ops->put(s);
+
+                shadow_generation++;
+                shadow_ncollapsed++;
+        }
+}
+
+/*
+ * Find the page frame that reads of pagenum through o should see, looking
+ * only at the objects strictly below o: the copy in the first shadow
+ * object that has one resident, otherwise the bottom object's. Singleton
+ * objects met on the way are collapsed into the object above them.
+ *
+ * When no shadow object below o has any resident page at all, o
+ * remembers that in mmo_emptybelow, and later walks from o go straight
+ * to the bottom object until shadow_generation moves on. Intermediate
+ * objects never gain pages except by collapsing, so the answer only
+ * changes when the generation does.
+ */
+static int
+shadow_find_below(mmobj_t *o, uint32_t pagenum, pframe_t **pf)
+{
+        mmobj_t *s;
+        int empty;
+
+again:
+        if (o->mmo_emptybelow == shadow_generation) {
+                shadow_nshortcuts++;
+                return pframe_lookup(o->mmo_un.mmo_bottom_obj, pagenum, 0, pf);
+        }
+
+        empty = 1;
+        for (s = o->mmo_shadowed; NULL != s->mmo_shadowed; s = s->mmo_shadowed) {
+                shadow_collapse(s);
+                if (NULL != (*pf = pframe_get_resident(s, pagenum))) {
+                        if (pframe_is_busy(*pf)) {
+                                sched_sleep_on(&(*pf)->pf_waitq);
+                                goto again;
+                        }
+                        return 0;
+                }
+                if (0 != s->mmo_nrespages)
+                        empty = 0;
+                if (s->mmo_emptybelow == shadow_generation)
+                        break;
+        }
+        if (empty)
+                o->mmo_emptybelow = shadow_generation;
+
+        return pframe_lookup(o->mmo_un.mmo_bottom_obj, pagenum, 0, pf);
 }
 
 /* Implementation of mmobj entry points: */
@@ -76,7 +177,8 @@ shadow_create()
 static void
 shadow_ref(mmobj_t *o)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_ref");
+        KASSERT(o && (0 < o->mmo_refcount) && (&shadow_mmobj_ops == o->mmo_ops));
+        o->mmo_refcount++;
 }
 
 /*
@@ -90,7 +192,28 @@ shadow_ref(mmobj_t *o)
 static void
 shadow_put(mmobj_t *o)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_put");
+        pframe_t *pf;
+
+        KASSERT(o && (0 < o->mmo_refcount) && (&shadow_mmobj_ops == o->mmo_ops));
+
+        if (o->mmo_refcount - 1 == o->mmo_nrespages) {
+                /* each page we free drops its own reference with a put,
+                 * which will not come back here */
+                list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                        while (pframe_is_busy(pf))
+                                sched_sleep_on(&pf->pf_waitq);
+                        while (pframe_is_pinned(pf))
+                                pframe_unpin(pf);
+                        pframe_free(pf);
+                } list_iterate_end();
+        }
+
+        if (0 == --o->mmo_refcount) {
+                KASSERT(0 == o->mmo_nrespages);
+                o->mmo_shadowed->mmo_ops->put(o->mmo_shadowed);
+                slab_obj_free(shadow_allocator, o);
+                shadow_count--;
+        }
 }
 
 /* This function looks up the given page in this shadow object. The
@@ -103,8 +226,25 @@ shadow_put(mmobj_t *o)
 static int
 shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_lookuppage");
-        return 0;
+        int ret;
+
+        if (forwrite) {
+                if (0 > (ret = pframe_get(o, pagenum, pf)))
+                        return ret;
+                /* our private copy can never be paged out; shadow_put
+                 * unpins it when the object goes away */
+                if (!pframe_is_pinned(*pf))
+                        pframe_pin(*pf);
+                return 0;
+        }
+
+        while (NULL != (*pf = pframe_get_resident(o, pagenum))) {
+                if (!pframe_is_busy(*pf))
+                        return 0;
+                sched_sleep_on(&(*pf)->pf_waitq);
+        }
+        shadow_collapse(o);
+        return shadow_find_below(o, pagenum, pf);
 }
 
 /* As per the specification in mmobj.h, fill the page frame starting
@@ -118,7 +258,15 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 static int
 shadow_fillpage(mmobj_t *o, pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_fillpage");
+        pframe_t *src;
+        int ret;
+
+        KASSERT(pframe_is_busy(pf));
+
+        /* pf is busy in o, so only the objects below o may be collapsed */
+        if (0 > (ret = shadow_find_below(o, pf->pf_pagenum, &src)))
+                return ret;
+        memcpy(pf->pf_addr, src->pf_addr, PAGE_SIZE);
         return 0;
 }
 
@@ -127,13 +275,28 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
 static int
 shadow_dirtypage(mmobj_t *o, pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_dirtypage");
-        return -1;
+        /* the page is private to o; there is nothing to set up */
+        return 0;
 }
 
 static int
 shadow_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("VM: shadow_cleanpage");
-        return -1;
+        /* anonymous copies have no backing store; they only ever go
+         * away with the object (or when a newer copy replaces them) */
+        return 0;
+}
+
+size_t
+shadow_info(const void *data, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "shadow objects: %d\n", shadow_count);
+        iprintf(&buf, &size, "shadow objects collapsed on fault: %u\n", shadow_ncollapsed);
+        iprintf(&buf, &size, "shadow walks straight to the bottom: %u\n", shadow_nshortcuts);
+
+        return osize - size;
 }
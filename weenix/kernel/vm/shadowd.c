@@ -4,6 +4,8 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
+#include "vm/shadow.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 
@@ -89,6 +91,9 @@ shadowd(int arg1, void *arg2)
                                                         o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
                                                         KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
                                                         o->mmo_ops->put(o);
+                                                        /* last may not be a top object, so
+                                                         * the shadow walk shortcuts are stale */
+                                                        shadow_generation++;
                                                 } else {
                                                         KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
                                                         o->mmo_ops->ref(o);
@@ -42,6 +42,13 @@ vmarea_alloc(void)
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                list_link_init(&newvma->vma_plink);
+                list_link_init(&newvma->vma_olink);
+                newvma->vma_left = NULL;
+                newvma->vma_right = NULL;
+                newvma->vma_height = 1;
+                newvma->vma_gap = 0;
+                newvma->vma_maxgap = 0;
         }
         return newvma;
 }
@@ -53,13 +60,185 @@ vmarea_free(vmarea_t *vma)
         slab_obj_free(vmarea_allocator, vma);
 }
 
+/*
+ * Besides vmm_list, the areas of a vmmap are kept in an AVL tree ordered
+ * by vma_start, so an area can be found in O(log n). Each area also knows
+ * the gap below it (down to the end of the previous area, or to
+ * USER_MEM_LOW), and the largest such gap in its subtree, which lets
+ * vmmap_find_range() go straight to the first gap that is big enough in
+ * either direction. The gap above the last area is worked out from the
+ * tail of vmm_list.
+ *
+ * Anything that changes vma_start or vma_end of an area in a map must
+ * vmmap_unlink() it first and vmmap_insert() it again after.
+ */
+
+#define VMMAP_LOW       ADDR_TO_PN(USER_MEM_LOW)
+#define VMMAP_HIGH      ADDR_TO_PN(USER_MEM_HIGH)
+
+#define _vma_height(vma)        ((NULL == (vma)) ? 0 : (vma)->vma_height)
+#define _vma_maxgap(vma)        ((NULL == (vma)) ? 0 : (vma)->vma_maxgap)
+
+static void
+_vma_update(vmarea_t *vma)
+{
+        vma->vma_height = 1 + MAX(_vma_height(vma->vma_left), _vma_height(vma->vma_right));
+        vma->vma_maxgap = MAX(vma->vma_gap, MAX(_vma_maxgap(vma->vma_left),
+                                                _vma_maxgap(vma->vma_right)));
+}
+
+static vmarea_t *
+_vma_rotate_right(vmarea_t *vma)
+{
+        vmarea_t *l = vma->vma_left;
+
+        vma->vma_left = l->vma_right;
+        l->vma_right = vma;
+        _vma_update(vma);
+        _vma_update(l);
+        return l;
+}
+
+static vmarea_t *
+_vma_rotate_left(vmarea_t *vma)
+{
+        vmarea_t *r = vma->vma_right;
+
+        vma->vma_right = r->vma_left;
+        r->vma_left = vma;
+        _vma_update(vma);
+        _vma_update(r);
+        return r;
+}
+
+/* Recomputes vma and rotates it if its subtrees differ in height by two;
+ * returns the new root of the subtree */
+static vmarea_t *
+_vma_balance(vmarea_t *vma)
+{
+        int bal;
+
+        _vma_update(vma);
+        bal = _vma_height(vma->vma_left) - _vma_height(vma->vma_right);
+        if (bal > 1) {
+                if (_vma_height(vma->vma_left->vma_left) < _vma_height(vma->vma_left->vma_right))
+                        vma->vma_left = _vma_rotate_left(vma->vma_left);
+                return _vma_rotate_right(vma);
+        }
+        if (bal < -1) {
+                if (_vma_height(vma->vma_right->vma_right) < _vma_height(vma->vma_right->vma_left))
+                        vma->vma_right = _vma_rotate_right(vma->vma_right);
+                return _vma_rotate_left(vma);
+        }
+        return vma;
+}
+
+static vmarea_t *
+_vma_tree_insert(vmarea_t *root, vmarea_t *vma)
+{
+        if (NULL == root) {
+                vma->vma_left = vma->vma_right = NULL;
+                _vma_update(vma);
+                return vma;
+        }
+        if (vma->vma_start < root->vma_start)
+                root->vma_left = _vma_tree_insert(root->vma_left, vma);
+        else
+                root->vma_right = _vma_tree_insert(root->vma_right, vma);
+        return _vma_balance(root);
+}
+
+static vmarea_t *
+_vma_tree_remove_min(vmarea_t *root, vmarea_t **min)
+{
+        if (NULL == root->vma_left) {
+                *min = root;
+                return root->vma_right;
+        }
+        root->vma_left = _vma_tree_remove_min(root->vma_left, min);
+        return _vma_balance(root);
+}
+
+static vmarea_t *
+_vma_tree_remove(vmarea_t *root, vmarea_t *vma)
+{
+        vmarea_t *min, *right;
+
+        KASSERT(NULL != root);
+        if (vma->vma_start < root->vma_start) {
+                root->vma_left = _vma_tree_remove(root->vma_left, vma);
+        } else if (vma->vma_start > root->vma_start) {
+                root->vma_right = _vma_tree_remove(root->vma_right, vma);
+        } else {
+                KASSERT(root == vma);
+                if (NULL == vma->vma_right)
+                        return vma->vma_left;
+                right = _vma_tree_remove_min(vma->vma_right, &min);
+                min->vma_left = vma->vma_left;
+                min->vma_right = right;
+                root = min;
+        }
+        return _vma_balance(root);
+}
+
+/* Recomputes the areas on the path down to vma, after its vma_gap changed */
+static void
+_vma_tree_refresh(vmarea_t *root, vmarea_t *vma)
+{
+        if (vma->vma_start < root->vma_start)
+                _vma_tree_refresh(root->vma_left, vma);
+        else if (vma->vma_start > root->vma_start)
+                _vma_tree_refresh(root->vma_right, vma);
+        _vma_update(root);
+}
+
+/* The area with the highest vma_start below vfn, or NULL */
+static vmarea_t *
+_vma_below(vmmap_t *map, uint32_t vfn)
+{
+        vmarea_t *vma = map->vmm_root, *below = NULL;
+
+        while (NULL != vma) {
+                if (vma->vma_start < vfn) {
+                        below = vma;
+                        vma = vma->vma_right;
+                } else {
+                        vma = vma->vma_left;
+                }
+        }
+        return below;
+}
+
+static vmarea_t *
+_vma_next(vmmap_t *map, vmarea_t *vma)
+{
+        if (vma->vma_plink.l_next == &map->vmm_list)
+                return NULL;
+        return list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+}
+
+static uint32_t
+_vma_end_before(vmmap_t *map, vmarea_t *vma)
+{
+        if (vma->vma_plink.l_prev == &map->vmm_list)
+                return VMMAP_LOW;
+        return (list_item(vma->vma_plink.l_prev, vmarea_t, vma_plink))->vma_end;
+}
+
 /* Create a new vmmap, which has no vmareas and does
  * not refer to a process. */
 vmmap_t *
 vmmap_create(void)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_create");
-        return NULL;
+        vmmap_t *map;
+
+        if (NULL == (map = (vmmap_t *) slab_obj_alloc(vmmap_allocator)))
+                return NULL;
+        list_init(&map->vmm_list);
+        map->vmm_root = NULL;
+        map->vmm_cache = NULL;
+        map->vmm_proc = NULL;
+        return map;
 }
 
 /* Removes all vmareas from the address space and frees the
@@ -67,7 +246,21 @@ vmmap_create(void)
 void
 vmmap_destroy(vmmap_t *map)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_destroy");
+        vmarea_t *vma;
+
+        KASSERT(NULL != map);
+
+        list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+                vmmap_unlink(map, vma);
+                if (list_link_is_linked(&vma->vma_olink))
+                        list_remove(&vma->vma_olink);
+                if (NULL != vma->vma_obj)
+                        vma->vma_obj->mmo_ops->put(vma->vma_obj);
+                vmarea_free(vma);
+        } list_iterate_end();
+
+        KASSERT(NULL == map->vmm_root);
+        slab_obj_free(vmmap_allocator, map);
 }
 
 /* Add a vmarea to an address space. Assumes (i.e. asserts to some extent)
@@ -77,7 +270,49 @@ vmmap_destroy(vmmap_t *map)
 void
 vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_insert");
+        vmarea_t *below, *next;
+
+        KASSERT(NULL != map && NULL != newvma);
+        KASSERT(newvma->vma_start < newvma->vma_end);
+        KASSERT(VMMAP_LOW <= newvma->vma_start && newvma->vma_end <= VMMAP_HIGH);
+        KASSERT(vmmap_is_range_empty(map, newvma->vma_start,
+                                     newvma->vma_end - newvma->vma_start));
+
+        newvma->vma_vmmap = map;
+        if (NULL == (below = _vma_below(map, newvma->vma_start)))
+                list_insert_head(&map->vmm_list, &newvma->vma_plink);
+        else
+                list_insert_before(below->vma_plink.l_next, &newvma->vma_plink);
+
+        newvma->vma_gap = newvma->vma_start - _vma_end_before(map, newvma);
+        map->vmm_root = _vma_tree_insert(map->vmm_root, newvma);
+
+        if (NULL != (next = _vma_next(map, newvma))) {
+                next->vma_gap = next->vma_start - newvma->vma_end;
+                _vma_tree_refresh(map->vmm_root, next);
+        }
+}
+
+/* Take a vmarea out of an address space without freeing it or touching
+ * its mmobj. */
+void
+vmmap_unlink(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *next;
+
+        KASSERT(map == vma->vma_vmmap);
+
+        next = _vma_next(map, vma);
+        map->vmm_root = _vma_tree_remove(map->vmm_root, vma);
+        list_remove(&vma->vma_plink);
+        if (map->vmm_cache == vma)
+                map->vmm_cache = NULL;
+
+        if (NULL != next) {
+                next->vma_gap = next->vma_start - _vma_end_before(map, next);
+                _vma_tree_refresh(map->vmm_root, next);
+        }
+        vma->vma_vmmap = NULL;
 }
 
 /* Find a contiguous range of free virtual pages of length npages in
@@ -90,18 +325,68 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 int
 vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_find_range");
+        vmarea_t *vma;
+        uint32_t top;
+
+        KASSERT(VMMAP_DIR_LOHI == dir || VMMAP_DIR_HILO == dir);
+
+        if (0 == npages)
+                return -1;
+
+        /* the gap above the last area, or all of it */
+        top = list_empty(&map->vmm_list) ? VMMAP_LOW
+              : (list_tail(&map->vmm_list, vmarea_t, vma_plink))->vma_end;
+        if ((VMMAP_DIR_HILO == dir) && (VMMAP_HIGH - top >= npages))
+                return VMMAP_HIGH - npages;
+
+        vma = map->vmm_root;
+        if (_vma_maxgap(vma) >= npages) {
+                for (;;) {
+                        vmarea_t *first = (VMMAP_DIR_LOHI == dir) ? vma->vma_left : vma->vma_right;
+                        vmarea_t *second = (VMMAP_DIR_LOHI == dir) ? vma->vma_right : vma->vma_left;
+
+                        if (_vma_maxgap(first) >= npages) {
+                                vma = first;
+                        } else if (vma->vma_gap >= npages) {
+                                break;
+                        } else {
+                                KASSERT(_vma_maxgap(second) >= npages);
+                                vma = second;
+                        }
+                }
+                if (VMMAP_DIR_LOHI == dir)
+                        return vma->vma_start - vma->vma_gap;
+                return vma->vma_start - npages;
+        }
+
+        if ((VMMAP_DIR_LOHI == dir) && (VMMAP_HIGH - top >= npages))
+                return top;
         return -1;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
- * return NULL. */
+/* Find the vm_area that vfn lies in. Areas are looked up in the tree,
+ * and the last one found is tried first, since faults tend to come in
+ * runs in the same area. If the page is unmapped, return NULL. */
 vmarea_t *
 vmmap_lookup(vmmap_t *map, uint32_t vfn)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_lookup");
-        return NULL;
+        vmarea_t *vma = map->vmm_cache;
+
+        if ((NULL != vma) && (vma->vma_start <= vfn) && (vfn < vma->vma_end))
+                return vma;
+
+        vma = map->vmm_root;
+        while (NULL != vma) {
+                if (vfn < vma->vma_start)
+                        vma = vma->vma_left;
+                else if (vfn >= vma->vma_end)
+                        vma = vma->vma_right;
+                else
+                        break;
+        }
+        if (NULL != vma)
+                map->vmm_cache = vma;
+        return vma;
 }
 
 /* Allocates a new vmmap containing a new vmarea for each area in the
@@ -191,8 +476,11 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 int
 vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
 {
-        NOT_YET_IMPLEMENTED("VM: vmmap_is_range_empty");
-        return 0;
+        /* the last area starting below the end of the range is the only
+         * one that can overlap it */
+        vmarea_t *vma = _vma_below(map, startvfn + npages);
+
+        return (NULL == vma) || (vma->vma_end <= startvfn);
 }
 
 /* Read into 'buf' from the virtual address space of 'map' starting at
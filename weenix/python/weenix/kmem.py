@@ -57,10 +57,9 @@ class SlabAllocator:
 		return int(self._value["sa_objsize"])
 
 	def slabs(self):
-		next = self._value["sa_slabs"]
-		while (next != 0):
-			yield Slab(self._value, next.dereference())
-			next = next.dereference()["s_next"]
+		for lname in ["sa_partial", "sa_full", "sa_free"]:
+			for link in weenix.list.List(self._value[lname], "struct slab", "s_link"):
+				yield Slab(self._value, link.item())
 
 	def objs(self, typ=None):
 		for slab in self.slabs():
@@ -100,4 +99,8 @@ def freepages():
 				freepages[order] += count
 			else:
 				freepages[order] = count
+	# single pages held back from the free lists by page_free
+	freepages[0] = freepages.get(0, 0) + int(gdb.parse_and_eval("page_nhot"))
+	# and the free pages zerod has already zeroed
+	freepages[0] = freepages.get(0, 0) + int(gdb.parse_and_eval("page_nzeroed"))
 	return freepages
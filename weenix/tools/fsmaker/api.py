@@ -3,14 +3,25 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 5
+S5_OLDEST_VERSION = 3
+S5_BITMAP_VERSION = 4
+S5_INDIRECT_VERSION = 5
 S5_BLOCK_SIZE = 4096
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
 
 S5_NBLKS_PER_FNODE = 30
 S5_NDIRECT_BLOCKS = 28
 S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
+# from S5_INDIRECT_VERSION on the last two direct block slots hold the
+# double and triple indirect blocks
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE / 4
+S5_DINDIRECT_SLOT = S5_NDIRECT_BLOCKS - 2
+S5_TINDIRECT_SLOT = S5_NDIRECT_BLOCKS - 1
+S5_MAX_OFF_BLOCKS = 0x7fffffff / S5_BLOCK_SIZE
+
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
@@ -68,7 +79,9 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
+        if (self._simdisk.has_bitmap()):
+            self._simdisk.set_block_used(self._blockno, False)
+        elif (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
             self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
             self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
         else:
@@ -180,46 +193,145 @@ class Inode:
             res += "links: {0}\n".format(self.get_link_count())
         if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             res += "size:  {0} bytes".format(self.get_size())
-            if (self.get_size() > S5_MAX_FILE_SIZE):
-                res += " (INVALID, max file size is {0})".format(S5_MAX_FILE_SIZE)
+            if (self.get_size() > self.get_max_size()):
+                res += " (INVALID, max file size is {0})".format(self.get_max_size())
             elif (self.get_type() == S5_TYPE_DIR and self.get_size() % S5_DIRENT_SIZE != 0):
                 res += " (INVALID, directory size must be multiple of dirent size ({0}))".format(S5_DIRENT_SIZE)
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
-            res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
-            for i in xrange(S5_NDIRECT_BLOCKS):
+            res += "direct blocks ({0}):\n".format(self._ndirect())
+            for i in xrange(self._ndirect()):
                 res += " {0:5}".format(self.get_direct_blockno(i))
                 if ((i + 1) % 4 == 0):
                     res += "\n"
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            if (self._nlevels() > 1):
+                res += "double indirect block: {0}\n".format(self._get_root(2))
+                res += "triple indirect block: {0}\n".format(self._get_root(3))
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
         return res
 
+    def _ndirect(self):
+        if (self._simdisk.get_version() >= S5_INDIRECT_VERSION):
+            return S5_DINDIRECT_SLOT
+        return S5_NDIRECT_BLOCKS
+
+    def _nlevels(self):
+        return 3 if self._simdisk.get_version() >= S5_INDIRECT_VERSION else 1
+
+    def get_max_blocks(self):
+        res = self._ndirect()
+        for level in xrange(1, self._nlevels() + 1):
+            res += S5_NIDIRECT_BLOCKS ** level
+        return min(res, S5_MAX_OFF_BLOCKS)
+
+    def get_max_size(self):
+        return self.get_max_blocks() * S5_BLOCK_SIZE
+
+    def _get_root(self, level):
+        if (level == 1):
+            return self.get_indirect_blockno()
+        return self.get_direct_blockno(S5_DINDIRECT_SLOT + level - 2)
+
+    def _set_root(self, level, val):
+        if (level == 1):
+            self.set_indirect_blockno(val)
+        else:
+            self.set_direct_blockno(S5_DINDIRECT_SLOT + level - 2, val)
+
+    def _indirect_path(self, blockloc):
+        # returns the level of the indirect tree holding file block
+        # blockloc and the slot to follow in each indirect block, top down
+        rel = blockloc - self._ndirect()
+        level = 1
+        while (rel >= S5_NIDIRECT_BLOCKS ** level):
+            rel -= S5_NIDIRECT_BLOCKS ** level
+            level += 1
+        return level, [ (rel / S5_NIDIRECT_BLOCKS ** l) % S5_NIDIRECT_BLOCKS for l in reversed(xrange(level)) ]
+
+    def _bmap(self, blockloc, alloc=False):
+        # returns the disk block holding file block blockloc, 0 if it is
+        # sparse; if alloc is set the block (and any indirect blocks on
+        # the way to it) are allocated instead
+        blockloc = int(blockloc)
+        if (blockloc >= self.get_max_blocks()):
+            raise S5fsException("block index {0} greater than max {1}".format(blockloc, self.get_max_blocks()))
+        if (blockloc < self._ndirect()):
+            blockno = self.get_direct_blockno(blockloc)
+            if (blockno == 0 and alloc):
+                block = self._simdisk.alloc_block()
+                block.zero()
+                blockno = block.get_blockno()
+                self.set_direct_blockno(blockloc, blockno)
+            return blockno
+        level, slots = self._indirect_path(blockloc)
+        blockno = self._get_root(level)
+        if (blockno == 0):
+            if (not alloc):
+                return 0
+            block = self._simdisk.alloc_block()
+            block.zero()
+            blockno = block.get_blockno()
+            self._set_root(level, blockno)
+        for slot in slots:
+            indirect = self._simdisk.get_block(blockno)
+            blockno = struct.unpack("I", indirect.read(slot * 4, 4))[0]
+            if (blockno == 0):
+                if (not alloc):
+                    return 0
+                block = self._simdisk.alloc_block()
+                block.zero()
+                blockno = block.get_blockno()
+                indirect.write(slot * 4, struct.pack("I", blockno))
+        return blockno
+
+    def _unmap(self, blockloc):
+        # frees file block blockloc, if it is allocated, and then any
+        # indirect blocks that no longer point to anything
+        if (blockloc >= self.get_max_blocks()):
+            return
+        if (blockloc < self._ndirect()):
+            blockno = self.get_direct_blockno(blockloc)
+            if (blockno != 0):
+                self._simdisk.get_block(blockno).free()
+                self.set_direct_blockno(blockloc, 0)
+            return
+        level, slots = self._indirect_path(blockloc)
+        blockno = self._get_root(level)
+        path = []
+        for slot in slots:
+            if (blockno == 0):
+                return
+            path.append((blockno, slot))
+            blockno = struct.unpack("I", self._simdisk.get_block(blockno).read(slot * 4, 4))[0]
+        if (blockno == 0):
+            return
+        self._simdisk.get_block(blockno).free()
+        for indirectno, slot in reversed(path):
+            indirect = self._simdisk.get_block(indirectno)
+            indirect.write(slot * 4, struct.pack("I", 0))
+            if (indirect.read() != '\0' * S5_BLOCK_SIZE):
+                return
+            indirect.free()
+        self._set_root(level, 0)
+
     def read(self, offset=0, size=None):
         if (size == None):
             size = self.get_size()
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
-        size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
+        size = min(size, min(self.get_max_size(), self.get_size()) - offset)
         res = ""
         while (size > 0):
             blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
+            blockno = self._bmap(blockno)
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -232,34 +344,14 @@ class Inode:
     def write(self, offset, data):
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
-        if (offset + len(data) > S5_MAX_FILE_SIZE):
-            raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
+        if (offset + len(data) > self.get_max_size()):
+            raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), self.get_max_size()))
         remaining = len(data)
         while (remaining > 0):
             blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._bmap(blockloc, True))
             if (remaining == ammount):
                 block.write(blockoff, data[-remaining:])
             else:
@@ -270,36 +362,11 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
+        target = int(math.floor((size - 1) / S5_BLOCK_SIZE))
+        curr = int(math.floor(self.get_size() / S5_BLOCK_SIZE))
         while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
+            self._unmap(curr)
             curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
-            else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
         self.set_size(size)
 
     def _find_dirent(self, name, types=S5_TYPES):
@@ -458,9 +525,28 @@ class Inode:
             return curr.create(path[-1])
         return last
 
+    def _free_indirect(self, blockno, level):
+        indirect = self._simdisk.get_block(blockno)
+        for slot in xrange(S5_NIDIRECT_BLOCKS):
+            child = struct.unpack("I", indirect.read(slot * 4, 4))[0]
+            if (child == 0):
+                continue
+            if (level > 1):
+                self._free_indirect(child, level - 1)
+            else:
+                self._simdisk.get_block(child).free()
+        indirect.free()
+
     def free(self):
         if (self.get_size() != 0):
             self.truncate()
+        # a write that ran out of space can leave indirect blocks past
+        # the end of the file
+        if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
+            for level in xrange(1, self._nlevels() + 1):
+                if (self._get_root(level) != 0):
+                    self._free_indirect(self._get_root(level), level)
+                    self._set_root(level, 0)
         self.set_type(S5_TYPE_FREE)
         self.set_next_free(self._simdisk.get_free_inode())
         self._simdisk.set_free_inode(self._number)
@@ -536,13 +622,71 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_num_blocks(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_num_blocks(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_nblocks(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_nblocks(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_nfree_blocks(self):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_nfree_blocks(self, val):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def has_bitmap(self):
+        return self.get_version() >= S5_BITMAP_VERSION
+
+    def _bitmap_location(self, blockno):
+        return self.get_bitmap_block() * S5_BLOCK_SIZE + int(blockno / 8), 1 << (blockno % 8)
+
+    def is_block_used(self, blockno):
+        offset, mask = self._bitmap_location(blockno)
+        self._simfile.seek(offset)
+        return (ord(self._simfile.read(1)) & mask) != 0
+
+    def set_block_used(self, blockno, used):
+        if (used == self.is_block_used(blockno)):
+            raise S5fsException("block {0} is already {1}".format(blockno, "in use" if used else "free"))
+        offset, mask = self._bitmap_location(blockno)
+        self._simfile.seek(offset)
+        byte = ord(self._simfile.read(1))
+        self._simfile.seek(offset)
+        self._simfile.write(chr(byte | mask if used else byte & ~mask))
+        self.set_nfree_blocks(self.get_nfree_blocks() + (-1 if used else 1))
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
-        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
+        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if S5_OLDEST_VERSION <= self.get_version() <= S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
         res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
+        if (self.has_bitmap()):
+            res += "num blocks: {0}\n".format(self.get_num_blocks())
+            res += "bitmap:     {0} block(s) at block {1}\n".format(self.get_bitmap_nblocks(), self.get_bitmap_block())
+            res += "free blocks: {0}\n".format(self.get_nfree_blocks())
+            return res
         res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
         for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
             res += "  {0}".format(self.get_free_block(i))
@@ -560,8 +704,9 @@ class Simdisk:
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        bblocks = int(math.floor((blocks - 1) / S5_BITS_PER_BLOCK) + 1)
+        if (iblocks + bblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bblocks) * S5_BLOCK_SIZE))
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -577,20 +722,18 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
+        # the free block list is left empty, the bitmap (which follows
+        # the inode blocks) says which blocks are free
         self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in xrange(iblocks, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in xrange(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+        self.set_nfree(0)
+        self.set_num_blocks(blocks)
+        self.set_bitmap_block(iblocks + 1)
+        self.set_bitmap_nblocks(bblocks)
+        self.set_nfree_blocks(blocks)
+        for num in xrange(bblocks):
+            self.get_block(iblocks + 1 + num).zero()
+        for num in xrange(iblocks + 1 + bblocks):
+            self.set_block_used(num, True)
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
@@ -631,6 +774,8 @@ class Simdisk:
         return Block(self, offset, index)
 
     def alloc_block(self):
+        if (self.has_bitmap()):
+            return self._alloc_block_bitmap()
         if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
             raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
         if (self.get_nfree() == 0):
@@ -647,5 +792,15 @@ class Simdisk:
             self.set_nfree(self.get_nfree() - 1)
             return self.get_block(self.get_free_block(self.get_nfree()))
 
+    def _alloc_block_bitmap(self):
+        # files are written one at a time, so taking the lowest free
+        # block keeps each of them contiguous
+        start = self.get_bitmap_block() + self.get_bitmap_nblocks()
+        for num in xrange(start, self.get_num_blocks()):
+            if (not self.is_block_used(num)):
+                self.set_block_used(num, True)
+                return self.get_block(num)
+        raise S5fsDiskSpaceException()
+
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
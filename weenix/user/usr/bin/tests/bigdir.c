@@ -0,0 +1,115 @@
+/*
+ * Exercises lookups in a large directory: makes one directory with many
+ * entries (hard links to a single file, so it fits the default disk's
+ * inode count), looks every name up, removes every other entry from the
+ * end (which moves entries around), checks that exactly the right names
+ * are left both by lookup and by getdents(), and removes the rest. The
+ * number of entries can be given on the command line.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+
+#include <test/test.h>
+
+#define DIR_NAME        "bigdir"
+#define TARGET          "bigdir/target"
+#define DEFAULT_COUNT   10000
+
+static char path[64];
+
+static const char *entry_path(int i)
+{
+        snprintf(path, sizeof(path), DIR_NAME "/e%d", i);
+        return path;
+}
+
+/* Count the entries of DIR_NAME other than ".", ".." and TARGET */
+static int count_entries(void)
+{
+        struct dirent d;
+        int fd, n = 0;
+
+        fd = open(DIR_NAME, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", DIR_NAME);
+        while (0 < getdents(fd, &d, sizeof(d))) {
+                if (strcmp(d.d_name, ".") && strcmp(d.d_name, "..")
+                    && strcmp(d.d_name, "target"))
+                        ++n;
+        }
+        close(fd);
+        return n;
+}
+
+int main(int argc, char **argv)
+{
+        struct stat st;
+        int count, i, fd, bad;
+
+        if (argc > 2) {
+                fprintf(stderr, "USAGE: bigdir [count]\n");
+                return 1;
+        }
+        count = (2 == argc) ? atoi(argv[1]) : DEFAULT_COUNT;
+
+        test_init();
+
+        test_assert(0 == mkdir(DIR_NAME, 0777), "mkdir(\"%s\")", DIR_NAME);
+        if (0 > (fd = open(TARGET, O_RDWR | O_CREAT, 0))) {
+                printf("open(\"%s\"): %s\n", TARGET, strerror(errno));
+                return 1;
+        }
+        close(fd);
+
+        bad = 0;
+        for (i = 0; i < count; ++i) {
+                if (0 != link(TARGET, entry_path(i)))
+                        ++bad;
+        }
+        test_assert(0 == bad, "create %d entries: %d failed", count, bad);
+        test_assert(0 != link(TARGET, entry_path(count / 2)) && EEXIST == errno,
+                    "duplicate link fails with EEXIST");
+
+        bad = 0;
+        for (i = 0; i < count; ++i) {
+                if (0 != stat(entry_path(i), &st))
+                        ++bad;
+        }
+        test_assert(0 == bad, "look up %d entries: %d missing", count, bad);
+        test_assert(0 != stat(entry_path(count), &st) && ENOENT == errno,
+                    "missing entry fails with ENOENT");
+
+        bad = 0;
+        for (i = count - 1; i >= 0; i -= 2) {
+                if (0 != unlink(entry_path(i)))
+                        ++bad;
+        }
+        test_assert(0 == bad, "unlink every other entry: %d failed", bad);
+
+        bad = 0;
+        for (i = 0; i < count; ++i) {
+                int found = (0 == stat(entry_path(i), &st));
+                if (found != ((count - 1 - i) % 2 == 1))
+                        ++bad;
+        }
+        test_assert(0 == bad, "look up after unlink: %d wrong", bad);
+        test_assert(count / 2 == count_entries(), "getdents after unlink");
+
+        bad = 0;
+        for (i = 0; i < count; ++i) {
+                if ((count - 1 - i) % 2 == 1 && 0 != unlink(entry_path(i)))
+                        ++bad;
+        }
+        test_assert(0 == bad, "unlink the rest: %d failed", bad);
+        test_assert(0 == unlink(TARGET), "unlink(\"%s\")", TARGET);
+        test_assert(0 == rmdir(DIR_NAME), "rmdir(\"%s\")", DIR_NAME);
+
+        test_fini();
+        return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Exercises large reads and writes: writes a file in chunks of many
+ * pages that do not start or end on page boundaries, leaves a sparse hole
+ * in the middle, overwrites part of it in place, and reads it all back
+ * with chunk sizes that do not line up with the writes. Every byte is
+ * checked, and the holes must read as zeros. Run the kshell "pframe"
+ * command before and after to see the page cache hit counts.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <test/test.h>
+
+#include "iotest.h"
+
+#define BIG_FILE        "bigrw-file"
+#define WRITE_CHUNK     (37 * IOTEST_PAGE + 123)
+#define READ_CHUNK      (23 * IOTEST_PAGE + 1001)
+#define HOLE_START      (3 * WRITE_CHUNK)
+#define HOLE_END        (HOLE_START + 40 * IOTEST_PAGE + 17)
+#define FILE_SIZE       (HOLE_END + 2 * WRITE_CHUNK)
+
+static char buf[WRITE_CHUNK];
+
+static int write_range(int fd, int start, int end, int seed)
+{
+        int pos, n;
+
+        for (pos = start; pos < end; pos += n) {
+                n = (end - pos < WRITE_CHUNK) ? end - pos : WRITE_CHUNK;
+                iotest_fill(buf, seed, pos, n);
+                lseek(fd, pos, SEEK_SET);
+                if (n != write(fd, buf, n))
+                        return -1;
+        }
+        return 0;
+}
+
+/* The seed the byte at pos was last written with, 0 for the hole */
+static int (*expected_seed)(int pos);
+
+static int seed_first(int pos)
+{
+        return (pos >= HOLE_START && pos < HOLE_END) ? 0 : 1;
+}
+
+static int seed_second(int pos)
+{
+        if (pos >= IOTEST_PAGE / 2 && pos < IOTEST_PAGE / 2 + WRITE_CHUNK)
+                return 2;
+        return seed_first(pos);
+}
+
+static void check_file(const char *what)
+{
+        int fd, pos, n, i, seed, bad = 0;
+
+        fd = open(BIG_FILE, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", BIG_FILE);
+        for (pos = 0; pos < FILE_SIZE; pos += n) {
+                n = read(fd, buf, READ_CHUNK);
+                test_assert(0 < n, "read at %d", pos);
+                if (0 >= n)
+                        break;
+                for (i = 0; i < n; ++i) {
+                        seed = expected_seed(pos + i);
+                        if (buf[i] != (seed ? iotest_byte(seed, pos + i) : 0))
+                                ++bad;
+                }
+        }
+        test_assert(FILE_SIZE == pos, "%s: read %d of %d bytes", what, pos, FILE_SIZE);
+        test_assert(0 == read(fd, buf, READ_CHUNK), "read at end of file");
+        test_assert(0 == bad, "%s: %d bad bytes", what, bad);
+        close(fd);
+}
+
+int main(int argc, char **argv)
+{
+        struct stat st;
+        int fd;
+
+        if (argc != 1) {
+                fprintf(stderr, "USAGE: bigrw\n");
+                return 1;
+        }
+
+        test_init();
+
+        if (0 > (fd = open(BIG_FILE, O_RDWR | O_CREAT, 0))) {
+                printf("open(\"%s\"): %s\n", BIG_FILE, strerror(errno));
+                return 1;
+        }
+
+        test_assert(0 == write_range(fd, 0, HOLE_START, 1), "write before hole");
+        test_assert(0 == write_range(fd, HOLE_END, FILE_SIZE, 1), "write after hole");
+        test_assert(0 == stat(BIG_FILE, &st) && FILE_SIZE == st.st_size, "file size");
+        expected_seed = seed_first;
+        check_file("first write");
+
+        /* overwrite in place; the size must not change */
+        test_assert(0 == write_range(fd, IOTEST_PAGE / 2, IOTEST_PAGE / 2 + WRITE_CHUNK, 2),
+                    "overwrite");
+        test_assert(0 == stat(BIG_FILE, &st) && FILE_SIZE == st.st_size, "size after overwrite");
+        expected_seed = seed_second;
+        check_file("overwrite");
+
+        close(fd);
+        test_assert(0 == unlink(BIG_FILE), "unlink(\"%s\")", BIG_FILE);
+
+        test_fini();
+        return 0;
+}
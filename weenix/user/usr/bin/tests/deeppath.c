@@ -0,0 +1,94 @@
+/*
+ * Exercises path resolution through the name lookup cache: builds a deep
+ * chain of directories, repeatedly stats and opens a file at the bottom
+ * and a name that does not exist there, and checks that creating,
+ * renaming and removing names is seen by the lookups that follow (so no
+ * stale positive or negative entries are used). Run the kshell "dcache"
+ * command before and after to see the hit counts. The number of
+ * repetitions can be given on the command line.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <test/test.h>
+
+#define DEPTH           16
+#define DEFAULT_REPS    1000
+
+static char dirs[DEPTH][DEPTH * 4 + 1];
+static char file[DEPTH * 4 + 16];
+static char missing[DEPTH * 4 + 16];
+static char renamed[DEPTH * 4 + 16];
+
+int main(int argc, char **argv)
+{
+        struct stat st;
+        int reps, i, fd, bad;
+
+        if (argc > 2) {
+                fprintf(stderr, "USAGE: deeppath [repetitions]\n");
+                return 1;
+        }
+        reps = (2 == argc) ? atoi(argv[1]) : DEFAULT_REPS;
+
+        test_init();
+
+        for (i = 0; i < DEPTH; ++i) {
+                if (0 == i)
+                        strcpy(dirs[i], "dp");
+                else
+                        snprintf(dirs[i], sizeof(dirs[i]), "%s/d%d", dirs[i - 1], i);
+                test_assert(0 == mkdir(dirs[i], 0777), "mkdir(\"%s\")", dirs[i]);
+        }
+        snprintf(file, sizeof(file), "%s/file", dirs[DEPTH - 1]);
+        snprintf(missing, sizeof(missing), "%s/missing", dirs[DEPTH - 1]);
+        snprintf(renamed, sizeof(renamed), "%s/renamed", dirs[DEPTH - 1]);
+
+        test_assert(0 <= (fd = open(file, O_RDWR | O_CREAT, 0)), "create \"%s\"", file);
+        close(fd);
+
+        bad = 0;
+        for (i = 0; i < reps; ++i) {
+                if (0 != stat(file, &st))
+                        ++bad;
+                if (0 > (fd = open(file, O_RDONLY, 0)))
+                        ++bad;
+                else
+                        close(fd);
+                if (0 == stat(missing, &st) || ENOENT != errno)
+                        ++bad;
+        }
+        test_assert(0 == bad, "%d deep lookups: %d wrong", reps, bad);
+
+        /* a cached negative entry must not hide a new file */
+        test_assert(0 <= (fd = open(missing, O_RDWR | O_CREAT, 0)), "create \"%s\"", missing);
+        close(fd);
+        test_assert(0 == stat(missing, &st), "stat new file");
+
+        /* nor a cached positive entry keep a removed one */
+        test_assert(0 == unlink(missing), "unlink(\"%s\")", missing);
+        test_assert(0 != stat(missing, &st) && ENOENT == errno, "stat removed file");
+
+        test_assert(0 == rename(file, renamed), "rename(\"%s\")", file);
+        test_assert(0 != stat(file, &st) && ENOENT == errno, "stat old name");
+        test_assert(0 == stat(renamed, &st), "stat new name");
+        test_assert(0 == unlink(renamed), "unlink(\"%s\")", renamed);
+
+        /* a directory removed and made again is a new, empty directory */
+        test_assert(0 == rmdir(dirs[DEPTH - 1]), "rmdir(\"%s\")", dirs[DEPTH - 1]);
+        test_assert(0 != stat(file, &st) && ENOENT == errno, "stat in removed directory");
+        test_assert(0 == mkdir(dirs[DEPTH - 1], 0777), "mkdir(\"%s\")", dirs[DEPTH - 1]);
+        test_assert(0 != stat(renamed, &st) && ENOENT == errno, "stat in new directory");
+
+        for (i = DEPTH - 1; i >= 0; --i)
+                test_assert(0 == rmdir(dirs[i]), "rmdir(\"%s\")", dirs[i]);
+
+        test_fini();
+        return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Exercises the block request queue with several processes doing I/O at
+ * once: each child writes its own file, syncs, and reads it back several
+ * times while the others do the same, then checks every byte. Half the
+ * children write their files back to front, so the queue sees requests
+ * from all over the disk. Run the kshell "blockq" command before and
+ * after to see how many requests were merged and the longest wait. The
+ * number of processes can be given on the command line.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <test/test.h>
+
+#include "iotest.h"
+
+#define FILE_PAGES      48
+#define READ_PASSES     4
+#define DEFAULT_PROCS   4
+#define MAX_PROCS       8
+
+static char buf[IOTEST_PAGE];
+
+/* Returns the number of bad pages */
+static int child_run(int child)
+{
+        char name[32];
+        int fd, page, i, pass, bad = 0;
+
+        snprintf(name, sizeof(name), "iomix-%d", child);
+        if (0 > (fd = open(name, O_RDWR | O_CREAT, 0)))
+                return FILE_PAGES;
+
+        for (i = 0; i < FILE_PAGES; ++i) {
+                page = (child % 2) ? FILE_PAGES - 1 - i : i;
+                iotest_fill(buf, child, page * IOTEST_PAGE, IOTEST_PAGE);
+                lseek(fd, page * IOTEST_PAGE, SEEK_SET);
+                if (IOTEST_PAGE != write(fd, buf, IOTEST_PAGE))
+                        ++bad;
+        }
+        sync();
+
+        for (pass = 0; pass < READ_PASSES; ++pass) {
+                lseek(fd, 0, SEEK_SET);
+                for (page = 0; page < FILE_PAGES; ++page) {
+                        if ((IOTEST_PAGE != read(fd, buf, IOTEST_PAGE))
+                            || iotest_check(buf, child, page * IOTEST_PAGE, IOTEST_PAGE))
+                                ++bad;
+                }
+        }
+
+        close(fd);
+        if (0 != unlink(name))
+                ++bad;
+        return bad;
+}
+
+int main(int argc, char **argv)
+{
+        int nprocs, i, status, bad;
+        pid_t pid;
+
+        if (argc > 2) {
+                fprintf(stderr, "USAGE: iomix [processes]\n");
+                return 1;
+        }
+        nprocs = (2 == argc) ? atoi(argv[1]) : DEFAULT_PROCS;
+        if (nprocs < 1 || nprocs > MAX_PROCS) {
+                fprintf(stderr, "iomix: between 1 and %d processes\n", MAX_PROCS);
+                return 1;
+        }
+
+        test_init();
+
+        for (i = 0; i < nprocs; ++i) {
+                if (0 > (pid = fork())) {
+                        printf("fork: %s\n", strerror(errno));
+                        return 1;
+                }
+                if (0 == pid)
+                        exit(child_run(i) ? 1 : 0);
+        }
+
+        bad = 0;
+        for (i = 0; i < nprocs; ++i) {
+                if (0 > wait(&status) || 0 != status)
+                        ++bad;
+        }
+        test_assert(0 == bad, "%d processes: %d saw bad data", nprocs, bad);
+
+        test_fini();
+        return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+ * Shared by the file I/O tests (readahead, writeback, bigrw, iomix):
+ * the data they write, and how to check what they read back.
+ */
+
+/* Shared header trickery */
+#include "page.h"
+
+/* The kernel's page size, as an int so that it mixes with file offsets */
+#define IOTEST_PAGE     ((int) PAGE_SIZE)
+
+/* Byte at position pos of data written with the given seed. Neighbouring
+ * pages, and the same page written with different seeds, all differ. */
+static char iotest_byte(int seed, int pos)
+{
+        return (char)(pos * 7 + (pos / IOTEST_PAGE) * 31 + seed * 29);
+}
+
+/* Fill buf with the len bytes written at position pos with seed */
+static void iotest_fill(char *buf, int seed, int pos, int len)
+{
+        int i;
+
+        for (i = 0; i < len; ++i)
+                buf[i] = iotest_byte(seed, pos + i);
+}
+
+/* The number of bytes of buf that differ from what iotest_fill() would
+ * have put there */
+static int iotest_check(const char *buf, int seed, int pos, int len)
+{
+        int i, bad = 0;
+
+        for (i = 0; i < len; ++i) {
+                if (buf[i] != iotest_byte(seed, pos + i))
+                        ++bad;
+        }
+        return bad;
+}
@@ -0,0 +1,119 @@
+/*
+ * Exercises sequential readahead: reads a large file front to back with
+ * several request sizes, then backwards and with a stride (which must
+ * turn readahead off). Every byte read is checked. Run the kshell
+ * "pframe" command before and after to see the hit, miss and readahead
+ * counters.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <test/test.h>
+
+#include "iotest.h"
+
+#define BIG_FILE        "readahead-big"
+#define BIG_PAGES       128
+
+static char buf[IOTEST_PAGE * 2];
+
+static int make_file(const char *name, int npages, int seed)
+{
+        int fd, pos;
+
+        if (0 > (fd = open(name, O_RDWR | O_CREAT, 0))) {
+                printf("open(\"%s\"): %s\n", name, strerror(errno));
+                return -1;
+        }
+        for (pos = 0; pos < npages * IOTEST_PAGE; pos += IOTEST_PAGE) {
+                iotest_fill(buf, seed, pos, IOTEST_PAGE);
+                if (IOTEST_PAGE != write(fd, buf, IOTEST_PAGE)) {
+                        printf("write(\"%s\"): %s\n", name, strerror(errno));
+                        close(fd);
+                        return -1;
+                }
+        }
+        close(fd);
+        return 0;
+}
+
+/* Read len bytes at pos and check them; returns the number of bad bytes */
+static int check_read(int fd, int seed, int pos, int len)
+{
+        int got;
+
+        lseek(fd, pos, SEEK_SET);
+        got = read(fd, buf, len);
+        test_assert(got == len, "read %d bytes at %d, got %d", len, pos, got);
+        return (0 < got) ? iotest_check(buf, seed, pos, got) : 0;
+}
+
+static void test_sequential(int chunk)
+{
+        int fd, pos, bad = 0;
+
+        fd = open(BIG_FILE, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", BIG_FILE);
+        for (pos = 0; pos < BIG_PAGES * IOTEST_PAGE; pos += chunk)
+                bad += check_read(fd, 1, pos, MIN(chunk, BIG_PAGES * IOTEST_PAGE - pos));
+        test_assert(0 == bad, "sequential read in %d byte chunks: %d bad bytes", chunk, bad);
+        close(fd);
+}
+
+static void test_backwards(void)
+{
+        int fd, page, bad = 0;
+
+        fd = open(BIG_FILE, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", BIG_FILE);
+        for (page = BIG_PAGES - 1; page >= 0; --page)
+                bad += check_read(fd, 1, page * IOTEST_PAGE, IOTEST_PAGE);
+        test_assert(0 == bad, "backwards read: %d bad bytes", bad);
+        close(fd);
+}
+
+static void test_stride(void)
+{
+        int fd, page, start, bad = 0;
+
+        fd = open(BIG_FILE, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", BIG_FILE);
+        for (start = 0; start < 7; ++start) {
+                for (page = start; page < BIG_PAGES; page += 7)
+                        bad += check_read(fd, 1, page * IOTEST_PAGE + 100, 200);
+        }
+        test_assert(0 == bad, "strided read: %d bad bytes", bad);
+        close(fd);
+}
+
+int main(int argc, char **argv)
+{
+        if (argc != 1) {
+                fprintf(stderr, "USAGE: readahead\n");
+                return 1;
+        }
+
+        test_init();
+
+        if (0 > make_file(BIG_FILE, BIG_PAGES, 1))
+                return 1;
+
+        test_sequential(IOTEST_PAGE);
+        test_sequential(1000);
+        test_sequential(IOTEST_PAGE * 2);
+        test_backwards();
+        test_stride();
+        /* a second pass should find everything read ahead or cached */
+        test_sequential(IOTEST_PAGE);
+
+        test_assert(0 == unlink(BIG_FILE), "unlink(\"%s\")", BIG_FILE);
+
+        test_fini();
+        return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Exercises clustered writeback: writes a large file front to back,
+ * rewrites it backwards and every other page (so the dirty runs are
+ * broken up), and calls sync() after each pass. After every sync the
+ * disk itself is read through its block device, which bypasses the page
+ * cache, and every page of the file must be found there with the data
+ * of its last write. Run the kshell "pframe" command before and after to
+ * compare the number of pages written with the number of requests.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <test/test.h>
+
+#include "iotest.h"
+
+#define BIG_FILE        "writeback-big"
+#define BIG_PAGES       128
+#define DISK            "/dev/hda0"
+
+/* Each page starts with a tag saying which page of which run of the test
+ * it is and which pass wrote it, so that it can be recognized on disk;
+ * the rest is the usual pattern. */
+#define TAG_MAGIC       0x77626b21
+#define TAG_SIZE        ((int) (4 * sizeof(int)))
+
+static char buf[IOTEST_PAGE];
+static int run;
+
+static int write_page(int fd, int page, int seed)
+{
+        int *tag = (int *) buf;
+
+        iotest_fill(buf, seed, page * IOTEST_PAGE, IOTEST_PAGE);
+        tag[0] = TAG_MAGIC;
+        tag[1] = run;
+        tag[2] = page;
+        tag[3] = seed;
+        lseek(fd, page * IOTEST_PAGE, SEEK_SET);
+        return write(fd, buf, IOTEST_PAGE);
+}
+
+/* Write the file back, then look for each page of it on the disk;
+ * seeds[page] is the pass that last wrote the page */
+static void check_disk(const int *seeds, const char *what)
+{
+        char found[BIG_PAGES];
+        int *tag = (int *) buf;
+        int fd, block, page, nfound = 0;
+
+        sync();
+
+        fd = open(DISK, O_RDONLY, 0);
+        test_assert(0 <= fd, "open(\"%s\")", DISK);
+        if (0 > fd)
+                return;
+        memset(found, 0, sizeof(found));
+        for (block = 0; nfound < BIG_PAGES; ++block) {
+                lseek(fd, block * IOTEST_PAGE, SEEK_SET);
+                if (IOTEST_PAGE != read(fd, buf, IOTEST_PAGE))
+                        break;
+                if ((TAG_MAGIC != tag[0]) || (run != tag[1]))
+                        continue;
+                page = tag[2];
+                if ((0 > page) || (BIG_PAGES <= page) || found[page]
+                    || (seeds[page] != tag[3]))
+                        continue;
+                if (0 == iotest_check(buf + TAG_SIZE, seeds[page],
+                                      page * IOTEST_PAGE + TAG_SIZE,
+                                      IOTEST_PAGE - TAG_SIZE)) {
+                        found[page] = 1;
+                        ++nfound;
+                }
+        }
+        close(fd);
+        test_assert(BIG_PAGES == nfound, "%s: %d of %d pages on disk",
+                    what, nfound, BIG_PAGES);
+}
+
+int main(int argc, char **argv)
+{
+        int seeds[BIG_PAGES];
+        int fd, page, bad;
+
+        if (argc != 1) {
+                fprintf(stderr, "USAGE: writeback\n");
+                return 1;
+        }
+
+        test_init();
+        /* so that blocks left on disk by an earlier run do not count
+         * (a run that finishes also clears its tags, below) */
+        run = getpid();
+
+        if (0 > (fd = open(BIG_FILE, O_RDWR | O_CREAT, 0))) {
+                printf("open(\"%s\"): %s\n", BIG_FILE, strerror(errno));
+                return 1;
+        }
+
+        bad = 0;
+        for (page = 0; page < BIG_PAGES; ++page) {
+                seeds[page] = 1;
+                if (IOTEST_PAGE != write_page(fd, page, 1))
+                        ++bad;
+        }
+        test_assert(0 == bad, "sequential write: %d short writes", bad);
+        check_disk(seeds, "sequential write");
+
+        bad = 0;
+        for (page = BIG_PAGES - 1; page >= 0; --page) {
+                seeds[page] = 2;
+                if (IOTEST_PAGE != write_page(fd, page, 2))
+                        ++bad;
+        }
+        test_assert(0 == bad, "backwards write: %d short writes", bad);
+        check_disk(seeds, "backwards write");
+
+        bad = 0;
+        for (page = 0; page < BIG_PAGES; page += 2) {
+                seeds[page] = 3;
+                if (IOTEST_PAGE != write_page(fd, page, 3))
+                        ++bad;
+        }
+        test_assert(0 == bad, "alternate page write: %d short writes", bad);
+        check_disk(seeds, "alternate page write");
+
+        /* leave no tagged blocks behind once the file is freed */
+        memset(buf, 0, sizeof(buf));
+        for (page = 0; page < BIG_PAGES; ++page) {
+                lseek(fd, page * IOTEST_PAGE, SEEK_SET);
+                write(fd, buf, IOTEST_PAGE);
+        }
+        sync();
+
+        close(fd);
+        test_assert(0 == unlink(BIG_FILE), "unlink(\"%s\")", BIG_FILE);
+
+        test_fini();
+        return 0;
+}